@@ -0,0 +1,54 @@
+// Counts heap allocations of json-util. Linked into benchmark build with
+// `-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc`, so only calls made by main.c are counted (not the ones made
+// inside libc). Counts are written at exit to file given by `JSON_UTIL_BENCH_ALLOCS` environment variable as
+// "<allocations> <bytes>".
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+
+
+// updated from worker threads too
+static unsigned long long allocations = 0;
+static unsigned long long allocated_bytes = 0;
+
+
+void count_allocation(size_t size) {
+	__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&allocated_bytes, size, __ATOMIC_RELAXED);
+}
+
+
+void* __wrap_malloc(size_t size) {
+	count_allocation(size);
+	return __real_malloc(size);
+}
+
+
+void* __wrap_calloc(size_t count, size_t size) {
+	count_allocation(count * size);
+	return __real_calloc(count, size);
+}
+
+
+// every resize is counted as allocation of the new size, even if it is done in place
+void* __wrap_realloc(void* ptr, size_t size) {
+	count_allocation(size);
+	return __real_realloc(ptr, size);
+}
+
+
+__attribute__((destructor)) void write_allocation_counts() {
+	const char* path = getenv("JSON_UTIL_BENCH_ALLOCS");
+	if(path == NULL || *path == '\0') return;
+
+	FILE* file = fopen(path, "w");
+	if(file == NULL) return;
+
+	fprintf(file, "%llu %llu\n", allocations, allocated_bytes);
+	fclose(file);
+}
@@ -0,0 +1,219 @@
+// Runs json-util actions against benchmark corpus and reports throughput, peak memory and allocations as JSON.
+// Every case is run `runs` times in a fresh process with input file as `stdin` (so it is memory-mapped, as usual)
+// and output discarded. The fastest run is reported, since slower ones only add noise of the machine.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+
+struct bench_case {
+	const char* input; // file in corpus directory
+	const char* arguments[8]; // options and action, NULL-terminated
+};
+
+const struct bench_case cases[] = {
+	{ "wide.json", { "check" } },
+	{ "deep.json", { "check" } },
+	{ "strings.json", { "check" } },
+	{ "numbers.json", { "check" } },
+	{ "wide.json", { "get", "key0100000" } },
+	{ "deep.json", { "get", "9999.a.0.a" } },
+	{ "numbers.json", { "get", "799999" } },
+	{ "wide.json", { "set", "key0100000" } },
+	{ "deep.json", { "--compact", "set", "0" } },
+	{ "numbers.json", { "--compact", "splice", "0", "1" } },
+	{ "strings.json", { "splice", "0", "1" } },
+	{ "wide.json", { "keys" } },
+	{ "text.txt", { "encode-string" } },
+	{ "string.json", { "decode-string" } },
+	{ "records.ndjson", { "--lines", "check" } },
+	{ "records.ndjson", { "--lines", "get", "nested.b.c" } },
+	{ "records.ndjson", { "--lines", "--jobs", "0", "get", "nested.b.c" } },
+	{ "records.ndjson", { "--lines", "--group-by", "group", "aggregate", "n" } },
+};
+
+
+struct bench_result {
+	int status; // exit status of failed run, 0 if all succeeded
+	double seconds; // of the fastest run
+	long max_rss; // KiB
+	unsigned long long allocations;
+	unsigned long long allocated_bytes;
+};
+
+
+double seconds_since(const struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+// Runs json-util once and updates result. Returns -1 if process could not be run.
+int run_case(const char* binary, const char* input_path, const char* allocs_path, const struct bench_case* bench_case, struct bench_result* result) {
+	const char* argv[10] = { binary };
+	size_t i;
+	for(i = 0; bench_case->arguments[i]; i++) argv[i + 1] = bench_case->arguments[i];
+
+	unlink(allocs_path);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if(pid < 0) return -1;
+
+	if(pid == 0) {
+		int in = open(input_path, O_RDONLY);
+		int out = open("/dev/null", O_WRONLY);
+		if(in < 0 || out < 0 || dup2(in, 0) < 0 || dup2(out, 1) < 0) _exit(127);
+		close(in);
+		close(out);
+
+		// action must be run by this process, not forwarded to a server
+		unsetenv("JSON_UTIL_SERVER");
+		setenv("JSON_UTIL_BENCH_ALLOCS", allocs_path, 1);
+
+		execv(binary, (char* const*) argv);
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	while(wait4(pid, &status, 0, &usage) < 0) {
+		if(errno != EINTR) return -1;
+	}
+
+	double seconds = seconds_since(&start);
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+		result->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		return 0;
+	}
+
+	if(result->seconds == 0 || seconds < result->seconds) result->seconds = seconds;
+	if(usage.ru_maxrss > result->max_rss) result->max_rss = usage.ru_maxrss;
+
+	// missing if binary is built without allocation counting
+	FILE* allocs = fopen(allocs_path, "r");
+	if(allocs) {
+		if(fscanf(allocs, "%llu %llu", &result->allocations, &result->allocated_bytes) != 2) {
+			result->allocations = result->allocated_bytes = 0;
+		}
+		fclose(allocs);
+	}
+
+	return 0;
+}
+
+
+void print_string(FILE* out, const char* string) {
+	fputc('"', out);
+	for(; *string; string++) {
+		if(*string == '"' || *string == '\\') fputc('\\', out);
+		if((unsigned char) *string < 0x20) fprintf(out, "\\u%04x", *string);
+		else fputc(*string, out);
+	}
+	fputc('"', out);
+}
+
+
+int main(int argc, const char* const* argv) {
+	unsigned int runs = 5;
+	const char* output_path = NULL;
+	int argi = 1;
+
+	while(argi + 1 < argc && argv[argi][0] == '-') {
+		if(strcmp(argv[argi], "-r") == 0) runs = (unsigned int) strtoul(argv[argi + 1], NULL, 10);
+		else if(strcmp(argv[argi], "-o") == 0) output_path = argv[argi + 1];
+		else break;
+		argi += 2;
+	}
+
+	if(argc - argi != 2 || runs < 1) {
+		fprintf(stderr, "Usage: %s [-r runs] [-o output] json-util corpus-directory\n", argv[0]);
+		return 1;
+	}
+
+	const char* binary = argv[argi];
+	const char* corpus = argv[argi + 1];
+
+	char allocs_path[64];
+	snprintf(allocs_path, sizeof(allocs_path), "/tmp/json-util-bench-allocs.%d", (int) getpid());
+
+	FILE* out = output_path ? fopen(output_path, "w") : stdout;
+	if(out == NULL) {
+		fprintf(stderr, "%s: Cannot open %s: (%d) %s\n", argv[0], output_path, errno, strerror(errno));
+		return 1;
+	}
+
+	int status = 0;
+	size_t i, j;
+
+	fprintf(out, "{\n\t\"binary\": ");
+	print_string(out, binary);
+	fprintf(out, ",\n\t\"runs\": %u,\n\t\"results\": [", runs);
+
+	for(i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+		const struct bench_case* bench_case = &cases[i];
+		struct bench_result result = { 0 };
+
+		char input_path[4096];
+		snprintf(input_path, sizeof(input_path), "%s/%s", corpus, bench_case->input);
+
+		struct stat input_stat;
+		if(stat(input_path, &input_stat)) {
+			fprintf(stderr, "%s: Cannot read %s: (%d) %s\n", argv[0], input_path, errno, strerror(errno));
+			return 1;
+		}
+
+		unsigned int run;
+		for(run = 0; run < runs && !result.status; run++) {
+			if(run_case(binary, input_path, allocs_path, bench_case, &result)) {
+				fprintf(stderr, "%s: Cannot run %s: (%d) %s\n", argv[0], binary, errno, strerror(errno));
+				return 1;
+			}
+		}
+
+		double megabytes = (double) input_stat.st_size / 1e6;
+		double throughput = result.status ? 0 : megabytes / result.seconds;
+
+		// readable summary while the cases run
+		fprintf(stderr, "%-16s", bench_case->input);
+		for(j = 0; bench_case->arguments[j]; j++) fprintf(stderr, " %s", bench_case->arguments[j]);
+		if(result.status) fprintf(stderr, ": failed with status %d\n", result.status);
+		else fprintf(stderr, ": %.1f MB/s, %ld KiB, %llu allocations\n", throughput, result.max_rss, result.allocations);
+
+		if(result.status) status = 1;
+
+		fprintf(out, "%s\n\t\t{\"input\": ", i ? "," : "");
+		print_string(out, bench_case->input);
+		fprintf(out, ", \"arguments\": [");
+		for(j = 0; bench_case->arguments[j]; j++) {
+			if(j) fprintf(out, ", ");
+			print_string(out, bench_case->arguments[j]);
+		}
+		fprintf(out, "], \"status\": %d, \"bytes\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"max_rss_kib\": %ld, \"allocations\": %llu, \"allocated_bytes\": %llu}",
+			result.status, (long long) input_stat.st_size, result.seconds, throughput, result.max_rss, result.allocations, result.allocated_bytes);
+	}
+
+	fprintf(out, "\n\t]\n}\n");
+
+	unlink(allocs_path);
+
+	if(output_path && fclose(out)) {
+		fprintf(stderr, "%s: Error writing %s: (%d) %s\n", argv[0], output_path, errno, strerror(errno));
+		return 1;
+	}
+
+	return status;
+}
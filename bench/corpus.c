@@ -0,0 +1,268 @@
+// Generates benchmark corpus into given directory. Output depends only on `scale`, so results of different
+// builds are comparable. At scale 1 files have 4-13 MB.
+//
+//   wide.json      single object with many members of mixed types
+//   deep.json      array of values nested 100 levels deep
+//   strings.json   array of long strings with escapes and non-ASCII characters
+//   numbers.json   array of integers and floating-point numbers
+//   records.ndjson JSON Lines of small records
+//   text.txt       raw UTF-8 text for encode-string
+//   string.json    single long encoded string for decode-string
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+
+/************/
+/** Random **/
+/************/
+
+// xorshift64* with fixed seed
+uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+uint64_t random_next() {
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+
+// Returns number in [0, n)
+unsigned int random_below(unsigned int n) {
+	return (unsigned int) ((random_next() >> 32) % n);
+}
+
+
+/************/
+/** Values **/
+/************/
+
+const char* const words[] = {
+	"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+	"incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua",
+};
+
+// UTF-8 text, JSON escape of it
+const char* const specials[][2] = {
+	{ "\n", "\\n" },
+	{ "\t", "\\t" },
+	{ "\"", "\\\"" },
+	{ "\\", "\\\\" },
+	{ "/", "\\/" },
+	{ "\xc3\xa9", "\\u00e9" },
+	{ "\xc3\xa9", "\xc3\xa9" },
+	{ "\xe2\x82\xac", "\xe2\x82\xac" },
+	{ "\xf0\x9f\x98\x80", "\\ud83d\\ude00" },
+	{ "\xf0\x9f\x98\x80", "\xf0\x9f\x98\x80" },
+};
+
+
+// Writes text of about `length` bytes: mostly words with occasional special characters
+void write_text(FILE* file, size_t length, int escaped) {
+	size_t written = 0;
+
+	while(written < length) {
+		const char* part;
+
+		if(random_below(8) == 0) {
+			part = specials[random_below(sizeof(specials) / sizeof(*specials))][escaped ? 1 : 0];
+		} else {
+			part = words[random_below(sizeof(words) / sizeof(*words))];
+			fputc(' ', file);
+			written++;
+		}
+
+		fputs(part, file);
+		written += strlen(part);
+	}
+}
+
+
+void write_number(FILE* file) {
+	switch(random_below(5)) {
+	case 0:
+		fprintf(file, "%u", random_below(100));
+		break;
+	case 1:
+		fprintf(file, "%lld", (long long) random_next() >> random_below(64));
+		break;
+	case 2:
+		fprintf(file, "%.17g", (double) random_next() / 1e6);
+		break;
+	case 3:
+		fprintf(file, "-%u.%03u", random_below(100000), random_below(1000));
+		break;
+	default:
+		fprintf(file, "%u.%ue%s%u", random_below(10), random_below(1000000), random_below(2) ? "-" : "+", random_below(300));
+		break;
+	}
+}
+
+
+void write_scalar(FILE* file) {
+	switch(random_below(6)) {
+	case 0:
+	case 1:
+		write_number(file);
+		break;
+	case 2:
+		fputc('"', file);
+		write_text(file, 4 + random_below(40), 1);
+		fputc('"', file);
+		break;
+	case 3:
+		fputs(random_below(2) ? "true" : "false", file);
+		break;
+	case 4:
+		fputs("null", file);
+		break;
+	default:
+		fputs("[1, 2.5, \"x\"]", file);
+		break;
+	}
+}
+
+
+/************/
+/** Corpus **/
+/************/
+
+void write_wide(FILE* file, unsigned int scale) {
+	unsigned int i, n = 200000 * scale;
+
+	fputc('{', file);
+	for(i = 0; i < n; i++) {
+		fprintf(file, "%s\n\t\"key%07u\": ", i ? "," : "", i);
+		write_scalar(file);
+	}
+	fputs("\n}\n", file);
+}
+
+
+void write_deep(FILE* file, unsigned int scale) {
+	unsigned int i, depth, n = 10000 * scale;
+
+	fputc('[', file);
+	for(i = 0; i < n; i++) {
+		if(i) fputc(',', file);
+
+		// alternating objects and arrays
+		for(depth = 0; depth < 100; depth++) fputs(depth % 2 ? "[" : "{\"a\":", file);
+		write_number(file);
+		for(depth = 100; depth-- > 0;) fputc(depth % 2 ? ']' : '}', file);
+	}
+	fputs("]\n", file);
+}
+
+
+void write_strings(FILE* file, unsigned int scale) {
+	unsigned int i, n = 4000 * scale;
+
+	fputc('[', file);
+	for(i = 0; i < n; i++) {
+		fputs(i ? ",\n\"" : "\n\"", file);
+		write_text(file, 1000 + random_below(3000), 1);
+		fputc('"', file);
+	}
+	fputs("\n]\n", file);
+}
+
+
+void write_numbers(FILE* file, unsigned int scale) {
+	unsigned int i, n = 800000 * scale;
+
+	fputc('[', file);
+	for(i = 0; i < n; i++) {
+		if(i) fputs(i % 16 ? ", " : ",\n", file);
+		write_number(file);
+	}
+	fputs("]\n", file);
+}
+
+
+void write_records(FILE* file, unsigned int scale) {
+	unsigned int i, n = 80000 * scale;
+
+	for(i = 0; i < n; i++) {
+		fprintf(file, "{\"id\":%u,\"group\":\"g%u\",\"n\":", i, random_below(16));
+		write_number(file);
+		fputs(",\"name\":\"", file);
+		write_text(file, 10 + random_below(30), 1);
+		fputs("\",\"tags\":[", file);
+		write_scalar(file);
+		fputc(',', file);
+		write_scalar(file);
+		fputs("],\"nested\":{\"a\":", file);
+		write_scalar(file);
+		fputs(",\"b\":{\"c\":", file);
+		write_scalar(file);
+		fputs("}}}\n", file);
+	}
+}
+
+
+void write_raw_text(FILE* file, unsigned int scale) {
+	write_text(file, 8000000 * (size_t) scale, 0);
+}
+
+
+void write_string(FILE* file, unsigned int scale) {
+	fputc('"', file);
+	write_text(file, 8000000 * (size_t) scale, 1);
+	fputs("\"\n", file);
+}
+
+
+const struct {
+	const char* name;
+	void (*write)(FILE*, unsigned int);
+} corpus[] = {
+	{ "wide.json", write_wide },
+	{ "deep.json", write_deep },
+	{ "strings.json", write_strings },
+	{ "numbers.json", write_numbers },
+	{ "records.ndjson", write_records },
+	{ "text.txt", write_raw_text },
+	{ "string.json", write_string },
+};
+
+
+int main(int argc, const char* const* argv) {
+	if(argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s directory [scale]\n", argv[0]);
+		return 1;
+	}
+
+	unsigned int scale = argc > 2 ? (unsigned int) strtoul(argv[2], NULL, 10) : 1;
+	if(scale < 1 || scale > 1000) {
+		fprintf(stderr, "%s: Invalid scale %s\n", argv[0], argv[2]);
+		return 1;
+	}
+
+	size_t i;
+	for(i = 0; i < sizeof(corpus) / sizeof(*corpus); i++) {
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", argv[1], corpus[i].name);
+
+		FILE* file = fopen(path, "w");
+		if(file == NULL) {
+			fprintf(stderr, "%s: Cannot open %s: (%d) %s\n", argv[0], path, errno, strerror(errno));
+			return 1;
+		}
+
+		// every file starts from the same state, so adding a file does not change the others
+		random_state = 0x9e3779b97f4a7c15ULL + i;
+		corpus[i].write(file, scale);
+
+		if(fclose(file)) {
+			fprintf(stderr, "%s: Error writing %s: (%d) %s\n", argv[0], path, errno, strerror(errno));
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -7,11 +7,21 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <pthread.h>
 
 enum json_error {
 	JSON_ERROR_OK = 0,
 	JSON_ERROR_UNEXPECTED_END,
-	JSON_ERROR_UNEXPECTED_TOKEN
+	JSON_ERROR_UNEXPECTED_TOKEN,
+	JSON_ERROR_TOO_DEEP,
 };
 
 enum json_type {
@@ -22,34 +32,50 @@ enum json_type {
 	JSON_TYPE_ARRAY,
 	JSON_TYPE_BOOLEAN,
 	JSON_TYPE_NULL,
+	JSON_TYPE_UNPARSED, // pseudotype - valid JSON text that is parsed only when needed
 };
 
 struct whitespace {
-	char* content;
+	const char* content;
 	size_t length;
 };
 
 struct json_string {
-	char* content;
+	const char* content;
 	size_t length;
+	int escaped; // content contains escape sequences
+};
+
+enum json_number_flags {
+	JSON_NUMBER_CONVERTED = 1, // `value` holds converted number
+	JSON_NUMBER_INTEGER = 2, // number is an integer and its magnitude fits into `value.integer`
+	JSON_NUMBER_NEGATIVE = 4,
 };
 
 struct json_number {
-	char* content;
+	const char* content;
 	size_t length;
+	unsigned int flags;
+	union {
+		uint64_t integer;
+		double real;
+	} value;
 };
 
+// `capacity` is the number of members storage has room for. Storage shared with other values (e.g. documents kept
+// by server) has capacity 0 and is copied before any change, see `json_object_reserve`.
 struct json_object {
 	struct json_string* keys;
 	struct json_value* values;
-	size_t length;
+	size_t length, capacity;
+	struct json_object_index* index; // built on lookup in large objects, see `json_object_resolve`
 //	struct whitespace* whitespaces;
 //	unsigned int whitespaces_length;
 };
 
 struct json_array {
 	struct json_value* values;
-	size_t length;
+	size_t length, capacity;
 //	struct whitespace* whitespaces;
 //	unsigned int whitespaces_length;
 };
@@ -58,6 +84,11 @@ struct json_boolean {
 	int value;
 };
 
+struct json_unparsed {
+	const char* content;
+	size_t length;
+};
+
 struct json_value {
 	enum json_type type;
 	union {
@@ -66,6 +97,7 @@ struct json_value {
 		struct json_boolean boolean;
 		struct json_array array;
 		struct json_object object;
+		struct json_unparsed unparsed;
 	} value;
 };
 
@@ -77,12 +109,15 @@ struct json_value {
 
 struct buffer {
 	char* content;
-	unsigned int length, size;
+	size_t length, size;
 };
 
 
-void buffer_append(struct buffer* buffer, const char* content, unsigned int length) {
-	unsigned int new_length = length + buffer->length;
+void buffer_append(struct buffer* buffer, const char* content, size_t length) {
+	// empty buffer has no content to copy into
+	if(length == 0) return;
+
+	size_t new_length = length + buffer->length;
 
 	if(buffer->size < new_length) {
 		if(buffer->size == 0) {
@@ -108,1044 +143,6853 @@ void buffer_append_char(struct buffer* buffer, char content) {
 }
 
 
-/*****************/
-/** JSON parser **/
-/*****************/
+// Makes sure that buffer can hold at least `size` bytes without reallocation
+void buffer_reserve(struct buffer* buffer, size_t size) {
+	if(buffer->size < size) {
+		if(size < buffer->size * 2) size = buffer->size * 2;
+		buffer->content = realloc(buffer->content, size);
+		buffer->size = size;
+	}
+}
 
 
-enum json_error json_parser_scan_whitespace(const char** in, const char* end, struct whitespace* out);
-enum json_error json_parser_scan_value(const char** in, const char* end, struct json_value* out);
-enum json_error json_parser_scan_string(const char** in, const char* end, struct json_string* out);
-enum json_error json_parser_scan_number(const char** in, const char* end, struct json_number* out);
-enum json_error json_parser_scan_object(const char** in, const char* end, struct json_object* out);
-enum json_error json_parser_scan_array(const char** in, const char* end, struct json_array* out);
-enum json_error json_parser_scan_boolean(const char** in, const char* end, struct json_boolean* out);
-enum json_error json_parser_scan_null(const char** in, const char* end);
+/***************************/
+/** Output implementation **/
+/***************************/
+
 
+#define OUTPUT_BUFFER_SIZE (256<<10)
+#define OUTPUT_INDENT_LEVELS 64
+
+// Output sink. Writes are collected in `buffer` and flushed to `fd` once it fills up;
+// with `fd` < 0 nothing is flushed and the buffer keeps everything written.
+struct output {
+	int fd;
+	struct buffer buffer;
+	struct buffer scratch; // reusable space for decoded strings
+	char* indentation; // "\n" followed by one indent per level
+	unsigned int indentation_levels;
+	const char* indent;
+	size_t indent_length;
+	int error; // errno of the first failed write
+	int invalid; // some string could not be encoded
+	// value printer for selected formatting style
+	void (*print)(struct output*, const struct json_value*, unsigned int);
+	struct output_unparsed* unparsed; // scratch parser for unparsed values, allocated on first one
+};
 
-enum json_error json_parser_scan_whitespace(const char** in, const char* end, struct whitespace* out) {
 
-	assert(*in < end);
+void output_unparsed_free(struct output_unparsed*);
 
-	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
 
-	while(*in < end) {
-		if(**in != 0x20 && **in != 0x09 && **in != 0x0A && **in != 0x0D) {
-			break;
+// Writes all `count` buffers to `fd`, resuming after partial writes
+int output_writev(int fd, struct iovec* iov, int count) {
+	while(count > 0) {
+		ssize_t r = writev(fd, iov, count);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+
+		while(count > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			count--;
 		}
-		if(out) buffer_append(&buffer, *in, 1);
-		(*in)++;
-	}
 
-	if(buffer.length != 0) {
-		out->content = buffer.content;
-		out->length = buffer.length;
+		if(count > 0) {
+			iov->iov_base = (char*)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
 	}
 
-	return JSON_ERROR_OK;
+	return 0;
 }
 
 
-enum json_error json_parser_scan_object(const char** in, const char* end, struct json_object* out) {
-
-	assert(*in < end);
+void output_init(struct output* out, int fd) {
+	out->fd = fd;
+	out->buffer.content = NULL;
+	out->buffer.length = out->buffer.size = 0;
+	out->scratch = out->buffer;
+	out->indentation = NULL;
+	out->indentation_levels = 0;
+	out->indent = "\t";
+	out->indent_length = 1;
+	out->error = 0;
+	out->invalid = 0;
+	out->print = NULL;
+	out->unparsed = NULL;
+
+	if(fd >= 0) buffer_reserve(&out->buffer, OUTPUT_BUFFER_SIZE);
+}
 
-	if(**in != '{') return JSON_ERROR_OK;
 
-	(*in)++;
+void output_flush(struct output* out) {
+	if(out->fd < 0 || out->buffer.length == 0) return;
 
-	struct json_string* keys = NULL;
-	struct json_value* values = NULL;
-	unsigned int size = 0, length = 0;
-//	struct whitespace* whitespaces = NULL;
-//	unsigned int whitespaces_size = 0, whitespaces_length = 0;
+	struct iovec iov = { .iov_base = out->buffer.content, .iov_len = out->buffer.length };
+	if(output_writev(out->fd, &iov, 1) && !out->error) out->error = errno;
 
-	enum json_error error;
+	out->buffer.length = 0;
+}
 
-	const char* tmp_pos;
-	struct whitespace whitespace = { .length = 0 };
 
-	while(*in < end) {
+void output_free(struct output* out) {
+	output_flush(out);
+	free(out->buffer.content);
+	free(out->scratch.content);
+	free(out->indentation);
+	output_unparsed_free(out->unparsed);
+}
 
-		json_parser_scan_whitespace(in, end, &whitespace);
-//		if(whitespace.length) {
-//			whitespace.length = 0;
-//		}
 
-		if(*in >= end) goto unexpected_end;
+// Flushes once the buffer is full; used after writes that append to `buffer` directly
+void output_check(struct output* out) {
+	if(out->buffer.length >= OUTPUT_BUFFER_SIZE && out->fd >= 0) output_flush(out);
+}
 
-		struct json_string key;
-		tmp_pos = *in;
-		error = json_parser_scan_string(in, end, &key);
-		if(error) goto error;
-		if(*in == tmp_pos) break;
-		if(*in >= end) goto unexpected_end;
 
-		json_parser_scan_whitespace(in, end, &whitespace);
-//		if(whitespace.length) {
-//			whitespace.length = 0;
-//		}
+void output_write(struct output* out, const char* content, size_t length) {
+	// deletions and other empty parts have no content to copy
+	if(length == 0) return;
 
-		if(*in >= end) goto unexpected_end;
+	if(out->buffer.length + length <= out->buffer.size) {
+		memcpy(out->buffer.content + out->buffer.length, content, length);
+		out->buffer.length += length;
+		output_check(out);
+		return;
+	}
 
-		if(**in != ':') {
-			error = JSON_ERROR_UNEXPECTED_TOKEN;
-			goto error;
-		}
+	// large writes go out together with the buffered data, without being copied
+	if(out->fd >= 0 && length >= OUTPUT_BUFFER_SIZE / 2) {
+		struct iovec iov[2] = {
+			{ .iov_base = out->buffer.content, .iov_len = out->buffer.length },
+			{ .iov_base = (void*)content, .iov_len = length },
+		};
+		if(output_writev(out->fd, iov, 2) && !out->error) out->error = errno;
+		out->buffer.length = 0;
+		return;
+	}
 
-		(*in)++;
-		if(*in >= end) goto unexpected_end;
+	output_flush(out);
+	buffer_append(&out->buffer, content, length);
+}
 
-		json_parser_scan_whitespace(in, end, &whitespace);
-//		if(whitespace.length) {
-//			whitespace.length = 0;
-//		}
 
-		if(*in >= end) goto unexpected_end;
+void output_char(struct output* out, char c) {
+	if(out->buffer.length < out->buffer.size) {
+		out->buffer.content[out->buffer.length++] = c;
+		output_check(out);
+	} else {
+		output_write(out, &c, 1);
+	}
+}
 
-		struct json_value value;
-		tmp_pos = *in;
-		error = json_parser_scan_value(in, end, &value);
-		if(error) goto error;
-		if(*in == tmp_pos) {
-			error = JSON_ERROR_UNEXPECTED_TOKEN;
-			goto error;
-		}
 
-		if(size < length + 1) {
-			if(size == 0) {
-				size = 1;
-				keys = malloc(sizeof(struct json_string));
-				values = malloc(sizeof(struct json_value));
-			} else {
-				size *= 2;
-				keys = realloc(keys, sizeof(struct json_string) * size);
-				values = realloc(values, sizeof(struct json_value) * size);
-			}
-		}
+void output_string(struct output* out, const char* string) {
+	output_write(out, string, strlen(string));
+}
 
-		keys[length] = key;
-		values[length] = value;
-		length++;
 
-		if(*in >= end) goto unexpected_end;
+// Line break followed by indentation of given level, written with one copy from a precomputed string
+void output_newline(struct output* out, unsigned int level) {
+	if(level >= out->indentation_levels) {
+		unsigned int levels = out->indentation_levels ? out->indentation_levels : OUTPUT_INDENT_LEVELS;
+		while(levels <= level) levels *= 2;
 
-		tmp_pos = *in;
-		json_parser_scan_whitespace(in, end, &whitespace);
-//		if(whitespace.length) {
-//			whitespace.length = 0;
-//		}
+		out->indentation = realloc(out->indentation, 1 + levels * out->indent_length);
+		out->indentation[0] = '\n';
+		unsigned int i;
+		for(i = 0; i < levels; i++) {
+			memcpy(out->indentation + 1 + i * out->indent_length, out->indent, out->indent_length);
+		}
+		out->indentation_levels = levels;
+	}
 
-		if(*in >= end) goto unexpected_end;
+	output_write(out, out->indentation, 1 + level * out->indent_length);
+}
 
-		if(**in != ',') break;
 
-		(*in)++;
-	}
+/**************************/
+/** Arena implementation **/
+/**************************/
 
-	if(*in >= end) goto unexpected_end;
 
-	if(**in != '}') {
-		error = JSON_ERROR_UNEXPECTED_TOKEN;
-		goto error;
-	}
+#define ARENA_CHUNK_SIZE (64 << 10)
+#define ARENA_MAX_CHUNK_SIZE (64 << 20)
+#define ARENA_HUGE_PAGE_SIZE (2 << 20)
+#define ARENA_ALIGNMENT 16
 
-	(*in)++;
 
-	out->keys = keys;
-	out->values = values;
-	out->length = length;
-//	out->whitespaces = whitespaces;
-//	out->whitespaces_length = whitespaces_length;
+// Bump-pointer allocator owning everything that belongs to parsed document. Memory is released
+// only all at once with `arena_free`.
+struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size, used;
+	int mapped;
+	_Alignas(ARENA_ALIGNMENT) char content[];
+};
 
-	return JSON_ERROR_OK;
+struct arena {
+	struct arena_chunk* chunk;
+	size_t chunk_size; // size of next chunk
+	int huge_pages; // back large chunks with transparent huge pages
+};
 
- unexpected_end:
 
- 	error = JSON_ERROR_UNEXPECTED_END;
+struct arena_chunk* arena_chunk_create(struct arena* arena, size_t size) {
+	struct arena_chunk* chunk;
+	size_t total = sizeof(struct arena_chunk) + size;
 
- error:
+	if(arena->huge_pages && total >= ARENA_HUGE_PAGE_SIZE) {
+		total = (total + ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1);
+		chunk = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(chunk == MAP_FAILED) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(chunk, total, MADV_HUGEPAGE);
+#endif
+		chunk->mapped = 1;
+	} else {
+		chunk = malloc(total);
+		if(chunk == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		chunk->mapped = 0;
+	}
 
-	free(keys);
-	free(values);
-//	free(whitespaces);
+	chunk->size = total - sizeof(struct arena_chunk);
+	chunk->used = 0;
 
- 	return error;
+	return chunk;
 }
 
 
-enum json_error json_parser_scan_array(const char** in, const char* end, struct json_array* out) {
+void* arena_alloc(struct arena* arena, size_t size) {
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
 
-	assert(*in < end);
+	struct arena_chunk* chunk = arena->chunk;
 
-	if(**in != '[') return JSON_ERROR_OK;
+	if(chunk == NULL || chunk->size - chunk->used < size) {
+		if(arena->chunk_size == 0) arena->chunk_size = ARENA_CHUNK_SIZE;
 
-	(*in)++;
+		if(size > arena->chunk_size) {
+			// oversized allocation gets its own chunk behind current one so rest of current chunk is not wasted
+			chunk = arena_chunk_create(arena, size);
+			if(arena->chunk) {
+				chunk->next = arena->chunk->next;
+				arena->chunk->next = chunk;
+			} else {
+				chunk->next = NULL;
+				arena->chunk = chunk;
+			}
+			chunk->used = size;
+			return chunk->content;
+		}
 
-	struct json_value* values = NULL;
-	unsigned int size = 0, length = 0;
-//	struct whitespace* whitespaces = NULL;
-//	unsigned int whitespaces_size = 0, whitespaces_length = 0;
+		chunk = arena_chunk_create(arena, arena->chunk_size);
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
 
-	enum json_error error;
+		if(arena->chunk_size < ARENA_MAX_CHUNK_SIZE) arena->chunk_size *= 2;
+	}
 
-	const char* tmp_pos;
-	struct whitespace whitespace = { .length = 0 };
+	void* out = chunk->content + chunk->used;
+	chunk->used += size;
 
-	while(*in < end) {
+	return out;
+}
 
-		json_parser_scan_whitespace(in, end, &whitespace);
-//		if(whitespace.length) {
-//			whitespace.length = 0;
-//		}
 
-		if(*in >= end) goto unexpected_end;
+void* arena_copy(struct arena* arena, const void* content, size_t size) {
+	if(size == 0) return NULL;
+	return memcpy(arena_alloc(arena, size), content, size);
+}
 
-		struct json_value value;
-		tmp_pos = *in;
-		error = json_parser_scan_value(in, end, &value);
-		if(error) goto error;
-		if(*in == tmp_pos) {
-			if(length == 0) break;
-			error = JSON_ERROR_UNEXPECTED_TOKEN;
-			goto error;
-		}
 
-		if(size < length + 1) {
-			if(size == 0) {
-				size = 1;
-				values = malloc(sizeof(struct json_value));
-			} else {
-				size *= 2;
-				values = realloc(values, sizeof(struct json_value) * size);
-			}
-		}
+// Arena memory cannot be resized in place - content is moved to new allocation and old one is abandoned
+void* arena_realloc(struct arena* arena, void* content, size_t old_size, size_t new_size) {
+	void* out = arena_alloc(arena, new_size);
+	if(old_size) memcpy(out, content, old_size < new_size ? old_size : new_size);
+	return out;
+}
 
-		values[length] = value;
-		length++;
 
-		if(*in >= end) goto unexpected_end;
+void arena_free(struct arena* arena) {
+	struct arena_chunk* chunk = arena->chunk;
 
-		tmp_pos = *in;
-		json_parser_scan_whitespace(in, end, &whitespace);
-//		if(whitespace.length) {
-//			whitespace.length = 0;
-//		}
+	while(chunk) {
+		struct arena_chunk* next = chunk->next;
+		if(chunk->mapped) {
+			munmap(chunk, sizeof(struct arena_chunk) + chunk->size);
+		} else {
+			free(chunk);
+		}
+		chunk = next;
+	}
 
-		if(*in >= end) goto unexpected_end;
+	arena->chunk = NULL;
+}
 
-		if(**in != ',') break;
 
-		(*in)++;
-	}
+// Releases all allocations, but keeps current chunk for reuse, so arena used for many small documents in turn
+// does not go back to the allocator for each of them
+void arena_reset(struct arena* arena) {
+	struct arena_chunk* chunk = arena->chunk;
 
-	if(*in >= end) goto unexpected_end;
+	if(chunk == NULL) return;
 
-	if(**in != ']') {
-		error = JSON_ERROR_UNEXPECTED_TOKEN;
-		goto error;
-	}
+	struct arena head = { .chunk = chunk->next };
+	arena_free(&head);
 
-	(*in)++;
-	out->values = values;
-	out->length = length;
-//	out->whitespaces = whitespaces;
-//	out->whitespaces_length = whitespaces_length;
+	chunk->next = NULL;
+	chunk->used = 0;
+}
 
-	return JSON_ERROR_OK;
 
- unexpected_end:
+// Returns number of bytes held by arena
+size_t arena_usage(const struct arena* arena) {
+	size_t usage = 0;
+	const struct arena_chunk* chunk;
 
- 	error = JSON_ERROR_UNEXPECTED_END;
+	for(chunk = arena->chunk; chunk; chunk = chunk->next) {
+		usage += sizeof(struct arena_chunk) + chunk->size;
+	}
 
- error:
+	return usage;
+}
 
-	free(values);
-//	free(whitespaces);
 
- 	return error;
+/*********************************/
+/** Whitespace and string index **/
+/*********************************/
 
-}
 
+// Input is classified 64 bytes at a time (SIMD when available) into bitmaps of unescaped quotes, whitespace outside
+// of strings and bytes inside strings that need closer look (escapes, control and non-ASCII characters).
+// Bitmaps are built for a window of input at a time, sequentially, as the parser advances. They are used only to skip
+// whitespace and to find the end of a string without looking at each byte. Structural characters (`{}[]:,`) are not
+// indexed: the parser still reads the byte after whitespace to decide what comes next, and numbers and literals are
+// scanned byte by byte.
 
-enum json_error json_parser_scan_string(const char** in, const char* end, struct json_string* out) {
-	assert(*in < end);
 
-	if(**in != '"') return JSON_ERROR_OK;
+#define JSON_INDEX_BLOCKS 1024
 
-	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
 
-	enum json_error error = 0;
+struct json_index_masks {
+	uint64_t quote, backslash, whitespace, control, non_ascii;
+};
 
-	(*in)++;
+struct json_index {
+	const char* start; // start of indexed window
+	const char* indexed_end; // end of indexed window
+	const char* end;
+	uint64_t prev_in_string, prev_escaped;
+	void (*classify)(const char*, struct json_index_masks*);
+	uint64_t (*prefix_xor)(uint64_t);
+	uint64_t quotes[JSON_INDEX_BLOCKS]; // unescaped quotes
+	uint64_t whitespace[JSON_INDEX_BLOCKS]; // whitespace outside of strings
+	uint64_t special[JSON_INDEX_BLOCKS]; // backslashes, control and non-ASCII characters inside strings
+};
 
-	while(*in < end) {
 
-		unsigned char c = **in;
+void json_index_classify_scalar(const char* in, struct json_index_masks* out) {
+	memset(out, 0, sizeof(struct json_index_masks));
 
-		if(c == '"') break;
+	int i;
+	for(i = 0; i < 64; i++) {
+		unsigned char c = in[i];
+		uint64_t bit = (uint64_t)1 << i;
+		if(c == '"') out->quote |= bit;
+		if(c == '\\') out->backslash |= bit;
+		if(c == 0x20 || c == 0x09 || c == 0x0A || c == 0x0D) out->whitespace |= bit;
+		if(c <= 0x1f || c == 0x7f) out->control |= bit;
+		if(c >= 0x80) out->non_ascii |= bit;
+	}
+}
 
-		if(c != '\\') {
 
-			if(c <= 0x1f || c == 0x7f) { // disable control characters
-				error = JSON_ERROR_UNEXPECTED_TOKEN;
-				goto error;
-			}
+// bit i of result is the XOR of bits 0..i of input
+uint64_t json_index_prefix_xor(uint64_t bits) {
+	bits ^= bits << 1;
+	bits ^= bits << 2;
+	bits ^= bits << 4;
+	bits ^= bits << 8;
+	bits ^= bits << 16;
+	bits ^= bits << 32;
+	return bits;
+}
 
-			buffer_append(&buffer, &c, 1);
 
-		} else {
+#if defined(__x86_64__) || defined(__i386__)
 
-			(*in)++;
+#include <immintrin.h>
 
-			if(*in >= end) goto unexpected_end;
 
-			// early declaration
-			uint16_t unicode_char;
-			const char* uend = *in + 5;
+__attribute__((target("sse4.2")))
+uint32_t json_index_eq_sse42(__m128i v, char c) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
 
-			switch(**in) {
-			default:
-				error = JSON_ERROR_UNEXPECTED_TOKEN;
-				goto error;
-			case '"':
-			case '\\':
-			case '/':
-				c = **in;
-				break;
-			case 'b':
-				c = '\b';
-				break;
-			case 'f':
-				c = '\f';
-				break;
-			case 'n':
-				c = '\n';
-				break;
-			case 'r':
-				c = '\r';
-				break;
-			case 't':
-				c = '\t';
-				break;
-			case 'u':
-				if(uend > end) goto unexpected_end;
-
-				(*in)++;
-
-				unicode_char = 0;
-
-				while(1) {
-					unsigned char c;
-					if(**in >= '0' && **in <= '9') c= **in - '0';
-					else if(**in >= 'a' && **in <= 'f') c = **in - 'a' + 10;
-					else if(**in >= 'A' && **in <= 'F') c = **in - 'A' + 10;
-					else {
-						error = JSON_ERROR_UNEXPECTED_TOKEN;
-						goto error;
-					}
-					unicode_char |= c;
-					(*in)++;
-					if(*in >= uend) break;
-					unicode_char <<= 4;
-				}
 
-//				printf("Unicode in: %x\n", unicode_char);
-
-				// FIXME: I guess this could be optimized/cleaned
-				if(unicode_char < 0x80) {
-//					printf("Bytes: %x\n", unicode_char);
-					buffer_append_char(&buffer, (unicode_char & 0xff));
-				} else if(unicode_char < 0x800) {
-					unsigned char firstByte = 0xc0 | (0x1f & (unicode_char >> 6));
-					unsigned char secondByte = 0x80 | (0x3f & unicode_char);
-//					printf("Bytes: %x %x\n", firstByte, secondByte);
-					buffer_append_char(&buffer, firstByte);
-					buffer_append_char(&buffer, secondByte);
-				} else {
-					unsigned char firstByte = 0xe0 | (0x1f & (unicode_char >> 12));
-					unsigned char secondByte = 0x80 | (0x3f & (unicode_char >> 6));
-					unsigned char thirdByte = 0x80 | (0x3f & unicode_char);
-//					printf("Bytes: %x %x %x\n", firstByte, secondByte, thirdByte);
-					buffer_append_char(&buffer, firstByte);
-					buffer_append_char(&buffer, secondByte);
-					buffer_append_char(&buffer, thirdByte);
-				}
-				continue;
-			}
-			buffer_append(&buffer, &c, 1);
-		}
+__attribute__((target("sse4.2")))
+void json_index_classify_sse42(const char* in, struct json_index_masks* out) {
+	memset(out, 0, sizeof(struct json_index_masks));
 
-		(*in)++;
+	int i;
+	for(i = 0; i < 4; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i * 16));
+		uint64_t whitespace = json_index_eq_sse42(v, 0x20) | json_index_eq_sse42(v, 0x09) | json_index_eq_sse42(v, 0x0A) | json_index_eq_sse42(v, 0x0D);
+		uint64_t control = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v)) | json_index_eq_sse42(v, 0x7f);
+		out->quote |= (uint64_t)json_index_eq_sse42(v, '"') << (i * 16);
+		out->backslash |= (uint64_t)json_index_eq_sse42(v, '\\') << (i * 16);
+		out->whitespace |= whitespace << (i * 16);
+		out->control |= control << (i * 16);
+		out->non_ascii |= (uint64_t)(uint32_t)_mm_movemask_epi8(v) << (i * 16);
 	}
+}
 
-	if(*in >= end) goto unexpected_end;
 
-	if(**in != '"') {
-		error = JSON_ERROR_UNEXPECTED_TOKEN;
-		goto error;
-	}
+__attribute__((target("avx2")))
+uint64_t json_index_eq_avx2(__m256i lo, __m256i hi, char c) {
+	__m256i n = _mm256_set1_epi8(c);
+	return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, n)) | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, n)) << 32;
+}
 
-	(*in)++;
 
-	out->content = buffer.content;
-	out->length = buffer.length;
+__attribute__((target("avx2")))
+void json_index_classify_avx2(const char* in, struct json_index_masks* out) {
+	__m256i lo = _mm256_loadu_si256((const __m256i*)in);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(in + 32));
+	__m256i control_max = _mm256_set1_epi8(0x1f);
 
-	return JSON_ERROR_OK;
+	out->quote = json_index_eq_avx2(lo, hi, '"');
+	out->backslash = json_index_eq_avx2(lo, hi, '\\');
+	out->whitespace = json_index_eq_avx2(lo, hi, 0x20) | json_index_eq_avx2(lo, hi, 0x09) | json_index_eq_avx2(lo, hi, 0x0A) | json_index_eq_avx2(lo, hi, 0x0D);
+	out->control = json_index_eq_avx2(lo, hi, 0x7f) |
+		(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(lo, control_max), lo)) |
+		(uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(hi, control_max), hi)) << 32;
+	out->non_ascii = (uint32_t)_mm256_movemask_epi8(lo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+}
 
- unexpected_end:
 
- 	error = JSON_ERROR_UNEXPECTED_END;
+// carry-less multiplication by all ones computes prefix XOR in one instruction
+__attribute__((target("pclmul")))
+uint64_t json_index_prefix_xor_clmul(uint64_t bits) {
+	uint64_t result;
+	// stored instead of _mm_cvtsi128_si64, which is not available on 32-bit x86
+	_mm_storel_epi64((__m128i*) &result, _mm_clmulepi64_si128(_mm_set_epi64x(0, bits), _mm_set1_epi8((char)0xff), 0));
+	return result;
+}
 
- error:
+#endif
 
-	free(buffer.content);
-	return error;
 
+void json_index_init(struct json_index* index, const char* start, const char* end) {
+	index->start = index->indexed_end = start;
+	index->end = end;
+	index->prev_in_string = index->prev_escaped = 0;
+	index->classify = json_index_classify_scalar;
+	index->prefix_xor = json_index_prefix_xor;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) index->classify = json_index_classify_avx2;
+	else if(__builtin_cpu_supports("sse4.2")) index->classify = json_index_classify_sse42;
+	if(__builtin_cpu_supports("pclmul")) index->prefix_xor = json_index_prefix_xor_clmul;
+#endif
 }
 
 
-enum json_error json_parser_scan_number(const char** in, const char* end, struct json_number* out) {
+// Marks characters escaped by backslashes, i.e. the ones following odd-length backslash sequences.
+// `prev_escaped` carries escape over block boundary.
+uint64_t json_index_find_escaped(uint64_t* prev_escaped, uint64_t backslash) {
+	const uint64_t even_bits = 0x5555555555555555;
 
-	assert(*in < end);
+	backslash &= ~*prev_escaped;
+	uint64_t follows_escape = backslash << 1 | *prev_escaped;
+	uint64_t odd_sequence_starts = backslash & ~even_bits & ~follows_escape;
+	uint64_t sequences_starting_on_even_bits = odd_sequence_starts + backslash;
+	*prev_escaped = sequences_starting_on_even_bits < backslash;
+	uint64_t invert_mask = sequences_starting_on_even_bits << 1;
 
-	if(**in != '-' && !(**in >= '0' && **in <= '9'))
-		return JSON_ERROR_OK;
+	return (even_bits ^ invert_mask) & follows_escape;
+}
 
-	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
 
-	enum json_error error;
+// Indexes next window of input
+void json_index_build(struct json_index* index) {
+	const char* start = index->indexed_end;
+	size_t blocks = (index->end - start + 63) / 64;
 
-	if(**in == '-') {
-		buffer_append(&buffer, *in, 1);
-		(*in)++;
-	}
+	if(blocks > JSON_INDEX_BLOCKS) blocks = JSON_INDEX_BLOCKS;
 
-	if(*in >= end) goto unexpected_end;
+	size_t i;
+	for(i = 0; i < blocks; i++) {
+		const char* block = start + i * 64;
+		char padded[64];
 
-	if(**in == '0') {
-		buffer_append(&buffer, *in, 1);
-		(*in)++;
-	} else if(**in >= '1' && **in <= '9') {
-		while(*in < end) {
-			if(**in < '0' || **in > '9') break;
-			buffer_append(&buffer, *in, 1);
-			(*in)++;
+		if(index->end - block < 64) {
+			memset(padded, 0x20, 64);
+			memcpy(padded, block, index->end - block);
+			block = padded;
 		}
-	} else {
-		error = JSON_ERROR_UNEXPECTED_TOKEN;
-		goto error;
+
+		struct json_index_masks masks;
+		index->classify(block, &masks);
+
+		uint64_t escaped = json_index_find_escaped(&index->prev_escaped, masks.backslash);
+		uint64_t quote = masks.quote & ~escaped;
+		uint64_t in_string = index->prefix_xor(quote) ^ index->prev_in_string;
+		index->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+		index->quotes[i] = quote;
+		index->whitespace[i] = masks.whitespace & ~in_string;
+		index->special[i] = (masks.backslash | masks.control | masks.non_ascii) & in_string;
 	}
 
-	if(*in < end && **in == '.') {
+	index->start = start;
+	index->indexed_end = start + blocks * 64;
+}
 
-		buffer_append(&buffer, *in ,1);
-		(*in)++;
 
-		if(*in >= end) goto unexpected_end;
+// Returns position of first non-whitespace byte at or after `in` or NULL if it is not known from index.
+const char* json_index_skip_whitespace(struct json_index* index, const char* in) {
+	if(in < index->start) return NULL;
 
-		if(**in < '0' || **in > '9') {
-			error = JSON_ERROR_UNEXPECTED_TOKEN;
-			goto error;
-		}
+	while(in < index->end) {
+		while(in >= index->indexed_end) json_index_build(index);
 
-		while(*in < end) {
-			if(**in < '0' || **in > '9') break;
-			buffer_append(&buffer, *in, 1);
-			(*in)++;
+		size_t offset = in - index->start;
+		uint64_t non_whitespace = ~index->whitespace[offset / 64] >> (offset % 64);
+		if(non_whitespace) {
+			in += __builtin_ctzll(non_whitespace);
+			return in < index->end ? in : index->end;
 		}
+
+		in += 64 - offset % 64;
 	}
 
-	if(*in < end && (**in == 'e' || **in == 'E')) {
+	return index->end;
+}
 
-		buffer_append(&buffer, *in, 1);
-		(*in)++;
-		if(*in >= end) goto unexpected_end;
 
-		if(**in == '+' || **in == '-') {
-			buffer_append(&buffer, *in, 1);
-			(*in)++;
+// Returns position of closing quote of string whose content starts at `in` or NULL if string contains escapes,
+// control or non-ASCII characters (or position is not known from index), so it needs to be scanned byte by byte.
+const char* json_index_find_string_end(struct json_index* index, const char* in) {
+	if(in < index->start) return NULL;
 
-			if(*in >= end) goto unexpected_end;
-		}
+	while(in < index->end) {
+		while(in >= index->indexed_end) json_index_build(index);
 
-		if(**in < '0' || **in > '9') {
-			error = JSON_ERROR_UNEXPECTED_TOKEN;
-			goto error;
-		}
+		size_t offset = in - index->start;
+		uint64_t quotes = index->quotes[offset / 64] >> (offset % 64);
+		uint64_t special = index->special[offset / 64] >> (offset % 64);
 
-		while(*in < end) {
-			if(**in < '0' || **in > '9') break;
-			buffer_append(&buffer, *in, 1);
-			(*in)++;
+		if(quotes) {
+			int n = __builtin_ctzll(quotes);
+			if(special & (((uint64_t)1 << n) - 1)) return NULL;
+			in += n;
+			return in < index->end ? in : NULL;
 		}
+
+		if(special) return NULL;
+
+		in += 64 - offset % 64;
 	}
 
-	out->content = buffer.content;
-	out->length = buffer.length;
+	return NULL;
+}
 
-	return JSON_ERROR_OK;
+
+/*****************/
+/** JSON parser **/
+/*****************/
+
+
+#define JSON_PARSER_MAX_DEPTH 1024
+
+// Upper bound of `max_depth`: values are still printed, copied and compared recursively, and this much nesting fits
+// into default 8 MiB stack with room to spare
+#define JSON_PARSER_DEPTH_LIMIT 10000
+
+// Object or array being scanned
+struct json_parser_frame {
+	enum json_type type;
+	size_t keys_base, values_base; // positions of its members in scratch stacks
+	size_t length;
+	struct json_string key; // key of the member being scanned
+};
+
+// Parsed values are allocated from `arena`. Members of objects and arrays are collected into scratch stacks
+// shared by all nesting levels and moved into the arena once container is closed and its length is known.
+// Scanners given NULL `out` only validate and skip the value - nothing is allocated in that case.
+struct json_parser {
+	struct arena* arena;
+	struct json_index* index; // optional
+	int shared; // parsed containers are shared, so they get no capacity
+	size_t max_depth; // of nested objects and arrays, JSON_PARSER_MAX_DEPTH if 0
+	size_t depth; // containers entered by path scanners, values scanned inside them are nested that much deeper
+	struct json_string* keys;
+	size_t keys_length, keys_size;
+	struct json_value* values;
+	size_t values_length, values_size;
+	struct json_parser_frame* frames;
+	size_t frames_length, frames_size;
+};
+
+
+void json_parser_free(struct json_parser* parser);
+size_t json_parser_max_depth(const struct json_parser* parser);
+enum json_error json_parser_enter(struct json_parser* parser);
+enum json_error json_parser_scan_whitespace(struct json_parser* parser, const char** in, const char* end, struct whitespace* out);
+enum json_error json_parser_scan_value(struct json_parser* parser, const char** in, const char* end, struct json_value* out);
+enum json_error json_parser_scan_string(struct json_parser* parser, const char** in, const char* end, struct json_string* out);
+enum json_error json_parser_scan_number(const char** in, const char* end, struct json_number* out);
+enum json_error json_parser_scan_boolean(const char** in, const char* end, struct json_boolean* out);
+enum json_error json_parser_scan_null(const char** in, const char* end);
+
+
+enum json_error json_parser_scan_whitespace(struct json_parser* parser, const char** in, const char* end, struct whitespace* out) {
+
+	assert(*in < end);
+
+	const char* start = *in;
+	const char* next;
+
+	if(parser && parser->index && (next = json_index_skip_whitespace(parser->index, *in))) {
+		*in = next < end ? next : end;
+	}
+
+	while(*in < end) {
+		if(**in != 0x20 && **in != 0x09 && **in != 0x0A && **in != 0x0D) {
+			break;
+		}
+		(*in)++;
+	}
+
+	if(out && *in != start) {
+		out->content = start;
+		out->length = *in - start;
+	}
+
+	return JSON_ERROR_OK;
+}
+
+
+size_t json_parser_max_depth(const struct json_parser* parser) {
+	return parser->max_depth ? parser->max_depth : JSON_PARSER_MAX_DEPTH;
+}
+
+
+// Counts container entered by a scanner that walks it member by member, so values scanned in it are limited by the
+// same `max_depth` as if the whole document was scanned at once. Every successful call is paired with `depth--`.
+enum json_error json_parser_enter(struct json_parser* parser) {
+	if(parser->depth >= json_parser_max_depth(parser)) return JSON_ERROR_TOO_DEEP;
+	parser->depth++;
+	return JSON_ERROR_OK;
+}
+
+
+void json_parser_free(struct json_parser* parser) {
+	free(parser->keys);
+	free(parser->values);
+	free(parser->frames);
+	parser->keys = NULL;
+	parser->values = NULL;
+	parser->frames = NULL;
+	parser->keys_length = parser->keys_size = 0;
+	parser->values_length = parser->values_size = 0;
+	parser->frames_length = parser->frames_size = 0;
+}
+
+
+void json_parser_push_key(struct json_parser* parser, const struct json_string* key) {
+	if(parser->keys_length >= parser->keys_size) {
+		parser->keys_size = parser->keys_size ? parser->keys_size * 2 : 64;
+		parser->keys = realloc(parser->keys, parser->keys_size * sizeof(struct json_string));
+	}
+	parser->keys[parser->keys_length++] = *key;
+}
+
+
+void json_parser_push_value(struct json_parser* parser, const struct json_value* value) {
+	if(parser->values_length >= parser->values_size) {
+		parser->values_size = parser->values_size ? parser->values_size * 2 : 64;
+		parser->values = realloc(parser->values, parser->values_size * sizeof(struct json_value));
+	}
+	parser->values[parser->values_length++] = *value;
+}
+
+
+// Decoded values of escape sequences ('u' for \uXXXX, 0 if escape is invalid)
+const char json_escape_table[256] = {
+	['"'] = '"', ['\\'] = '\\', ['/'] = '/', ['b'] = '\b', ['f'] = '\f', ['n'] = '\n', ['r'] = '\r', ['t'] = '\t', ['u'] = 'u'
+};
+
+const signed char json_hex_table[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15
+};
+
+
+// Returns position of the first quote, backslash or control character in string content, or `end`
+const char* json_string_find_special_scalar(const char* in, const char* end) {
+	while(in < end) {
+		unsigned char c = *in;
+		if(c == '"' || c == '\\' || c <= 0x1f || c == 0x7f) break;
+		in++;
+	}
+	return in;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse4.2")))
+const char* json_string_find_special_sse42(const char* in, const char* end) {
+	const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+	const __m128i control_max = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+
+	while(end - in >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)in);
+		__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+			_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, control_max), v), _mm_cmpeq_epi8(v, del)));
+		int mask = _mm_movemask_epi8(special);
+		if(mask) return in + __builtin_ctz(mask);
+		in += 16;
+	}
+
+	return json_string_find_special_scalar(in, end);
+}
+
+
+__attribute__((target("avx2")))
+const char* json_string_find_special_avx2(const char* in, const char* end) {
+	const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+	const __m256i control_max = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(0x7f);
+
+	while(end - in >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)in);
+		__m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, control_max), v), _mm256_cmpeq_epi8(v, del)));
+		uint32_t mask = _mm256_movemask_epi8(special);
+		if(mask) return in + __builtin_ctz(mask);
+		in += 32;
+	}
+
+	return json_string_find_special_scalar(in, end);
+}
+
+#endif
+
+
+const char* json_string_find_special(const char* in, const char* end) {
+	static const char* (*find)(const char*, const char*) = NULL;
+
+	if(find == NULL) {
+		find = json_string_find_special_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) find = json_string_find_special_avx2;
+		else if(__builtin_cpu_supports("sse4.2")) find = json_string_find_special_sse42;
+#endif
+	}
+
+	return find(in, end);
+}
+
+
+// Length of UTF-8 sequence by its first byte, 0 if the byte cannot start a sequence
+const unsigned char json_utf8_length_table[256] = {
+	[0x00 ... 0x7f] = 1,
+	[0xc2 ... 0xdf] = 2,
+	[0xe0 ... 0xef] = 3,
+	[0xf0 ... 0xf4] = 4,
+};
+
+
+// Decodes one UTF-8 sequence. Returns -1 if it is incomplete or invalid (overlong, surrogate or above U+10FFFF).
+int json_utf8_decode(const unsigned char** in, const unsigned char* end, uint32_t* out) {
+	const unsigned char* s = *in;
+	unsigned int length = json_utf8_length_table[s[0]], i;
+
+	if(length == 0 || end - s < length) return -1;
+
+	uint32_t c = length == 1 ? s[0] : s[0] & (0x7f >> length);
+	for(i = 1; i < length; i++) {
+		if((s[i] & 0xc0) != 0x80) return -1;
+		c = c << 6 | (s[i] & 0x3f);
+	}
+
+	// overlong 2-byte sequences are excluded by the length table
+	if(length == 3 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) return -1;
+	if(length == 4 && (c < 0x10000 || c > 0x10ffff)) return -1;
+
+	*out = c;
+	*in = s + length;
+	return 0;
+}
+
+
+int json_utf8_validate_scalar(const char* in, const char* end) {
+	const unsigned char* s = (const unsigned char*)in;
+	const unsigned char* e = (const unsigned char*)end;
+	uint32_t c;
+
+	while(s < e) {
+		// skip ASCII 8 bytes at a time
+		uint64_t word;
+		if(e - s >= 8 && (memcpy(&word, s, 8), (word & 0x8080808080808080) == 0)) {
+			s += 8;
+			continue;
+		}
+		if(*s < 0x80) s++;
+		else if(json_utf8_decode(&s, e, &c)) return -1;
+	}
+
+	return 0;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Vectorized validation looks up error flags by high and low nibble of previous byte and high nibble of current one
+// (Keiser, Lemire: Validating UTF-8 In Less Than One Instruction Per Byte). A byte pair is invalid if all three
+// lookups share a flag. Third and fourth bytes of longer sequences are checked by looking 2 and 3 bytes back.
+
+#define JSON_UTF8_TOO_SHORT 0x01
+#define JSON_UTF8_TOO_LONG 0x02
+#define JSON_UTF8_OVERLONG_3 0x04
+#define JSON_UTF8_TOO_LARGE 0x08
+#define JSON_UTF8_SURROGATE 0x10
+#define JSON_UTF8_OVERLONG_2 0x20
+#define JSON_UTF8_TOO_LARGE_1000 0x40
+#define JSON_UTF8_OVERLONG_4 0x40
+#define JSON_UTF8_TWO_CONTINUATIONS 0x80
+#define JSON_UTF8_CARRY (JSON_UTF8_TOO_SHORT | JSON_UTF8_TOO_LONG | JSON_UTF8_TWO_CONTINUATIONS)
+
+const unsigned char json_utf8_byte_1_high[16] = {
+	// ASCII
+	JSON_UTF8_TOO_LONG, JSON_UTF8_TOO_LONG, JSON_UTF8_TOO_LONG, JSON_UTF8_TOO_LONG,
+	JSON_UTF8_TOO_LONG, JSON_UTF8_TOO_LONG, JSON_UTF8_TOO_LONG, JSON_UTF8_TOO_LONG,
+	// continuation
+	JSON_UTF8_TWO_CONTINUATIONS, JSON_UTF8_TWO_CONTINUATIONS, JSON_UTF8_TWO_CONTINUATIONS, JSON_UTF8_TWO_CONTINUATIONS,
+	// 2-byte lead
+	JSON_UTF8_TOO_SHORT | JSON_UTF8_OVERLONG_2,
+	JSON_UTF8_TOO_SHORT,
+	// 3-byte lead
+	JSON_UTF8_TOO_SHORT | JSON_UTF8_OVERLONG_3 | JSON_UTF8_SURROGATE,
+	// 4-byte lead
+	JSON_UTF8_TOO_SHORT | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000 | JSON_UTF8_OVERLONG_4,
+};
+
+const unsigned char json_utf8_byte_1_low[16] = {
+	JSON_UTF8_CARRY | JSON_UTF8_OVERLONG_2 | JSON_UTF8_OVERLONG_3 | JSON_UTF8_OVERLONG_4,
+	JSON_UTF8_CARRY | JSON_UTF8_OVERLONG_2,
+	JSON_UTF8_CARRY,
+	JSON_UTF8_CARRY,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000 | JSON_UTF8_SURROGATE,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+	JSON_UTF8_CARRY | JSON_UTF8_TOO_LARGE | JSON_UTF8_TOO_LARGE_1000,
+};
+
+const unsigned char json_utf8_byte_2_high[16] = {
+	// ASCII
+	JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT,
+	JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT,
+	// continuation 0x80 - 0x8f
+	JSON_UTF8_TOO_LONG | JSON_UTF8_OVERLONG_2 | JSON_UTF8_TWO_CONTINUATIONS | JSON_UTF8_OVERLONG_3 | JSON_UTF8_TOO_LARGE_1000 | JSON_UTF8_OVERLONG_4,
+	// continuation 0x90 - 0x9f
+	JSON_UTF8_TOO_LONG | JSON_UTF8_OVERLONG_2 | JSON_UTF8_TWO_CONTINUATIONS | JSON_UTF8_OVERLONG_3 | JSON_UTF8_TOO_LARGE,
+	// continuation 0xa0 - 0xbf
+	JSON_UTF8_TOO_LONG | JSON_UTF8_OVERLONG_2 | JSON_UTF8_TWO_CONTINUATIONS | JSON_UTF8_SURROGATE | JSON_UTF8_TOO_LARGE,
+	JSON_UTF8_TOO_LONG | JSON_UTF8_OVERLONG_2 | JSON_UTF8_TWO_CONTINUATIONS | JSON_UTF8_SURROGATE | JSON_UTF8_TOO_LARGE,
+	// lead
+	JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT, JSON_UTF8_TOO_SHORT,
+};
+
+// bytes greater than these at the end of block start a sequence that continues in the next block
+const unsigned char json_utf8_incomplete_max[32] = {
+	[0 ... 28] = 0xff, 0xef, 0xdf, 0xbf
+};
+
+
+__attribute__((target("sse4.2")))
+int json_utf8_validate_sse42(const char* in, const char* end) {
+	const __m128i byte_1_high = _mm_loadu_si128((const __m128i*)json_utf8_byte_1_high);
+	const __m128i byte_1_low = _mm_loadu_si128((const __m128i*)json_utf8_byte_1_low);
+	const __m128i byte_2_high = _mm_loadu_si128((const __m128i*)json_utf8_byte_2_high);
+	const __m128i incomplete_max = _mm_loadu_si128((const __m128i*)(json_utf8_incomplete_max + 16));
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+
+	__m128i prev = _mm_setzero_si128(), incomplete = _mm_setzero_si128(), error = _mm_setzero_si128();
+	char padded[16];
+
+	while(in < end) {
+		__m128i v;
+		if(end - in >= 16) {
+			v = _mm_loadu_si128((const __m128i*)in);
+		} else {
+			memset(padded, 0, 16);
+			memcpy(padded, in, end - in);
+			v = _mm_loadu_si128((const __m128i*)padded);
+		}
+		in += 16;
+
+		if(_mm_movemask_epi8(v)) {
+			__m128i prev1 = _mm_alignr_epi8(v, prev, 15);
+			__m128i special = _mm_and_si128(_mm_and_si128(
+				_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+				_mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+				_mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+			// only third and fourth bytes of sequences get high bit set
+			__m128i continuation = _mm_or_si128(_mm_subs_epu8(_mm_alignr_epi8(v, prev, 14), _mm_set1_epi8(0xe0 - 0x80)),
+				_mm_subs_epu8(_mm_alignr_epi8(v, prev, 13), _mm_set1_epi8(0xf0 - 0x80)));
+			error = _mm_or_si128(error, _mm_xor_si128(_mm_and_si128(continuation, _mm_set1_epi8(0x80)), special));
+			incomplete = _mm_subs_epu8(v, incomplete_max);
+		} else {
+			error = _mm_or_si128(error, incomplete);
+			incomplete = _mm_setzero_si128();
+		}
+
+		prev = v;
+	}
+
+	error = _mm_or_si128(error, incomplete);
+
+	return _mm_testz_si128(error, error) ? 0 : -1;
+}
+
+
+__attribute__((target("avx2")))
+int json_utf8_validate_avx2(const char* in, const char* end) {
+	const __m256i byte_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)json_utf8_byte_1_high));
+	const __m256i byte_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)json_utf8_byte_1_low));
+	const __m256i byte_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)json_utf8_byte_2_high));
+	const __m256i incomplete_max = _mm256_loadu_si256((const __m256i*)json_utf8_incomplete_max);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+	__m256i prev = _mm256_setzero_si256(), incomplete = _mm256_setzero_si256(), error = _mm256_setzero_si256();
+	char padded[32];
+
+	while(in < end) {
+		__m256i v;
+		if(end - in >= 32) {
+			v = _mm256_loadu_si256((const __m256i*)in);
+		} else {
+			memset(padded, 0, 32);
+			memcpy(padded, in, end - in);
+			v = _mm256_loadu_si256((const __m256i*)padded);
+		}
+		in += 32;
+
+		if(_mm256_movemask_epi8(v)) {
+			// bytes preceding each byte of `v`, across the lane boundary
+			__m256i shifted = _mm256_permute2x128_si256(prev, v, 0x21);
+			__m256i prev1 = _mm256_alignr_epi8(v, shifted, 15);
+			__m256i special = _mm256_and_si256(_mm256_and_si256(
+				_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+				_mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+				_mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+			// only third and fourth bytes of sequences get high bit set
+			__m256i continuation = _mm256_or_si256(_mm256_subs_epu8(_mm256_alignr_epi8(v, shifted, 14), _mm256_set1_epi8(0xe0 - 0x80)),
+				_mm256_subs_epu8(_mm256_alignr_epi8(v, shifted, 13), _mm256_set1_epi8(0xf0 - 0x80)));
+			error = _mm256_or_si256(error, _mm256_xor_si256(_mm256_and_si256(continuation, _mm256_set1_epi8(0x80)), special));
+			incomplete = _mm256_subs_epu8(v, incomplete_max);
+		} else {
+			error = _mm256_or_si256(error, incomplete);
+			incomplete = _mm256_setzero_si256();
+		}
+
+		prev = v;
+	}
+
+	error = _mm256_or_si256(error, incomplete);
+
+	return _mm256_testz_si256(error, error) ? 0 : -1;
+}
+
+#endif
+
+
+// Returns -1 if string content is not valid UTF-8
+int json_utf8_validate(const char* in, const char* end) {
+	static int (*validate)(const char*, const char*) = NULL;
+
+	if(validate == NULL) {
+		validate = json_utf8_validate_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) validate = json_utf8_validate_avx2;
+		else if(__builtin_cpu_supports("sse4.2")) validate = json_utf8_validate_sse42;
+#endif
+	}
+
+	return validate(in, end);
+}
+
+
+// Returns number of bytes at `end` that start UTF-8 sequence not completed before `end` (sequence may continue in
+// the next chunk of input)
+size_t json_utf8_incomplete(const char* in, const char* end) {
+	size_t i;
+	for(i = 1; i <= 3 && end - i >= in; i++) {
+		unsigned char c = end[-i];
+		if(c < 0x80) return 0;
+		if(c >= 0xc0) return json_utf8_length_table[c] > i ? i : 0;
+	}
+	return 0;
+}
+
+
+// Strings are not decoded while parsing - `out` points to the raw content between the quotes. If the content
+// contains escape sequences, `escaped` is set and the bytes must be decoded with `json_string_decode`
+// (or compared with `json_string_equals`) before use. Content must be valid UTF-8.
+enum json_error json_parser_scan_string(struct json_parser* parser, const char** in, const char* end, struct json_string* out) {
+	assert(*in < end);
+
+	if(**in != '"') return JSON_ERROR_OK;
+
+	(*in)++;
+
+	const char* start = *in;
+	int escaped = 0, ascii = 0;
+
+	const char* close;
+	if(parser && parser->index && (close = json_index_find_string_end(parser->index, start)) && close < end) {
+		*in = close;
+		ascii = 1;
+	}
+
+	while(*in < end) {
+
+		*in = json_string_find_special(*in, end);
+
+		if(*in >= end) break;
+
+		unsigned char c = **in;
+
+		if(c == '"') break;
+
+		if(c != '\\') { // disable control characters
+			return JSON_ERROR_UNEXPECTED_TOKEN;
+		}
+
+		escaped = 1;
+
+		(*in)++;
+
+		if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+		c = json_escape_table[(unsigned char)**in];
+
+		if(!c) return JSON_ERROR_UNEXPECTED_TOKEN;
+
+		if(c == 'u') {
+			if(*in + 5 > end) return JSON_ERROR_UNEXPECTED_END;
+
+			const unsigned char* hex = (const unsigned char*)*in + 1;
+			if((json_hex_table[hex[0]] | json_hex_table[hex[1]] | json_hex_table[hex[2]] | json_hex_table[hex[3]]) < 0) {
+				return JSON_ERROR_UNEXPECTED_TOKEN;
+			}
+
+			*in += 4;
+		}
+
+		(*in)++;
+	}
+
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+	if(!ascii && json_utf8_validate(start, *in)) return JSON_ERROR_UNEXPECTED_TOKEN;
+
+	if(out) {
+		out->content = start;
+		out->length = *in - start;
+		out->escaped = escaped;
+	}
+
+	(*in)++;
+
+	return JSON_ERROR_OK;
+}
+
+
+// Checks content of string that does not come from parser (without quotes), so it can be decoded safely
+int json_string_validate(const char* in, const char* end) {
+	const char* start = in;
+
+	while((in = json_string_find_special(in, end)) < end) {
+		if(*in != '\\') return -1;
+
+		in++;
+		if(in >= end) return -1;
+
+		char c = json_escape_table[(unsigned char)*in];
+		if(!c) return -1;
+
+		if(c == 'u') {
+			if(end - in < 5) return -1;
+
+			const unsigned char* hex = (const unsigned char*)in + 1;
+			if((json_hex_table[hex[0]] | json_hex_table[hex[1]] | json_hex_table[hex[2]] | json_hex_table[hex[3]]) < 0) return -1;
+
+			in += 4;
+		}
+
+		in++;
+	}
+
+	return json_utf8_validate(start, end);
+}
+
+
+// Decodes single character of already validated string content into UTF-8. Returns number of bytes written to `out`
+// (at most 4). Escaped surrogate pair is decoded as one character, unpaired surrogate as U+FFFD.
+unsigned int json_string_decode_char(const char** in, const char* end, char* out) {
+	if(**in != '\\') {
+		*out = **in;
+		(*in)++;
+		return 1;
+	}
+
+	(*in)++;
+
+	char c = json_escape_table[(unsigned char)**in];
+	(*in)++;
+
+	if(c != 'u') {
+		*out = c;
+		return 1;
+	}
+
+	const unsigned char* hex = (const unsigned char*)*in;
+	uint32_t unicode_char = json_hex_table[hex[0]] << 12 | json_hex_table[hex[1]] << 8 | json_hex_table[hex[2]] << 4 | json_hex_table[hex[3]];
+	*in += 4;
+
+	if(unicode_char >= 0xd800 && unicode_char <= 0xdbff && end - *in >= 6 && (*in)[0] == '\\' && (*in)[1] == 'u') {
+		hex = (const unsigned char*)*in + 2;
+		uint32_t low = json_hex_table[hex[0]] << 12 | json_hex_table[hex[1]] << 8 | json_hex_table[hex[2]] << 4 | json_hex_table[hex[3]];
+		if(low >= 0xdc00 && low <= 0xdfff) {
+			unicode_char = 0x10000 + ((unicode_char - 0xd800) << 10) + (low - 0xdc00);
+			*in += 6;
+		}
+	}
+
+	if(unicode_char >= 0xd800 && unicode_char <= 0xdfff) unicode_char = 0xfffd;
+
+	if(unicode_char < 0x80) {
+		out[0] = unicode_char & 0xff;
+		return 1;
+	} else if(unicode_char < 0x800) {
+		out[0] = 0xc0 | (0x1f & (unicode_char >> 6));
+		out[1] = 0x80 | (0x3f & unicode_char);
+		return 2;
+	} else if(unicode_char < 0x10000) {
+		out[0] = 0xe0 | (0x0f & (unicode_char >> 12));
+		out[1] = 0x80 | (0x3f & (unicode_char >> 6));
+		out[2] = 0x80 | (0x3f & unicode_char);
+		return 3;
+	} else {
+		out[0] = 0xf0 | (0x07 & (unicode_char >> 18));
+		out[1] = 0x80 | (0x3f & (unicode_char >> 12));
+		out[2] = 0x80 | (0x3f & (unicode_char >> 6));
+		out[3] = 0x80 | (0x3f & unicode_char);
+		return 4;
+	}
+}
+
+
+void json_string_decode(const struct json_string* string, struct buffer* out) {
+	const char* in = string->content;
+	const char* end = in + string->length;
+
+	if(!string->escaped) {
+		buffer_append(out, in, string->length);
+		return;
+	}
+
+	while(in < end) {
+		// copy everything up to the next escape sequence at once
+		const char* run = in;
+		in = memchr(in, '\\', end - in);
+		if(in == NULL) in = end;
+		if(in != run) buffer_append(out, run, in - run);
+
+		if(in < end) {
+			char c[4];
+			buffer_append(out, c, json_string_decode_char(&in, end, c));
+		}
+	}
+}
+
+
+// Compares decoded contents of two strings without allocating
+int json_string_equals(const struct json_string* a, const struct json_string* b) {
+	if(!a->escaped && !b->escaped) {
+		return a->length == b->length && memcmp(a->content, b->content, a->length) == 0;
+	}
+
+	// decoded string is never longer than the raw one
+	if((!a->escaped && a->length > b->length) || (!b->escaped && b->length > a->length)) return 0;
+
+	const char* a_in = a->content;
+	const char* a_end = a_in + a->length;
+	const char* b_in = b->content;
+	const char* b_end = b_in + b->length;
+	char a_chars[4], b_chars[4];
+	unsigned int a_length = 0, b_length = 0, a_pos = 0, b_pos = 0;
+
+	while(1) {
+		if(a_pos == a_length) {
+			if(a_in >= a_end) break;
+			if(a->escaped) {
+				a_length = json_string_decode_char(&a_in, a_end, a_chars);
+			} else {
+				a_chars[0] = *a_in++;
+				a_length = 1;
+			}
+			a_pos = 0;
+		}
+		if(b_pos == b_length) {
+			if(b_in >= b_end) return 0;
+			if(b->escaped) {
+				b_length = json_string_decode_char(&b_in, b_end, b_chars);
+			} else {
+				b_chars[0] = *b_in++;
+				b_length = 1;
+			}
+			b_pos = 0;
+		}
+		if(a_chars[a_pos++] != b_chars[b_pos++]) return 0;
+	}
+
+	return b_pos == b_length && b_in >= b_end;
+}
+
+
+// FNV-1a of decoded content, so differently escaped forms of a string hash the same
+uint64_t json_string_hash(const struct json_string* string) {
+	const char* in = string->content;
+	const char* end = in + string->length;
+	uint64_t hash = 0xcbf29ce484222325;
+
+	while(in < end) {
+		if(string->escaped && *in == '\\') {
+			char c[4];
+			unsigned int length = json_string_decode_char(&in, end, c), i;
+			for(i = 0; i < length; i++) hash = (hash ^ (unsigned char)c[i]) * 0x100000001b3;
+		} else {
+			hash = (hash ^ (unsigned char)*in++) * 0x100000001b3;
+		}
+	}
+
+	return hash;
+}
+
+
+// Like strings, numbers are kept as slices of the input. Numeric value is computed only when asked for
+// (see `json_number_convert`).
+enum json_error json_parser_scan_number(const char** in, const char* end, struct json_number* out) {
+
+	assert(*in < end);
+
+	if(**in != '-' && !(**in >= '0' && **in <= '9'))
+		return JSON_ERROR_OK;
+
+	const char* start = *in;
+
+	if(**in == '-') {
+		(*in)++;
+	}
+
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+	if(**in == '0') {
+		(*in)++;
+	} else if(**in >= '1' && **in <= '9') {
+		while(*in < end) {
+			if(**in < '0' || **in > '9') break;
+			(*in)++;
+		}
+	} else {
+		return JSON_ERROR_UNEXPECTED_TOKEN;
+	}
+
+	if(*in < end && **in == '.') {
+
+		(*in)++;
+
+		if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+		if(**in < '0' || **in > '9') return JSON_ERROR_UNEXPECTED_TOKEN;
+
+		while(*in < end) {
+			if(**in < '0' || **in > '9') break;
+			(*in)++;
+		}
+	}
+
+	if(*in < end && (**in == 'e' || **in == 'E')) {
+
+		(*in)++;
+		if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+		if(**in == '+' || **in == '-') {
+			(*in)++;
+
+			if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+		}
+
+		if(**in < '0' || **in > '9') return JSON_ERROR_UNEXPECTED_TOKEN;
+
+		while(*in < end) {
+			if(**in < '0' || **in > '9') break;
+			(*in)++;
+		}
+	}
+
+	if(out) {
+		out->content = start;
+		out->length = *in - start;
+		out->flags = 0;
+	}
+
+	return JSON_ERROR_OK;
+}
+
+
+enum json_error json_parser_scan_boolean(const char** in, const char* end, struct json_boolean* out) {
+
+	assert(*in < end);
+
+	const char* s = *in;
+	if(*in + 4 <= end && s[0] == 't' && s[1] == 'r' && s[2] == 'u' && s[3] == 'e') {
+		if(out) out->value = 1;
+		*in += 4;
+	} else if(*in + 5 <= end && s[0] == 'f' && s[1] == 'a' && s[2] == 'l' && s[3] == 's' && s[4] == 'e') {
+		if(out) out->value = 0;
+		*in += 5;
+	}
+	return JSON_ERROR_OK;
+}
+
+
+enum json_error json_parser_scan_null(const char** in, const char* end) {
+
+	assert(*in < end);
+
+	const char* s = *in;
+	if(*in + 4 <= end && s[0] == 'n' && s[1] == 'u' && s[2] == 'l' && s[3] == 'l') {
+		*in += 4;
+	}
+	return JSON_ERROR_OK;
+}
+
+
+// Kind of value by its first character
+enum json_token {
+	JSON_TOKEN_NONE = 0,
+	JSON_TOKEN_STRING,
+	JSON_TOKEN_NUMBER,
+	JSON_TOKEN_OBJECT,
+	JSON_TOKEN_ARRAY,
+	JSON_TOKEN_BOOLEAN,
+	JSON_TOKEN_NULL,
+};
+
+const unsigned char json_token_table[256] = {
+	['"'] = JSON_TOKEN_STRING,
+	['-'] = JSON_TOKEN_NUMBER, ['0' ... '9'] = JSON_TOKEN_NUMBER,
+	['{'] = JSON_TOKEN_OBJECT, ['['] = JSON_TOKEN_ARRAY,
+	['t'] = JSON_TOKEN_BOOLEAN, ['f'] = JSON_TOKEN_BOOLEAN,
+	['n'] = JSON_TOKEN_NULL,
+};
+
+
+// Scans value without recursion - objects and arrays being scanned are kept on explicit stack, which is limited
+// by `max_depth`. Like other scanners, it leaves `*in` as it is if there is no value. Objects accept trailing comma
+// after the last member.
+enum json_error json_parser_scan_value(struct json_parser* parser, const char** in, const char* end, struct json_value* out) {
+
+	assert(*in < end);
+
+	size_t base = parser->frames_length;
+	size_t max_depth = json_parser_max_depth(parser);
+	struct json_parser_frame* frame;
+	struct json_value value;
+	enum json_error error = JSON_ERROR_OK;
+	const char* tmp_pos;
+
+ scan_value:
+
+	tmp_pos = *in;
+
+	switch(json_token_table[(unsigned char)**in]) {
+	case JSON_TOKEN_STRING:
+		error = json_parser_scan_string(parser, in, end, out ? &value.value.string : NULL);
+		value.type = JSON_TYPE_STRING;
+		break;
+	case JSON_TOKEN_NUMBER:
+		error = json_parser_scan_number(in, end, out ? &value.value.number : NULL);
+		value.type = JSON_TYPE_NUMBER;
+		break;
+	case JSON_TOKEN_BOOLEAN:
+		error = json_parser_scan_boolean(in, end, out ? &value.value.boolean : NULL);
+		value.type = JSON_TYPE_BOOLEAN;
+		break;
+	case JSON_TOKEN_NULL:
+		error = json_parser_scan_null(in, end);
+		value.type = JSON_TYPE_NULL;
+		break;
+	case JSON_TOKEN_OBJECT:
+	case JSON_TOKEN_ARRAY:
+		if(parser->depth + parser->frames_length - base >= max_depth) {
+			error = JSON_ERROR_TOO_DEEP;
+			goto error;
+		}
+
+		if(parser->frames_length >= parser->frames_size) {
+			parser->frames_size = parser->frames_size ? parser->frames_size * 2 : 64;
+			parser->frames = realloc(parser->frames, parser->frames_size * sizeof(struct json_parser_frame));
+		}
+
+		frame = &parser->frames[parser->frames_length++];
+		frame->type = **in == '{' ? JSON_TYPE_OBJECT : JSON_TYPE_ARRAY;
+		frame->keys_base = parser->keys_length;
+		frame->values_base = parser->values_length;
+		frame->length = 0;
+
+		(*in)++;
+		goto next_member;
+	default:
+		break;
+	}
+
+	if(error) goto error;
+
+	if(*in == tmp_pos) {
+		if(parser->frames_length == base) return JSON_ERROR_OK;
+
+		// only empty array may end where value is expected
+		frame = &parser->frames[parser->frames_length - 1];
+		if(frame->type == JSON_TYPE_ARRAY && frame->length == 0) goto close;
+
+		error = JSON_ERROR_UNEXPECTED_TOKEN;
+		goto error;
+	}
+
+ scanned_value:
+
+	if(parser->frames_length == base) {
+		if(out) *out = value;
+		return JSON_ERROR_OK;
+	}
+
+	frame = &parser->frames[parser->frames_length - 1];
+
+	if(out) {
+		if(frame->type == JSON_TYPE_OBJECT) json_parser_push_key(parser, &frame->key);
+		json_parser_push_value(parser, &value);
+	}
+	frame->length++;
+
+	if(*in >= end) goto unexpected_end;
+	json_parser_scan_whitespace(parser, in, end, NULL);
+	if(*in >= end) goto unexpected_end;
+
+	if(**in != ',') goto close;
+	(*in)++;
+
+ next_member:
+
+	if(*in >= end) goto unexpected_end;
+	json_parser_scan_whitespace(parser, in, end, NULL);
+	if(*in >= end) goto unexpected_end;
+
+	frame = &parser->frames[parser->frames_length - 1];
+
+	if(frame->type == JSON_TYPE_OBJECT) {
+		tmp_pos = *in;
+		error = json_parser_scan_string(parser, in, end, &frame->key);
+		if(error) goto error;
+		if(*in == tmp_pos) goto close;
+
+		if(*in >= end) goto unexpected_end;
+		json_parser_scan_whitespace(parser, in, end, NULL);
+		if(*in >= end) goto unexpected_end;
+
+		if(**in != ':') {
+			error = JSON_ERROR_UNEXPECTED_TOKEN;
+			goto error;
+		}
+
+		(*in)++;
+		if(*in >= end) goto unexpected_end;
+		json_parser_scan_whitespace(parser, in, end, NULL);
+		if(*in >= end) goto unexpected_end;
+	}
+
+	goto scan_value;
+
+ close:
+
+	frame = &parser->frames[parser->frames_length - 1];
+
+	if(**in != (frame->type == JSON_TYPE_OBJECT ? '}' : ']')) {
+		error = JSON_ERROR_UNEXPECTED_TOKEN;
+		goto error;
+	}
+
+	(*in)++;
+
+	value.type = frame->type;
+
+	if(out) {
+		size_t length = frame->length;
+
+		if(frame->type == JSON_TYPE_OBJECT) {
+			struct json_object* object = &value.value.object;
+			object->keys = arena_copy(parser->arena, &parser->keys[frame->keys_base], length * sizeof(struct json_string));
+			object->values = arena_copy(parser->arena, &parser->values[frame->values_base], length * sizeof(struct json_value));
+			object->length = length;
+			object->capacity = parser->shared ? 0 : length;
+			object->index = NULL;
+		} else {
+			struct json_array* array = &value.value.array;
+			array->values = arena_copy(parser->arena, &parser->values[frame->values_base], length * sizeof(struct json_value));
+			array->length = length;
+			array->capacity = parser->shared ? 0 : length;
+		}
+
+		parser->keys_length = frame->keys_base;
+		parser->values_length = frame->values_base;
+	}
+
+	parser->frames_length--;
+	goto scanned_value;
 
  unexpected_end:
 
-	error = JSON_ERROR_UNEXPECTED_END;
+	error = JSON_ERROR_UNEXPECTED_END;
+
+ error:
+
+	if(parser->frames_length > base) {
+		parser->keys_length = parser->frames[base].keys_base;
+		parser->values_length = parser->frames[base].values_base;
+		parser->frames_length = base;
+	}
+
+	return error;
+}
+
+
+// Advances to the next member of object or array whose opening bracket has already been consumed. `index` is the
+// number of members scanned so far. If there is another member, `*more` is set and `*in` is left at its value
+// (object key is stored to `key`), otherwise closing bracket is consumed.
+enum json_error json_parser_next_member(struct json_parser* parser, const char** in, const char* end, char close, size_t index, struct json_string* key, int* more) {
+
+	*more = 0;
+
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+	json_parser_scan_whitespace(parser, in, end, NULL);
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+	if(index > 0) {
+		if(**in == close) {
+			(*in)++;
+			return JSON_ERROR_OK;
+		}
+
+		if(**in != ',') return JSON_ERROR_UNEXPECTED_TOKEN;
+
+		(*in)++;
+		if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+		json_parser_scan_whitespace(parser, in, end, NULL);
+		if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+	}
+
+	if(close == ']') {
+		if(index == 0 && **in == close) {
+			(*in)++;
+			return JSON_ERROR_OK;
+		}
+
+		*more = 1;
+		return JSON_ERROR_OK;
+	}
+
+	// like json_parser_scan_object, this accepts trailing comma after last member
+	const char* tmp_pos = *in;
+	enum json_error error = json_parser_scan_string(parser, in, end, key);
+	if(error) return error;
+
+	if(*in == tmp_pos) {
+		if(**in != close) return JSON_ERROR_UNEXPECTED_TOKEN;
+		(*in)++;
+		return JSON_ERROR_OK;
+	}
+
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+	json_parser_scan_whitespace(parser, in, end, NULL);
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+	if(**in != ':') return JSON_ERROR_UNEXPECTED_TOKEN;
+
+	(*in)++;
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+	json_parser_scan_whitespace(parser, in, end, NULL);
+	if(*in >= end) return JSON_ERROR_UNEXPECTED_END;
+
+	*more = 1;
+	return JSON_ERROR_OK;
+}
+
+
+/********************/
+/** JSON validator **/
+/********************/
+
+
+// Push validator - accepts the same texts as the parser (including trailing comma in objects), but input can be
+// fed in chunks of any size and nothing is allocated unless nesting is deeper than `inline_stack` can hold.
+// Only one bit per open container is kept: set for objects, clear for arrays.
+
+enum json_validator_state {
+	JSON_VALIDATOR_VALUE, // value expected
+	JSON_VALIDATOR_ARRAY_START, // value or ']'
+	JSON_VALIDATOR_KEY, // key or '}'
+	JSON_VALIDATOR_COLON,
+	JSON_VALIDATOR_AFTER_VALUE, // ',' or closing bracket, only whitespace at top level
+	JSON_VALIDATOR_STRING,
+	JSON_VALIDATOR_STRING_ESCAPE,
+	JSON_VALIDATOR_STRING_HEX,
+	JSON_VALIDATOR_LITERAL,
+	JSON_VALIDATOR_NUMBER_SIGN,
+	JSON_VALIDATOR_NUMBER_ZERO,
+	JSON_VALIDATOR_NUMBER_INTEGER,
+	JSON_VALIDATOR_NUMBER_POINT,
+	JSON_VALIDATOR_NUMBER_FRACTION,
+	JSON_VALIDATOR_NUMBER_EXPONENT,
+	JSON_VALIDATOR_NUMBER_EXPONENT_SIGN,
+	JSON_VALIDATOR_NUMBER_EXPONENT_DIGITS,
+	JSON_VALIDATOR_ERROR
+};
+
+struct json_validator {
+	enum json_validator_state state;
+	int key; // string being scanned is object key
+	unsigned int hex_digits; // remaining digits of \uXXXX escape
+	unsigned char utf8[4]; // UTF-8 sequence split between chunks of input
+	unsigned int utf8_length;
+	const char* literal; // remaining characters of true/false/null
+	size_t depth;
+	size_t max_depth; // same as in parser
+	uint64_t* stack;
+	size_t stack_size; // in 64-bit words
+	uint64_t inline_stack[16];
+};
+
+
+void json_validator_init(struct json_validator* validator, size_t max_depth) {
+	validator->state = JSON_VALIDATOR_VALUE;
+	validator->max_depth = max_depth ? max_depth : JSON_PARSER_MAX_DEPTH;
+	validator->key = 0;
+	validator->hex_digits = 0;
+	validator->utf8_length = 0;
+	validator->literal = NULL;
+	validator->depth = 0;
+	validator->stack = validator->inline_stack;
+	validator->stack_size = sizeof(validator->inline_stack) / sizeof(uint64_t);
+}
+
+
+void json_validator_free(struct json_validator* validator) {
+	if(validator->stack != validator->inline_stack) free(validator->stack);
+	validator->stack = validator->inline_stack;
+}
+
+
+// Returns -1 if containers are nested too deep
+int json_validator_push(struct json_validator* validator, int object) {
+	size_t word = validator->depth / 64;
+
+	if(validator->depth >= validator->max_depth) return -1;
+
+	if(word >= validator->stack_size) {
+		uint64_t* stack = malloc(validator->stack_size * 2 * sizeof(uint64_t));
+		memcpy(stack, validator->stack, validator->stack_size * sizeof(uint64_t));
+		json_validator_free(validator);
+		validator->stack = stack;
+		validator->stack_size *= 2;
+	}
+
+	uint64_t bit = (uint64_t)1 << (validator->depth % 64);
+	if(object) validator->stack[word] |= bit;
+	else validator->stack[word] &= ~bit;
+
+	validator->depth++;
+
+	return 0;
+}
+
+
+// Returns non-zero if innermost open container is an object
+int json_validator_top(const struct json_validator* validator) {
+	size_t i = validator->depth - 1;
+	return (validator->stack[i / 64] >> (i % 64)) & 1;
+}
+
+
+enum json_error json_validator_feed(struct json_validator* validator, const char* in, const char* end) {
+
+	while(in < end) {
+
+		unsigned char c = *in;
+
+		// states inside of tokens
+		switch(validator->state) {
+		case JSON_VALIDATOR_STRING: {
+			if(validator->utf8_length) {
+				unsigned int length = json_utf8_length_table[validator->utf8[0]];
+				while(validator->utf8_length < length && in < end) validator->utf8[validator->utf8_length++] = *in++;
+				if(validator->utf8_length < length) return JSON_ERROR_OK;
+				if(json_utf8_validate((const char*)validator->utf8, (const char*)validator->utf8 + length)) goto error;
+				validator->utf8_length = 0;
+				continue;
+			}
+
+			const char* run = in;
+			in = json_string_find_special(in, end);
+
+			if(in >= end) {
+				// sequence at the end of chunk is validated once it is complete
+				size_t incomplete = json_utf8_incomplete(run, end);
+				if(json_utf8_validate(run, end - incomplete)) goto error;
+				memcpy(validator->utf8, end - incomplete, incomplete);
+				validator->utf8_length = incomplete;
+				return JSON_ERROR_OK;
+			}
+
+			if(json_utf8_validate(run, in)) goto error;
+			c = *in++;
+			if(c == '"') validator->state = validator->key ? JSON_VALIDATOR_COLON : JSON_VALIDATOR_AFTER_VALUE;
+			else if(c == '\\') validator->state = JSON_VALIDATOR_STRING_ESCAPE;
+			else goto error; // control characters
+			continue;
+		}
+
+		case JSON_VALIDATOR_STRING_ESCAPE:
+			c = json_escape_table[c];
+			if(!c) goto error;
+			in++;
+			if(c == 'u') {
+				validator->hex_digits = 4;
+				validator->state = JSON_VALIDATOR_STRING_HEX;
+			} else {
+				validator->state = JSON_VALIDATOR_STRING;
+			}
+			continue;
+
+		case JSON_VALIDATOR_STRING_HEX:
+			if(json_hex_table[c] < 0) goto error;
+			in++;
+			if(--validator->hex_digits == 0) validator->state = JSON_VALIDATOR_STRING;
+			continue;
+
+		case JSON_VALIDATOR_LITERAL:
+			if(c != *validator->literal) goto error;
+			in++;
+			if(*++validator->literal == '\0') validator->state = JSON_VALIDATOR_AFTER_VALUE;
+			continue;
+
+		case JSON_VALIDATOR_NUMBER_SIGN:
+			if(c == '0') validator->state = JSON_VALIDATOR_NUMBER_ZERO;
+			else if(c >= '1' && c <= '9') validator->state = JSON_VALIDATOR_NUMBER_INTEGER;
+			else goto error;
+			in++;
+			continue;
+
+		case JSON_VALIDATOR_NUMBER_INTEGER:
+			while(in < end && *in >= '0' && *in <= '9') in++;
+			if(in >= end) return JSON_ERROR_OK;
+			c = *in;
+			/* fallthrough */
+		case JSON_VALIDATOR_NUMBER_ZERO:
+			if(c == '.') {
+				validator->state = JSON_VALIDATOR_NUMBER_POINT;
+				in++;
+			} else if(c == 'e' || c == 'E') {
+				validator->state = JSON_VALIDATOR_NUMBER_EXPONENT;
+				in++;
+			} else {
+				validator->state = JSON_VALIDATOR_AFTER_VALUE;
+			}
+			continue;
+
+		case JSON_VALIDATOR_NUMBER_POINT:
+			if(c < '0' || c > '9') goto error;
+			validator->state = JSON_VALIDATOR_NUMBER_FRACTION;
+			in++;
+			continue;
+
+		case JSON_VALIDATOR_NUMBER_FRACTION:
+			while(in < end && *in >= '0' && *in <= '9') in++;
+			if(in >= end) return JSON_ERROR_OK;
+			if(*in == 'e' || *in == 'E') {
+				validator->state = JSON_VALIDATOR_NUMBER_EXPONENT;
+				in++;
+			} else {
+				validator->state = JSON_VALIDATOR_AFTER_VALUE;
+			}
+			continue;
+
+		case JSON_VALIDATOR_NUMBER_EXPONENT:
+			if(c == '+' || c == '-') validator->state = JSON_VALIDATOR_NUMBER_EXPONENT_SIGN;
+			else if(c >= '0' && c <= '9') validator->state = JSON_VALIDATOR_NUMBER_EXPONENT_DIGITS;
+			else goto error;
+			in++;
+			continue;
+
+		case JSON_VALIDATOR_NUMBER_EXPONENT_SIGN:
+			if(c < '0' || c > '9') goto error;
+			validator->state = JSON_VALIDATOR_NUMBER_EXPONENT_DIGITS;
+			in++;
+			continue;
+
+		case JSON_VALIDATOR_NUMBER_EXPONENT_DIGITS:
+			while(in < end && *in >= '0' && *in <= '9') in++;
+			if(in >= end) return JSON_ERROR_OK;
+			validator->state = JSON_VALIDATOR_AFTER_VALUE;
+			continue;
+
+		case JSON_VALIDATOR_ERROR:
+			return JSON_ERROR_UNEXPECTED_TOKEN;
+
+		default:
+			break;
+		}
+
+		// states between tokens
+		if(c == 0x20 || c == 0x09 || c == 0x0A || c == 0x0D) {
+			in++;
+			continue;
+		}
+
+		switch(validator->state) {
+		case JSON_VALIDATOR_KEY:
+			if(c == '}') goto close;
+			if(c != '"') goto error;
+			validator->key = 1;
+			validator->state = JSON_VALIDATOR_STRING;
+			in++;
+			continue;
+
+		case JSON_VALIDATOR_COLON:
+			if(c != ':') goto error;
+			validator->state = JSON_VALIDATOR_VALUE;
+			in++;
+			continue;
+
+		case JSON_VALIDATOR_AFTER_VALUE:
+			if(validator->depth == 0) goto error;
+			if(c == ',') {
+				validator->state = json_validator_top(validator) ? JSON_VALIDATOR_KEY : JSON_VALIDATOR_VALUE;
+				in++;
+				continue;
+			}
+			if(c == (json_validator_top(validator) ? '}' : ']')) goto close;
+			goto error;
+
+		case JSON_VALIDATOR_ARRAY_START:
+			if(c == ']') goto close;
+			/* fallthrough */
+		case JSON_VALIDATOR_VALUE:
+			switch(c) {
+			case '"':
+				validator->key = 0;
+				validator->state = JSON_VALIDATOR_STRING;
+				break;
+			case '-':
+				validator->state = JSON_VALIDATOR_NUMBER_SIGN;
+				break;
+			case '0':
+				validator->state = JSON_VALIDATOR_NUMBER_ZERO;
+				break;
+			case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+				validator->state = JSON_VALIDATOR_NUMBER_INTEGER;
+				break;
+			case '{':
+				if(json_validator_push(validator, 1)) goto error;
+				validator->state = JSON_VALIDATOR_KEY;
+				break;
+			case '[':
+				if(json_validator_push(validator, 0)) goto error;
+				validator->state = JSON_VALIDATOR_ARRAY_START;
+				break;
+			case 't':
+				validator->literal = "rue";
+				validator->state = JSON_VALIDATOR_LITERAL;
+				break;
+			case 'f':
+				validator->literal = "alse";
+				validator->state = JSON_VALIDATOR_LITERAL;
+				break;
+			case 'n':
+				validator->literal = "ull";
+				validator->state = JSON_VALIDATOR_LITERAL;
+				break;
+			default:
+				goto error;
+			}
+			in++;
+			continue;
+
+		default:
+			assert(0);
+		}
+
+	 close:
+
+		validator->depth--;
+		validator->state = JSON_VALIDATOR_AFTER_VALUE;
+		in++;
+	}
+
+	return JSON_ERROR_OK;
+
+ error:
+
+	validator->state = JSON_VALIDATOR_ERROR;
+
+	return JSON_ERROR_UNEXPECTED_TOKEN;
+}
+
+
+// Checks that complete input was exactly one value
+enum json_error json_validator_finish(struct json_validator* validator) {
+	if(validator->state == JSON_VALIDATOR_ERROR) return JSON_ERROR_UNEXPECTED_TOKEN;
+	if(validator->depth != 0) return JSON_ERROR_UNEXPECTED_END;
+
+	switch(validator->state) {
+	case JSON_VALIDATOR_AFTER_VALUE:
+	case JSON_VALIDATOR_NUMBER_ZERO:
+	case JSON_VALIDATOR_NUMBER_INTEGER:
+	case JSON_VALIDATOR_NUMBER_FRACTION:
+	case JSON_VALIDATOR_NUMBER_EXPONENT_DIGITS:
+		return JSON_ERROR_OK;
+	default:
+		return JSON_ERROR_UNEXPECTED_END;
+	}
+}
+
+
+/********************/
+/** JSON generator **/
+/********************/
+
+
+int json_encode_string(const unsigned char* in, size_t length, struct buffer* out);
+
+void print_value(struct output*, const struct json_value*, unsigned int);
+void print_string(struct output*, const struct json_string*);
+void print_number(struct output*, const struct json_number*);
+void print_object(struct output*, const struct json_object*, unsigned int);
+void print_array(struct output*, const struct json_array*, unsigned int);
+void print_boolean(struct output*, const struct json_boolean*);
+void print_null(struct output*);
+void print_unparsed(struct output*, const struct json_unparsed*, unsigned int);
+int print_keys(struct output*, const struct json_value*);
+void print_value_compact(struct output*, const struct json_value*, unsigned int);
+void print_object_compact(struct output*, const struct json_object*);
+void print_array_compact(struct output*, const struct json_array*);
+
+
+void print_value(struct output* out, const struct json_value* value, unsigned int level) {
+	switch(value->type) {
+//	case JSON_TYPE_UNDEFINED:
+//		output_string(out, "undefined");
+//		break;
+	case JSON_TYPE_STRING:
+		print_string(out, &value->value.string);
+		break;
+	case JSON_TYPE_NUMBER:
+		print_number(out, &value->value.number);
+		break;
+	case JSON_TYPE_OBJECT:
+		print_object(out, &value->value.object, level);
+		break;
+	case JSON_TYPE_ARRAY:
+		print_array(out, &value->value.array, level);
+		break;
+	case JSON_TYPE_BOOLEAN:
+		print_boolean(out, &value->value.boolean);
+		break;
+	case JSON_TYPE_NULL:
+		print_null(out);
+		break;
+	case JSON_TYPE_UNPARSED:
+		print_unparsed(out, &value->value.unparsed, level);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+
+// String is encoded directly into the output buffer
+void print_string(struct output* out, const struct json_string* string) {
+	const char* content = string->content;
+	size_t length = string->length;
+
+	if(string->escaped) {
+		out->scratch.length = 0;
+		json_string_decode(string, &out->scratch);
+		content = out->scratch.content;
+		length = out->scratch.length;
+	}
+
+	output_char(out, '"');
+	if(json_encode_string((const unsigned char*)content, length, &out->buffer)) out->invalid = 1;
+	output_char(out, '"');
+}
+
+
+void print_number(struct output* out, const struct json_number* number) {
+	output_write(out, number->content, number->length);
+}
+
+
+void print_object(struct output* out, const struct json_object* object, unsigned int level) {
+	output_char(out, '{');
+
+	size_t i;
+	for(i = 0; i < object->length; i++) {
+		if(i) output_char(out, ',');
+		output_newline(out, level + 1);
+		print_string(out, &object->keys[i]);
+		output_write(out, " : ", 3);
+		print_value(out, &object->values[i], level + 1);
+	}
+
+	output_newline(out, level);
+	output_char(out, '}');
+}
+
+
+void print_array(struct output* out, const struct json_array* array, unsigned int level) {
+	output_char(out, '[');
+
+	size_t i;
+	for(i = 0; i < array->length; i++) {
+		if(i) output_char(out, ',');
+		output_newline(out, level + 1);
+		print_value(out, &array->values[i], level + 1);
+	}
+
+	output_newline(out, level);
+	output_char(out, ']');
+}
+
+
+void print_boolean(struct output* out, const struct json_boolean* boolean) {
+	if(boolean->value) output_write(out, "true", 4);
+	else output_write(out, "false", 5);
+}
+
+
+void print_null(struct output* out) {
+	output_write(out, "null", 4);
+}
+
+
+// Value is parsed into temporary arena, so only one unparsed value is materialized at a time
+// Parser and arena reused by all unparsed values printed to one output (siblings of a value set deep in a wide
+// object are often printed one by one)
+struct output_unparsed {
+	struct arena arena;
+	struct json_parser parser;
+};
+
+
+void output_unparsed_free(struct output_unparsed* unparsed) {
+	if(unparsed == NULL) return;
+	json_parser_free(&unparsed->parser);
+	arena_free(&unparsed->arena);
+	free(unparsed);
+}
+
+
+void print_unparsed(struct output* out, const struct json_unparsed* unparsed, unsigned int level) {
+	struct output_unparsed* scratch = out->unparsed;
+
+	if(scratch == NULL) {
+		scratch = out->unparsed = malloc(sizeof(struct output_unparsed));
+		scratch->arena = (struct arena){ .chunk = NULL, .chunk_size = 4096, .huge_pages = 0 };
+		// depth was checked when span was skipped
+		scratch->parser = (struct json_parser){ .arena = &scratch->arena, .max_depth = SIZE_MAX };
+	}
+
+	// scanned value is fully parsed, so printing it does not get here again while the arena is in use
+	const char* in = unparsed->content;
+	struct json_value value;
+	json_parser_scan_value(&scratch->parser, &in, in + unparsed->length, &value);
+
+	out->print(out, &value, level);
+
+	arena_reset(&scratch->arena);
+}
+
+
+// Compact style - no whitespace at all, `level` is unused
+
+void print_value_compact(struct output* out, const struct json_value* value, unsigned int level) {
+	switch(value->type) {
+	case JSON_TYPE_STRING:
+		print_string(out, &value->value.string);
+		break;
+	case JSON_TYPE_NUMBER:
+		print_number(out, &value->value.number);
+		break;
+	case JSON_TYPE_OBJECT:
+		print_object_compact(out, &value->value.object);
+		break;
+	case JSON_TYPE_ARRAY:
+		print_array_compact(out, &value->value.array);
+		break;
+	case JSON_TYPE_BOOLEAN:
+		print_boolean(out, &value->value.boolean);
+		break;
+	case JSON_TYPE_NULL:
+		print_null(out);
+		break;
+	case JSON_TYPE_UNPARSED:
+		print_unparsed(out, &value->value.unparsed, 0);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+
+void print_object_compact(struct output* out, const struct json_object* object) {
+	output_char(out, '{');
+
+	size_t i;
+	for(i = 0; i < object->length; i++) {
+		if(i) output_char(out, ',');
+		print_string(out, &object->keys[i]);
+		output_char(out, ':');
+		print_value_compact(out, &object->values[i], 0);
+	}
+
+	output_char(out, '}');
+}
+
+
+void print_array_compact(struct output* out, const struct json_array* array) {
+	output_char(out, '[');
+
+	size_t i;
+	for(i = 0; i < array->length; i++) {
+		if(i) output_char(out, ',');
+		print_value_compact(out, &array->values[i], 0);
+	}
+
+	output_char(out, ']');
+}
+
+
+// Prints keys of object, one per line. Returns -1 if value is not an object.
+int print_keys(struct output* out, const struct json_value* value) {
+	if(value->type != JSON_TYPE_OBJECT) return -1;
+
+	const struct json_object* object = &value->value.object;
+
+	size_t i;
+	for(i = 0; i < object->length; i++) {
+		print_string(out, &object->keys[i]);
+		output_char(out, '\n');
+	}
+
+	return 0;
+}
+
+
+/****************/
+/** JSON utils **/
+/****************/
+
+
+struct path {
+	struct json_string* components;
+	size_t length;
+};
+
+
+// Operation of JSON Patch (RFC 6902)
+enum json_patch_op {
+	JSON_PATCH_ADD,
+	JSON_PATCH_REMOVE,
+	JSON_PATCH_REPLACE,
+	JSON_PATCH_MOVE,
+	JSON_PATCH_COPY,
+	JSON_PATCH_TEST,
+};
+
+struct json_patch_operation {
+	enum json_patch_op op;
+	struct path path;
+	struct path from; // `move` and `copy` only
+	const struct json_value* value; // `add`, `replace` and `test` only
+};
+
+// Containers along the last resolved path. Patch operations mostly work on neighbouring paths, so only the part
+// of path that differs from the previous one has to be resolved.
+struct json_cursor {
+	const struct path* path;
+	struct json_value** values; // values[i] is the container at the first i components of `path`, values[0] is root
+	size_t length; // number of valid values
+	size_t size;
+};
+
+
+// FIXME: hacking with const
+int json_resolve_path(struct arena*, const struct json_value*, const struct path*, const struct json_value** out);
+enum json_error json_parser_scan_path(struct json_parser*, const char**, const char*, const struct path*, size_t, struct json_value*, int*, int);
+enum json_error json_parser_scan_spine(struct json_parser*, const char**, const char*, const struct path*, size_t, struct json_value*);
+struct json_value* json_object_resolve(struct arena*, const struct json_object*, const struct json_string*);
+int json_parse_uint64(const char*, size_t, uint64_t*);
+int json_string_to_index(const struct json_string*, size_t*);
+void json_number_convert(struct json_number*);
+int json_number_to_uint64(struct json_number*, uint64_t*);
+int json_number_to_int64(struct json_number*, int64_t*);
+double json_number_to_double(struct json_number*);
+int json_number_compare(struct json_number*, struct json_number*);
+void json_object_set(struct arena*, struct json_object*, const struct json_string*, const struct json_value*, struct json_value*);
+void json_array_set(struct arena*, struct json_array*, size_t, const struct json_value*, struct json_value*);
+void json_path_set(struct arena*, struct json_value*, const struct path*, const struct json_value*);
+void json_copy_spine(struct arena*, struct json_value*, const struct path*);
+void json_merge_patch(struct arena*, struct json_value*, const struct json_value*);
+void json_value_copy(struct arena*, const struct json_value*, struct json_value*);
+int json_value_equal(struct arena*, const struct json_value*, const struct json_value*);
+size_t json_patch_apply(struct arena*, struct json_value*, const struct json_patch_operation*, size_t);
+const char* json_type_name(enum json_type);
+int json_encode_string(const unsigned char*, size_t, struct buffer*);
+
+
+// Objects on the path get their key index allocated from `arena` (see `json_object_resolve`), which may be NULL
+int json_resolve_path(struct arena* arena, const struct json_value* in, const struct path* path, const struct json_value** out) {
+	int i;
+	for(i = 0; i < path->length; i++) {
+
+		const struct json_string* component = &path->components[i];
+
+		if(in->type == JSON_TYPE_OBJECT) {
+			in = json_object_resolve(arena, &in->value.object, component);
+			if(in == NULL) break;
+		} else if(in->type == JSON_TYPE_ARRAY) {
+
+			// because I do not trust standard number parsers and my use case is simplistic anyway
+			size_t index = 0;
+
+			if(json_string_to_index(component, &index) || index >= in->value.array.length) {
+				in = NULL;
+				break;
+			}
+
+			in = &in->value.array.values[index];
+		} else {
+			in = NULL;
+			break;
+		}
+	}
+
+	*out = in;
+
+	return i;
+}
+
+
+// Scans value while materializing only the value at `path` (starting from component `depth`) - everything else is
+// only validated and skipped. `*found` is set and `out` receives the value if the path could be resolved.
+// If `scalar` is set, object or array at path is skipped as well and `out` only gets its type.
+// As with `json_resolve_path`, the last one of duplicate keys is used.
+enum json_error json_parser_scan_path(struct json_parser* parser, const char** in, const char* end, const struct path* path, size_t depth, struct json_value* out, int* found, int scalar) {
+
+	assert(*in < end);
+
+	if(depth == path->length) {
+		enum json_error error;
+		if(scalar && (**in == '{' || **in == '[')) {
+			out->type = **in == '{' ? JSON_TYPE_OBJECT : JSON_TYPE_ARRAY;
+			error = json_parser_scan_value(parser, in, end, NULL);
+		} else {
+			error = json_parser_scan_value(parser, in, end, out);
+		}
+		if(!error) *found = 1;
+		return error;
+	}
+
+	if(**in != '{' && **in != '[') return json_parser_scan_value(parser, in, end, NULL);
+
+	const struct json_string* component = &path->components[depth];
+	char close = **in == '{' ? '}' : ']';
+	size_t target = SIZE_MAX;
+
+	if(close == ']' && json_string_to_index(component, &target)) target = SIZE_MAX;
+
+	enum json_error error = json_parser_enter(parser);
+	if(error) return error;
+
+	(*in)++;
+
+	size_t index;
+	for(index = 0; ; index++) {
+		struct json_string key;
+		int more;
+		error = json_parser_next_member(parser, in, end, close, index, &key, &more);
+		if(error || !more) break;
+
+		const char* tmp_pos = *in;
+
+		if(close == '}' ? json_string_equals(&key, component) : index == target) {
+			*found = 0;
+			error = json_parser_scan_path(parser, in, end, path, depth + 1, out, found, scalar);
+		} else {
+			error = json_parser_scan_value(parser, in, end, NULL);
+		}
+
+		if(!error && *in == tmp_pos) error = JSON_ERROR_UNEXPECTED_TOKEN;
+		if(error) break;
+	}
+
+	parser->depth--;
+
+	return error;
+}
+
+
+// Scans value while materializing only containers along `path` (starting from component `depth`) and the container
+// at the end of it. Everything else is validated and kept as unparsed text, so the whole value can still be
+// modified along the path and printed.
+enum json_error json_parser_scan_spine(struct json_parser* parser, const char** in, const char* end, const struct path* path, size_t depth, struct json_value* out) {
+
+	assert(*in < end);
+
+	if(**in != '{' && **in != '[') return json_parser_scan_value(parser, in, end, out);
+
+	const struct json_string* component = depth < path->length ? &path->components[depth] : NULL;
+	char close = **in == '{' ? '}' : ']';
+	uint64_t target = UINT64_MAX;
+
+	if(close == ']' && component && !component->escaped) {
+		if(json_parse_uint64(component->content, component->length, &target)) target = UINT64_MAX;
+	}
+
+	size_t keys_base = parser->keys_length, values_base = parser->values_length;
+
+	enum json_error error = json_parser_enter(parser);
+	if(error) return error;
+
+	(*in)++;
+
+	size_t index;
+	for(index = 0; ; index++) {
+		struct json_string key;
+		int more;
+		error = json_parser_next_member(parser, in, end, close, index, &key, &more);
+		if(error) goto error;
+		if(!more) break;
+
+		const char* tmp_pos = *in;
+		struct json_value value;
+
+		if(component && (close == '}' ? json_string_equals(&key, component) : index == target)) {
+			error = json_parser_scan_spine(parser, in, end, path, depth + 1, &value);
+		} else {
+			error = json_parser_scan_value(parser, in, end, NULL);
+			value.type = JSON_TYPE_UNPARSED;
+			value.value.unparsed.content = tmp_pos;
+			value.value.unparsed.length = *in - tmp_pos;
+		}
+
+		if(error) goto error;
+		if(*in == tmp_pos) {
+			error = JSON_ERROR_UNEXPECTED_TOKEN;
+			goto error;
+		}
+
+		if(close == '}') json_parser_push_key(parser, &key);
+		json_parser_push_value(parser, &value);
+	}
+
+	if(close == '}') {
+		out->type = JSON_TYPE_OBJECT;
+		out->value.object.keys = arena_copy(parser->arena, &parser->keys[keys_base], index * sizeof(struct json_string));
+		out->value.object.values = arena_copy(parser->arena, &parser->values[values_base], index * sizeof(struct json_value));
+		out->value.object.length = index;
+		out->value.object.capacity = parser->shared ? 0 : index;
+		out->value.object.index = NULL;
+	} else {
+		out->type = JSON_TYPE_ARRAY;
+		out->value.array.values = arena_copy(parser->arena, &parser->values[values_base], index * sizeof(struct json_value));
+		out->value.array.length = index;
+		out->value.array.capacity = parser->shared ? 0 : index;
+	}
+
+ error:
+
+	parser->keys_length = keys_base;
+	parser->values_length = values_base;
+	parser->depth--;
+
+	return error;
+}
+
+
+// Large objects are looked up via hash index mapping each key to position of its last occurrence. Index is built on
+// first lookup, from `arena` (no index is built if it is NULL), and belongs to the object - copies of the object
+// must not share it. Deleted members are removed from the index in place, other changes that move members
+// invalidate it and it is rebuilt in the same table on next lookup (unless the object outgrew it).
+
+#define JSON_OBJECT_INDEX_THRESHOLD 32
+
+struct json_object_index {
+	size_t mask; // number of slots - 1
+	size_t length; // number of indexed members
+	size_t slots[]; // position of member + 1, 0 for empty slot
+};
+
+
+// Adds member at `position` to index. Returns -1 if index is too full.
+int json_object_index_insert(struct json_object* object, size_t position) {
+	struct json_object_index* index = object->index;
+	const struct json_string* key = &object->keys[position];
+	size_t slot = json_string_hash(key) & index->mask;
+
+	if((index->length + 1) * 2 > index->mask + 1) return -1;
+
+	while(index->slots[slot]) {
+		if(json_string_equals(&object->keys[index->slots[slot] - 1], key)) {
+			index->slots[slot] = position + 1;
+			index->length = position + 1;
+			return 0;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+
+	index->slots[slot] = position + 1;
+	index->length = position + 1;
+
+	return 0;
+}
+
+
+// Removes member at `position` (the last occurrence of its key) from valid index before it is removed from object.
+// Key is mapped to its previous occurrence if there is any and positions of the following members are shifted.
+void json_object_index_remove(struct json_object* object, size_t position) {
+	struct json_object_index* index = object->index;
+	const struct json_string* key = &object->keys[position];
+	size_t slot = json_string_hash(key) & index->mask;
+	size_t i;
+
+	while(index->slots[slot] != position + 1) slot = (slot + 1) & index->mask;
+
+	for(i = position; i-- > 0;) {
+		if(json_string_equals(&object->keys[i], key)) break;
+	}
+
+	if(i != SIZE_MAX) {
+		index->slots[slot] = i + 1;
+	} else {
+		// backward shift keeps probe sequences of the following keys unbroken without tombstones
+		size_t hole = slot;
+		size_t next = (slot + 1) & index->mask;
+
+		while(index->slots[next]) {
+			size_t home = json_string_hash(&object->keys[index->slots[next] - 1]) & index->mask;
+			if(((next - home) & index->mask) >= ((next - hole) & index->mask)) {
+				index->slots[hole] = index->slots[next];
+				hole = next;
+			}
+			next = (next + 1) & index->mask;
+		}
+
+		index->slots[hole] = 0;
+	}
+
+	for(i = 0; i <= index->mask; i++) {
+		if(index->slots[i] > position + 1) index->slots[i]--;
+	}
+
+	index->length--;
+}
+
+
+// Marks index as out of date, its table is reused when it is rebuilt
+void json_object_index_invalidate(struct json_object* object) {
+	if(object->index) object->index->length = SIZE_MAX;
+}
+
+
+void json_object_index_build(struct arena* arena, struct json_object* object) {
+	size_t size = 64;
+	while(size < object->length * 2) size *= 2;
+
+	// one extra doubling leaves room for members added later
+	size *= 2;
+
+	if(object->index == NULL || object->index->mask + 1 < size) {
+		object->index = arena_alloc(arena, sizeof(struct json_object_index) + size * sizeof(size_t));
+	} else {
+		size = object->index->mask + 1;
+	}
+
+	object->index->mask = size - 1;
+	object->index->length = 0;
+	memset(object->index->slots, 0, size * sizeof(size_t));
+
+	size_t i;
+	for(i = 0; i < object->length; i++) {
+		json_object_index_insert(object, i);
+	}
+}
+
+
+struct json_value* json_object_resolve(struct arena* arena, const struct json_object* object, const struct json_string* key) {
+	const struct json_object_index* index = object->index;
+
+	if(object->length >= JSON_OBJECT_INDEX_THRESHOLD && (index == NULL || index->length != object->length) && arena) {
+		// index is not part of the value, so it is added even to "const" objects
+		json_object_index_build(arena, (struct json_object*)object);
+		index = object->index;
+	}
+
+	if(index && index->length == object->length) {
+		size_t slot = json_string_hash(key) & index->mask;
+
+		while(index->slots[slot]) {
+			size_t position = index->slots[slot] - 1;
+			if(json_string_equals(&object->keys[position], key)) return &object->values[position];
+			slot = (slot + 1) & index->mask;
+		}
+
+		return NULL;
+	}
+
+	struct json_value* property_value = NULL;
+	size_t ii;
+	for(ii = 0; ii < object->length; ii++) {
+		if(json_string_equals(&object->keys[ii], key)) {
+			property_value = &object->values[ii];
+		}
+	}
+
+	return property_value;
+}
+
+
+// Parses unsigned decimal integer. Returns -1 if `in` contains anything else than digits and 1 on overflow.
+int json_parse_uint64(const char* in, size_t length, uint64_t* out) {
+	if(length == 0) return -1;
+
+	uint64_t value = 0;
+	size_t i;
+	for(i = 0; i < length; i++) {
+		unsigned int n = (unsigned char)in[i] - '0';
+		if(n > 9) return -1;
+
+		// up to 19 digits always fit
+		if(i >= 19 && (value > UINT64_MAX / 10 || value * 10 > UINT64_MAX - n)) {
+			while(++i < length) {
+				if((unsigned char)in[i] - '0' > 9) return -1;
+			}
+			return 1;
+		}
+
+		value = value * 10 + n;
+	}
+
+	*out = value;
+	return 0;
+}
+
+
+int json_string_to_index(const struct json_string* string, size_t* out) {
+	uint64_t index;
+
+	if(string->escaped) return -1;
+
+	int r = json_parse_uint64(string->content, string->length, &index);
+	if(r < 0) return -1;
+
+	if(r > 0 || index > SIZE_MAX) {
+		fprintf(stderr, "Overflow\n");
+		return -1;
+	}
+
+	*out = index;
+	return 0;
+}
+
+
+// Converts number and caches the result in `number`. Integers are kept exact as long as they fit into 64 bits;
+// everything else is converted to double - directly if mantissa and exponent are small enough
+// to make the result exact (Clinger's fast path) and through strtod otherwise.
+void json_number_convert(struct json_number* number) {
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	if(number->flags & JSON_NUMBER_CONVERTED) return;
+
+	const char* in = number->content;
+	const char* end = in + number->length;
+	int negative = 0;
+
+	if(*in == '-') {
+		negative = 1;
+		in++;
+	}
+
+	const char* digits = in;
+	while(in < end && *in >= '0' && *in <= '9') in++;
+
+	number->flags = JSON_NUMBER_CONVERTED | (negative ? JSON_NUMBER_NEGATIVE : 0);
+
+	if(in == end && json_parse_uint64(digits, in - digits, &number->value.integer) == 0) {
+		number->flags |= JSON_NUMBER_INTEGER;
+		return;
+	}
+
+	// mantissa with up to 19 significant digits and decimal exponent
+	uint64_t mantissa = 0;
+	int significant = 0, truncated = 0;
+	int64_t exponent = 0;
+
+	for(in = digits; in < end && *in >= '0' && *in <= '9'; in++) {
+		if(mantissa == 0 && *in == '0') continue;
+		if(significant < 19) {
+			mantissa = mantissa * 10 + (*in - '0');
+			significant++;
+		} else {
+			exponent++;
+			if(*in != '0') truncated = 1;
+		}
+	}
+
+	if(in < end && *in == '.') {
+		for(in++; in < end && *in >= '0' && *in <= '9'; in++) {
+			if(mantissa == 0 && *in == '0') {
+				exponent--;
+				continue;
+			}
+			if(significant < 19) {
+				mantissa = mantissa * 10 + (*in - '0');
+				significant++;
+				exponent--;
+			} else if(*in != '0') {
+				truncated = 1;
+			}
+		}
+	}
+
+	if(in < end && (*in == 'e' || *in == 'E')) {
+		in++;
+		int exponent_negative = *in == '-';
+		if(*in == '-' || *in == '+') in++;
+
+		int64_t e = 0;
+		for(; in < end; in++) {
+			if(e < 100000) e = e * 10 + (*in - '0');
+		}
+		exponent += exponent_negative ? -e : e;
+	}
+
+	if(!truncated && mantissa <= (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22) {
+		double value = mantissa;
+		value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+		number->value.real = negative ? -value : value;
+		return;
+	}
+
+	char short_buffer[64];
+	char* copy = number->length < sizeof(short_buffer) ? short_buffer : malloc(number->length + 1);
+	memcpy(copy, number->content, number->length);
+	copy[number->length] = '\0';
+	number->value.real = strtod(copy, NULL);
+	if(copy != short_buffer) free(copy);
+}
+
+
+int json_number_to_uint64(struct json_number* number, uint64_t* out) {
+	json_number_convert(number);
+
+	if(!(number->flags & JSON_NUMBER_INTEGER)) return -1;
+	if(number->flags & JSON_NUMBER_NEGATIVE && number->value.integer != 0) return -1;
+
+	*out = number->value.integer;
+	return 0;
+}
+
+
+int json_number_to_int64(struct json_number* number, int64_t* out) {
+	json_number_convert(number);
+
+	if(!(number->flags & JSON_NUMBER_INTEGER)) return -1;
+
+	uint64_t magnitude = number->value.integer;
+
+	if(number->flags & JSON_NUMBER_NEGATIVE) {
+		if(magnitude > (uint64_t)INT64_MAX + 1) return -1;
+		*out = magnitude == (uint64_t)INT64_MAX + 1 ? INT64_MIN : -(int64_t)magnitude;
+	} else {
+		if(magnitude > INT64_MAX) return -1;
+		*out = magnitude;
+	}
+
+	return 0;
+}
+
+
+double json_number_to_double(struct json_number* number) {
+	json_number_convert(number);
+
+	if(number->flags & JSON_NUMBER_INTEGER) {
+		double value = number->value.integer;
+		return number->flags & JSON_NUMBER_NEGATIVE ? -value : value;
+	}
+
+	return number->value.real;
+}
+
+
+// Returns negative value, 0 or positive value if `a` is less than, equal to or greater than `b`. Integers are
+// compared exactly, anything else as doubles.
+int json_number_compare(struct json_number* a, struct json_number* b) {
+	json_number_convert(a);
+	json_number_convert(b);
+
+	if(a->flags & b->flags & JSON_NUMBER_INTEGER) {
+		int a_negative = a->flags & JSON_NUMBER_NEGATIVE && a->value.integer;
+		int b_negative = b->flags & JSON_NUMBER_NEGATIVE && b->value.integer;
+
+		if(a_negative != b_negative) return a_negative ? -1 : 1;
+		if(a->value.integer == b->value.integer) return 0;
+		return (a->value.integer < b->value.integer) != a_negative ? -1 : 1;
+	}
+
+	double x = json_number_to_double(a), y = json_number_to_double(b);
+	return x < y ? -1 : x > y;
+}
+
+
+// Makes sure that object owns its members and has room for `length` of them. Storage grows at least twice,
+// so appending members one at a time takes amortized constant time.
+void json_object_reserve(struct arena* arena, struct json_object* object, size_t length) {
+	if(object->capacity >= object->length && object->capacity >= length) return;
+
+	size_t capacity = object->capacity * 2;
+	if(capacity < length) capacity = length;
+	if(capacity < 4) capacity = 4;
+
+	// index of shared object stays with the original
+	if(object->capacity < object->length) object->index = NULL;
+
+	object->keys = arena_realloc(arena, object->keys, object->length * sizeof(struct json_string), capacity * sizeof(struct json_string));
+	object->values = arena_realloc(arena, object->values, object->length * sizeof(struct json_value), capacity * sizeof(struct json_value));
+	object->capacity = capacity;
+}
+
+
+void json_array_reserve(struct arena* arena, struct json_array* array, size_t length) {
+	if(array->capacity >= array->length && array->capacity >= length) return;
+
+	size_t capacity = array->capacity * 2;
+	if(capacity < length) capacity = length;
+	if(capacity < 4) capacity = 4;
+
+	array->values = arena_realloc(arena, array->values, array->length * sizeof(struct json_value), capacity * sizeof(struct json_value));
+	array->capacity = capacity;
+}
+
+
+void json_object_set(struct arena* arena, struct json_object* object, const struct json_string* key, const struct json_value* value, struct json_value* old_value) {
+	struct json_value* v = json_object_resolve(arena, object, key);
+	if(v) {
+		size_t index = v - object->values;
+
+		json_object_reserve(arena, object, object->length);
+
+//		if(old_key) *old_key = object->keys[index];			// FIXME: key will be dangling
+		if(old_value) *old_value = object->values[index];
+
+		if(value->type == JSON_TYPE_UNDEFINED) {
+			if(object->index && object->index->length == object->length) json_object_index_remove(object, index);
+			object->length--;
+			memmove(&object->keys[index], &object->keys[index+1], (object->length - index) * sizeof(struct json_string));
+			memmove(&object->values[index], &object->values[index+1], (object->length - index) * sizeof(struct json_value));
+		} else {
+			object->keys[index] = *key;
+			object->values[index] = *value;
+		}
+	} else if(value->type != JSON_TYPE_UNDEFINED) {
+		json_object_reserve(arena, object, object->length + 1);
+
+		object->keys[object->length] = *key;
+		object->values[object->length] = *value;
+
+		object->length++;
+		if(object->index && object->index->length == object->length - 1 && json_object_index_insert(object, object->length - 1)) {
+			json_object_index_invalidate(object);
+		}
+		if(old_value) old_value->type = JSON_TYPE_UNDEFINED;
+	}
+}
+
+
+void json_array_set(struct arena* arena, struct json_array* array, size_t index, const struct json_value* value, struct json_value* old_value) {
+	json_array_reserve(arena, array, index >= array->length ? index + 1 : array->length);
+
+	if(index >= array->length) {
+		// fill gap
+		size_t i;
+		for(i = array->length; i < index; i++) {
+			array->values[i].type = JSON_TYPE_NULL;
+		}
+		array->length = index + 1;
+
+		if(old_value) old_value->type = JSON_TYPE_UNDEFINED;
+	} else {
+		if(old_value) *old_value = array->values[index];
+	}
+	array->values[index] = *value;
+	if(value->type == JSON_TYPE_UNDEFINED) array->values[index].type = JSON_TYPE_NULL;
+}
+
+
+// Sets (or deletes, if `value` is undefined) value at `path`. Nothing is changed if container of the value cannot be
+// resolved. Key is copied into arena, so `path` does not have to outlive `root`. Shared containers along the path
+// are copied first. Empty path (JSON Pointer to the whole document) replaces `root`, which cannot be deleted.
+void json_path_set(struct arena* arena, struct json_value* root, const struct path* path, const struct json_value* value) {
+	if(path->length == 0) {
+		if(value->type != JSON_TYPE_UNDEFINED) *root = *value;
+		return;
+	}
+
+	struct path parent = { .components = path->components, .length = path->length - 1 };
+	struct json_value* resolved_value;
+
+	json_copy_spine(arena, root, &parent);
+
+	if(json_resolve_path(arena, root, &parent, (const struct json_value**)&resolved_value) != parent.length) return;
+
+	struct json_string key = path->components[parent.length];
+
+	if(resolved_value->type == JSON_TYPE_OBJECT) {
+		key.content = arena_copy(arena, key.content, key.length);
+		json_object_set(arena, &resolved_value->value.object, &key, value, NULL);
+	}
+
+	if(resolved_value->type == JSON_TYPE_ARRAY) {
+		size_t index;
+		if(!json_string_to_index(&key, &index)) {
+			json_array_set(arena, &resolved_value->value.array, index, value, NULL);
+		}
+	}
+}
+
+
+// Copies members of every shared container along `path` (including `root` and the container at the end of path),
+// so containers can be modified without affecting other values sharing them. Containers that own their members
+// are left as they are.
+void json_copy_spine(struct arena* arena, struct json_value* root, const struct path* path) {
+	struct json_value* value = root;
+	size_t i = 0;
+
+	while(value) {
+		if(value->type == JSON_TYPE_OBJECT) {
+			struct json_object* object = &value->value.object;
+			json_object_reserve(arena, object, object->length);
+
+			if(i >= path->length) break;
+			value = json_object_resolve(arena, object, &path->components[i]);
+		} else if(value->type == JSON_TYPE_ARRAY) {
+			struct json_array* array = &value->value.array;
+			json_array_reserve(arena, array, array->length);
+
+			size_t index;
+			if(i >= path->length || json_string_to_index(&path->components[i], &index) || index >= array->length) break;
+			value = &array->values[index];
+		} else {
+			break;
+		}
+
+		i++;
+	}
+}
+
+
+// Applies `patch` to `target` as described by RFC 7396. Members of target objects are looked up through their key
+// index, and removed members are only marked while patch is applied and dropped in a single pass afterwards,
+// so merging is linear in the size of both values. All occurrences of removed duplicate keys are dropped.
+void json_merge_patch(struct arena* arena, struct json_value* target, const struct json_value* patch) {
+	if(patch->type != JSON_TYPE_OBJECT) {
+		*target = *patch;
+		return;
+	}
+
+	if(target->type != JSON_TYPE_OBJECT) {
+		target->type = JSON_TYPE_OBJECT;
+		target->value.object.keys = NULL;
+		target->value.object.values = NULL;
+		target->value.object.length = target->value.object.capacity = 0;
+		target->value.object.index = NULL;
+	}
+
+	struct json_object* object = &target->value.object;
+	const struct json_object* members = &patch->value.object;
+	size_t removed = 0;
+	size_t i;
+
+	json_object_reserve(arena, object, object->length);
+
+	for(i = 0; i < members->length; i++) {
+		const struct json_value* value = &members->values[i];
+		struct json_value* member = json_object_resolve(arena, object, &members->keys[i]);
+
+		if(value->type == JSON_TYPE_NULL) {
+			if(member && member->type != JSON_TYPE_UNDEFINED) {
+				member->type = JSON_TYPE_UNDEFINED;
+				removed++;
+			}
+		} else if(member) {
+			if(member->type == JSON_TYPE_UNDEFINED) removed--;
+			json_merge_patch(arena, member, value);
+		} else {
+			struct json_value merged = { .type = JSON_TYPE_UNDEFINED };
+			json_merge_patch(arena, &merged, value);
+			json_object_set(arena, object, &members->keys[i], &merged, NULL);
+		}
+	}
+
+	if(removed == 0) return;
+
+	// member is dropped if the last occurrence of its key was removed; members are only moved towards the start,
+	// so the last occurrences are still in place when they are looked up
+	size_t length = 0;
+	for(i = 0; i < object->length; i++) {
+		if(json_object_resolve(arena, object, &object->keys[i])->type == JSON_TYPE_UNDEFINED) continue;
+
+		object->keys[length] = object->keys[i];
+		object->values[length] = object->values[i];
+		length++;
+	}
+
+	object->length = length;
+	json_object_index_invalidate(object);
+}
+
+
+// Copies `in` to `out`, so that either of them can be changed without affecting the other. Only containers that own
+// their members are copied - shared ones are never changed in place, so copies can keep sharing them.
+void json_value_copy(struct arena* arena, const struct json_value* in, struct json_value* out) {
+	*out = *in;
+
+	if(in->type == JSON_TYPE_OBJECT && in->value.object.length && in->value.object.capacity >= in->value.object.length) {
+		const struct json_object* object = &in->value.object;
+		struct json_object* copy = &out->value.object;
+
+		copy->keys = arena_copy(arena, object->keys, object->length * sizeof(struct json_string));
+		copy->values = arena_alloc(arena, object->length * sizeof(struct json_value));
+		copy->capacity = object->length;
+		copy->index = NULL;
+
+		size_t i;
+		for(i = 0; i < object->length; i++) json_value_copy(arena, &object->values[i], &copy->values[i]);
+	}
+
+	if(in->type == JSON_TYPE_ARRAY && in->value.array.length && in->value.array.capacity >= in->value.array.length) {
+		const struct json_array* array = &in->value.array;
+		struct json_array* copy = &out->value.array;
+
+		copy->values = arena_alloc(arena, array->length * sizeof(struct json_value));
+		copy->capacity = array->length;
+
+		size_t i;
+		for(i = 0; i < array->length; i++) json_value_copy(arena, &array->values[i], &copy->values[i]);
+	}
+}
+
+
+// Compares values as JSON Patch `test` operation does - numbers by their value, objects regardless of member order.
+// Members of `a` are looked up through key index (allocated from `arena` only for objects that own their members),
+// objects with duplicate keys in `b` are never equal.
+int json_value_equal(struct arena* arena, const struct json_value* a, const struct json_value* b) {
+	if(a->type != b->type) return 0;
+
+	switch(a->type) {
+	case JSON_TYPE_STRING:
+		return json_string_equals(&a->value.string, &b->value.string);
+	case JSON_TYPE_NUMBER: {
+		// numbers are converted in copies, values may be shared with other threads
+		struct json_number x = a->value.number, y = b->value.number;
+		json_number_convert(&x);
+		json_number_convert(&y);
+
+		if(x.flags & y.flags & JSON_NUMBER_INTEGER) {
+			return x.value.integer == y.value.integer &&
+			       (x.value.integer == 0 || (x.flags & JSON_NUMBER_NEGATIVE) == (y.flags & JSON_NUMBER_NEGATIVE));
+		}
+
+		return json_number_to_double(&x) == json_number_to_double(&y);
+	}
+	case JSON_TYPE_BOOLEAN:
+		return a->value.boolean.value == b->value.boolean.value;
+	case JSON_TYPE_NULL:
+		return 1;
+	case JSON_TYPE_ARRAY: {
+		const struct json_array* x = &a->value.array;
+		const struct json_array* y = &b->value.array;
+		if(x->length != y->length) return 0;
+
+		size_t i;
+		for(i = 0; i < x->length; i++) {
+			if(!json_value_equal(arena, &x->values[i], &y->values[i])) return 0;
+		}
+		return 1;
+	}
+	case JSON_TYPE_OBJECT: {
+		const struct json_object* x = &a->value.object;
+		const struct json_object* y = &b->value.object;
+		struct arena* index_arena = x->capacity >= x->length ? arena : NULL;
+		size_t i, distinct = 0;
+
+		for(i = 0; i < y->length; i++) {
+			const struct json_value* member = json_object_resolve(index_arena, x, &y->keys[i]);
+			if(member == NULL || !json_value_equal(arena, member, &y->values[i])) return 0;
+		}
+
+		// every key of `b` is in `a`, so it is enough to compare the number of keys
+		for(i = 0; i < x->length; i++) {
+			if(json_object_resolve(index_arena, x, &x->keys[i]) == &x->values[i]) distinct++;
+		}
+		return distinct == y->length;
+	}
+	default:
+		return 0;
+	}
+}
+
+
+// Member of object or element of array at `key`, NULL if there is none
+struct json_value* json_container_member(struct arena* arena, struct json_value* container, const struct json_string* key) {
+	if(container->type == JSON_TYPE_OBJECT) return json_object_resolve(arena, &container->value.object, key);
+
+	size_t index;
+	if(container->type != JSON_TYPE_ARRAY || json_string_to_index(key, &index) || index >= container->value.array.length) {
+		return NULL;
+	}
+
+	return &container->value.array.values[index];
+}
+
+
+void json_cursor_init(struct json_cursor* cursor, struct json_value* root) {
+	cursor->path = NULL;
+	cursor->size = 16;
+	cursor->values = malloc(cursor->size * sizeof(struct json_value*));
+	cursor->values[0] = root;
+	cursor->length = 1;
+}
+
+
+void json_cursor_free(struct json_cursor* cursor) {
+	free(cursor->values);
+}
+
+
+// Returns container at the first `depth` components of `path`, or NULL if there is none. The common prefix with
+// the previously resolved path is not resolved again. Containers along the path (including the returned one) are
+// made to own their members, so they can be changed in place.
+struct json_value* json_cursor_resolve(struct arena* arena, struct json_cursor* cursor, const struct path* path, size_t depth) {
+	if(cursor->size <= depth) {
+		while(cursor->size <= depth) cursor->size *= 2;
+		cursor->values = realloc(cursor->values, cursor->size * sizeof(struct json_value*));
+	}
+
+	size_t i = 1;
+	while(i < cursor->length && i <= depth) {
+		const struct json_string* a = &cursor->path->components[i - 1];
+		const struct json_string* b = &path->components[i - 1];
+		if(a->length != b->length || (a->length && memcmp(a->content, b->content, a->length) != 0)) break;
+		i++;
+	}
+
+	cursor->path = path;
+	cursor->length = i;
+
+	struct json_value* value = cursor->values[i - 1];
+
+	while(1) {
+		if(value->type == JSON_TYPE_OBJECT) {
+			json_object_reserve(arena, &value->value.object, value->value.object.length);
+		} else if(value->type == JSON_TYPE_ARRAY) {
+			json_array_reserve(arena, &value->value.array, value->value.array.length);
+		} else {
+			return NULL;
+		}
+
+		if(i > depth) return value;
+
+		value = json_container_member(arena, value, &path->components[i - 1]);
+		if(value == NULL) return NULL;
+
+		cursor->values[i++] = value;
+		cursor->length = i;
+	}
+}
+
+
+// Value at `path`, NULL if there is none
+struct json_value* json_cursor_get(struct arena* arena, struct json_cursor* cursor, const struct path* path) {
+	if(path->length == 0) return cursor->values[0];
+
+	struct json_value* container = json_cursor_resolve(arena, cursor, path, path->length - 1);
+	return container ? json_container_member(arena, container, &path->components[path->length - 1]) : NULL;
+}
+
+
+// Adds `value` to container as JSON Patch `add` operation does - object member is replaced or appended, array element
+// is inserted before element at `key` (`-` appends it)
+int json_patch_add(struct arena* arena, struct json_value* container, const struct json_string* key, const struct json_value* value) {
+	if(container->type == JSON_TYPE_OBJECT) {
+		struct json_string copy = *key;
+		copy.content = arena_copy(arena, key->content, key->length);
+		json_object_set(arena, &container->value.object, &copy, value, NULL);
+		return 0;
+	}
+
+	struct json_array* array = &container->value.array;
+	size_t index;
+
+	if(key->length == 1 && key->content[0] == '-') {
+		index = array->length;
+	} else if(json_string_to_index(key, &index) || index > array->length) {
+		return -1;
+	}
+
+	json_array_reserve(arena, array, array->length + 1);
+	memmove(&array->values[index + 1], &array->values[index], (array->length - index) * sizeof(struct json_value));
+	array->values[index] = *value;
+	array->length++;
+
+	return 0;
+}
+
+
+// Removes member or element at `key` from container and stores it in `out`
+int json_patch_remove(struct arena* arena, struct json_value* container, const struct json_string* key, struct json_value* out) {
+	struct json_value* member = json_container_member(arena, container, key);
+	if(member == NULL) return -1;
+
+	*out = *member;
+
+	if(container->type == JSON_TYPE_OBJECT) {
+		static const struct json_value undefined = { .type = JSON_TYPE_UNDEFINED };
+		json_object_set(arena, &container->value.object, key, &undefined, NULL);
+	} else {
+		struct json_array* array = &container->value.array;
+		size_t index = member - array->values;
+		array->length--;
+		memmove(&array->values[index], &array->values[index + 1], (array->length - index) * sizeof(struct json_value));
+	}
+
+	return 0;
+}
+
+
+int json_patch_operation_apply(struct arena* arena, struct json_cursor* cursor, const struct json_patch_operation* operation) {
+	const struct path* path = &operation->path;
+	struct json_value* container;
+	struct json_value value;
+
+	switch(operation->op) {
+	case JSON_PATCH_TEST: {
+		const struct json_value* current = json_cursor_get(arena, cursor, path);
+		return current && json_value_equal(arena, current, operation->value) ? 0 : -1;
+	}
+	case JSON_PATCH_REMOVE:
+		if(path->length == 0) return -1;
+
+		container = json_cursor_resolve(arena, cursor, path, path->length - 1);
+		if(container == NULL || json_patch_remove(arena, container, &path->components[path->length - 1], &value)) return -1;
+
+		// members of changed container may have moved
+		cursor->length = path->length;
+		return 0;
+	case JSON_PATCH_COPY: {
+		const struct json_value* source = json_cursor_get(arena, cursor, &operation->from);
+		if(source == NULL) return -1;
+
+		json_value_copy(arena, source, &value);
+		break;
+	}
+	case JSON_PATCH_MOVE: {
+		const struct path* from = &operation->from;
+
+		// value cannot be moved into itself, moving it to the same place does nothing
+		size_t i = 0;
+		while(i < from->length && i < path->length && from->components[i].length == path->components[i].length &&
+		      (from->components[i].length == 0 || memcmp(from->components[i].content, path->components[i].content, from->components[i].length) == 0)) i++;
+		if(i == from->length) return i == path->length && json_cursor_get(arena, cursor, from) ? 0 : -1;
+
+		container = json_cursor_resolve(arena, cursor, from, from->length - 1);
+		if(container == NULL || json_patch_remove(arena, container, &from->components[from->length - 1], &value)) return -1;
+
+		cursor->length = from->length;
+		break;
+	}
+	default:
+		value = *operation->value;
+	}
+
+	if(path->length == 0) {
+		*cursor->values[0] = value;
+		cursor->length = 1;
+		return 0;
+	}
+
+	container = json_cursor_resolve(arena, cursor, path, path->length - 1);
+	if(container == NULL) return -1;
+
+	const struct json_string* key = &path->components[path->length - 1];
+
+	if(operation->op == JSON_PATCH_REPLACE) {
+		struct json_value* member = json_container_member(arena, container, key);
+		if(member == NULL) return -1;
+		*member = value;
+	} else if(json_patch_add(arena, container, key, &value)) {
+		return -1;
+	}
+
+	cursor->length = path->length;
+
+	return 0;
+}
+
+
+// Applies JSON Patch (RFC 6902) operations to `root` in order and returns the number of applied operations, which is
+// less than `length` if some operation failed. Containers are changed in place, except for shared ones, which are
+// copied first - so a document loaded as shared is left intact and can be used as it was if the patch fails.
+size_t json_patch_apply(struct arena* arena, struct json_value* root, const struct json_patch_operation* operations, size_t length) {
+	struct json_cursor cursor;
+	json_cursor_init(&cursor, root);
+
+	size_t i;
+	for(i = 0; i < length; i++) {
+		if(json_patch_operation_apply(arena, &cursor, &operations[i])) break;
+	}
+
+	json_cursor_free(&cursor);
+
+	return i;
+}
+
+
+const char* json_type_name(enum json_type type) {
+	switch(type) {
+	case JSON_TYPE_OBJECT:
+		return "object";
+	case JSON_TYPE_ARRAY:
+		return "array";
+	case JSON_TYPE_STRING:
+		return "string";
+	case JSON_TYPE_NUMBER:
+		return "number";
+	case JSON_TYPE_BOOLEAN:
+		return "boolean";
+	case JSON_TYPE_NULL:
+		return "null";
+	default:
+		assert(0);
+		return NULL;
+	}
+}
+
+
+// Characters with two-character escape sequence
+const char json_short_escape_table[128] = {
+	['"'] = '"', ['\\'] = '\\', ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r', ['\t'] = 't'
+};
+
+
+// Returns position of the first byte that cannot be copied to JSON string as is (quote, backslash, control character
+// or non-ASCII character), or `end`
+const unsigned char* json_encode_find_escape_scalar(const unsigned char* in, const unsigned char* end) {
+	while(in < end) {
+		if(*in == '"' || *in == '\\' || *in < 0x20 || *in >= 0x7f) break;
+		in++;
+	}
+	return in;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// bytes >= 0x80 are negative when compared as signed, so one comparison catches both them and control characters
+
+__attribute__((target("sse4.2")))
+const unsigned char* json_encode_find_escape_sse42(const unsigned char* in, const unsigned char* end) {
+	const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+	const __m128i printable_min = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+
+	while(end - in >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)in);
+		__m128i escape = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+			_mm_or_si128(_mm_cmpgt_epi8(printable_min, v), _mm_cmpeq_epi8(v, del)));
+		int mask = _mm_movemask_epi8(escape);
+		if(mask) return in + __builtin_ctz(mask);
+		in += 16;
+	}
+
+	return json_encode_find_escape_scalar(in, end);
+}
+
+
+__attribute__((target("avx2")))
+const unsigned char* json_encode_find_escape_avx2(const unsigned char* in, const unsigned char* end) {
+	const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+	const __m256i printable_min = _mm256_set1_epi8(0x20), del = _mm256_set1_epi8(0x7f);
+
+	while(end - in >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)in);
+		__m256i escape = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+			_mm256_or_si256(_mm256_cmpgt_epi8(printable_min, v), _mm256_cmpeq_epi8(v, del)));
+		uint32_t mask = _mm256_movemask_epi8(escape);
+		if(mask) return in + __builtin_ctz(mask);
+		in += 32;
+	}
+
+	return json_encode_find_escape_scalar(in, end);
+}
+
+#endif
+
+
+const unsigned char* json_encode_find_escape(const unsigned char* in, const unsigned char* end) {
+	static const unsigned char* (*find)(const unsigned char*, const unsigned char*) = NULL;
+
+	if(find == NULL) {
+		find = json_encode_find_escape_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) find = json_encode_find_escape_avx2;
+		else if(__builtin_cpu_supports("sse4.2")) find = json_encode_find_escape_sse42;
+#endif
+	}
+
+	return find(in, end);
+}
+
+
+// Appends encoded string to `out`. Characters outside of BMP are encoded as surrogate pairs. Returns -1 if string
+// is not valid UTF-8.
+int json_encode_string(const unsigned char* in, size_t length, struct buffer* out) {
+	static const char hex[] = "0123456789abcdef";
+
+	uint32_t unicode_char = 0;
+	const unsigned char* end = in + length;
+
+	// most strings need no escaping at all
+	buffer_reserve(out, out->length + length + length / 8 + 8);
+
+	while(in < end) {
+		// copy everything up to the next character that needs escaping at once
+		const unsigned char* run = in;
+		in = json_encode_find_escape(in, end);
+		if(in != run) buffer_append(out, (const char*)run, in - run);
+
+		if(in >= end) break;
+
+		if(*in < 0x80 && json_short_escape_table[*in]) {
+			char b[2] = { '\\', json_short_escape_table[*in] };
+			buffer_append(out, b, 2);
+			in++;
+			continue;
+		}
+
+		if(*in < 0x20 || *in == 0x7f) {
+			unicode_char = *in++;
+		} else if(json_utf8_decode(&in, end, &unicode_char)) {
+			fprintf(stderr, "Invalid unicode sequence starting with %x\n", *in);
+			return -1;
+		}
+
+		if(unicode_char >= 0x10000) {
+			uint32_t high = 0xd800 + ((unicode_char - 0x10000) >> 10);
+			char b[6] = { '\\', 'u', hex[high >> 12], hex[(high >> 8) & 0xf], hex[(high >> 4) & 0xf], hex[high & 0xf] };
+			buffer_append(out, b, 6);
+			unicode_char = 0xdc00 + ((unicode_char - 0x10000) & 0x3ff);
+		}
+
+		char b[6] = { '\\', 'u', hex[unicode_char >> 12], hex[(unicode_char >> 8) & 0xf], hex[(unicode_char >> 4) & 0xf], hex[unicode_char & 0xf] };
+		buffer_append(out, b, 6);
+	}
+
+	return 0;
+}
+
+
+/*****************************/
+/** Format-preserving edits **/
+/*****************************/
+
+
+// Instead of printing modified document, original text is copied with a single span replaced. Containers being
+// modified are scanned with `json_parser_scan_spine`, so their members are unparsed values pointing into the text.
+// Inserted members follow layout of their neighbours.
+
+struct json_edit {
+	const char* start; // NULL if there is no change
+	size_t length; // of replaced text
+	struct buffer replacement;
+};
+
+
+// Start of member text, including key of object member
+const char* json_edit_member_start(const struct json_value* container, size_t index) {
+	if(container->type == JSON_TYPE_OBJECT) return container->value.object.keys[index].content - 1;
+	return container->value.array.values[index].value.unparsed.content;
+}
+
+
+const struct json_unparsed* json_edit_member_value(const struct json_value* container, size_t index) {
+	if(container->type == JSON_TYPE_OBJECT) return &container->value.object.values[index].value.unparsed;
+	return &container->value.array.values[index].value.unparsed;
+}
+
+
+const char* json_edit_member_end(const struct json_value* container, size_t index) {
+	const struct json_unparsed* value = json_edit_member_value(container, index);
+	return value->content + value->length;
+}
+
+
+// Text separating two members (comma and whitespace) as used in `container` text starting at `start`
+void json_edit_separator(const struct json_value* container, size_t length, const char* start, struct buffer* out) {
+	if(length >= 2) {
+		const char* from = json_edit_member_end(container, length - 2);
+		buffer_append(out, from, json_edit_member_start(container, length - 1) - from);
+	} else if(length == 1) {
+		buffer_append_char(out, ',');
+		buffer_append(out, start + 1, json_edit_member_start(container, 0) - (start + 1));
+	} else {
+		buffer_append_char(out, ',');
+	}
+}
+
+
+// Replaces `count` members of array at `index` with `values`. Array text spans from `start` to `end`.
+void json_edit_splice(const struct json_value* array, const char* start, const char* end, size_t index, size_t count, const struct json_unparsed* values, size_t values_length, struct json_edit* edit) {
+	size_t length = array->value.array.length;
+	struct buffer separator = { .content = NULL, .length = 0, .size = 0 };
+	size_t i;
+
+	json_edit_separator(array, length, start, &separator);
+
+	if(index > length) index = length;
+	if(count > length - index) count = length - index;
+
+	edit->replacement.length = 0;
+
+	if(count == 0 && values_length == 0) {
+		edit->start = NULL;
+	} else if(count == 0) {
+		// inserted before member at index, after last member or into empty array
+		if(index < length) {
+			edit->start = json_edit_member_start(array, index);
+		} else if(length) {
+			edit->start = json_edit_member_end(array, length - 1);
+			buffer_append(&edit->replacement, separator.content, separator.length);
+		} else {
+			edit->start = end - 1;
+		}
+		edit->length = 0;
+
+		for(i = 0; i < values_length; i++) {
+			if(i) buffer_append(&edit->replacement, separator.content, separator.length);
+			buffer_append(&edit->replacement, values[i].content, values[i].length);
+		}
+
+		if(index < length) buffer_append(&edit->replacement, separator.content, separator.length);
+	} else if(values_length) {
+		edit->start = json_edit_member_start(array, index);
+		edit->length = json_edit_member_end(array, index + count - 1) - edit->start;
+
+		for(i = 0; i < values_length; i++) {
+			if(i) buffer_append(&edit->replacement, separator.content, separator.length);
+			buffer_append(&edit->replacement, values[i].content, values[i].length);
+		}
+	} else {
+		// removed members take separator preceding them, or following them if they are first
+		if(index > 0) {
+			edit->start = json_edit_member_end(array, index - 1);
+			edit->length = json_edit_member_end(array, index + count - 1) - edit->start;
+		} else if(count < length) {
+			edit->start = json_edit_member_start(array, 0);
+			edit->length = json_edit_member_start(array, count) - edit->start;
+		} else {
+			edit->start = start + 1;
+			edit->length = (end - 1) - edit->start;
+		}
+	}
+
+	free(separator.content);
+}
+
+
+// Sets member `key` of `container` (spanning from `start` to `end`) to `value` text, or deletes it if `value` is NULL.
+// Same as `json_object_set` and `json_array_set`, the last one of duplicate keys is changed and deleted array
+// elements are set to null. Returns -1 if key cannot be encoded.
+int json_edit_set(const struct json_value* container, const char* start, const char* end, const struct json_string* key, const struct json_unparsed* value, struct json_edit* edit) {
+	static const struct json_unparsed null = { .content = "null", .length = 4 };
+
+	edit->start = NULL;
+	edit->replacement.length = 0;
+
+	if(container->type == JSON_TYPE_ARRAY) {
+		size_t index, length = container->value.array.length;
+		if(json_string_to_index(key, &index)) return 0;
+
+		if(value == NULL) value = &null;
+
+		if(index < length) {
+			json_edit_splice(container, start, end, index, 1, value, 1, edit);
+			return 0;
+		}
+
+		// gap is filled with nulls
+		size_t i, count = index - length + 1;
+		struct json_unparsed* values = malloc(count * sizeof(struct json_unparsed));
+		for(i = 0; i < count - 1; i++) values[i] = null;
+		values[count - 1] = *value;
+
+		json_edit_splice(container, start, end, length, 0, values, count, edit);
+		free(values);
+
+		return 0;
+	}
+
+	if(container->type != JSON_TYPE_OBJECT) return 0;
+
+	const struct json_object* object = &container->value.object;
+	size_t length = object->length;
+	size_t i = length;
+
+	while(i > 0 && !json_string_equals(&object->keys[i - 1], key)) i--;
+
+	if(i > 0) {
+		i--;
+		if(value) {
+			edit->start = json_edit_member_value(container, i)->content;
+			edit->length = json_edit_member_value(container, i)->length;
+			buffer_append(&edit->replacement, value->content, value->length);
+		} else if(i > 0) {
+			edit->start = json_edit_member_end(container, i - 1);
+			edit->length = json_edit_member_end(container, i) - edit->start;
+		} else if(length > 1) {
+			edit->start = json_edit_member_start(container, 0);
+			edit->length = json_edit_member_start(container, 1) - edit->start;
+		} else {
+			// also drops trailing comma
+			edit->start = start + 1;
+			edit->length = (end - 1) - edit->start;
+		}
+
+		return 0;
+	}
+
+	if(value == NULL) return 0;
+
+	// new member goes after the last one, with the same separators
+	if(length) {
+		const struct json_string* last_key = &object->keys[length - 1];
+		const char* colon = last_key->content + last_key->length + 1;
+
+		edit->start = json_edit_member_end(container, length - 1);
+		json_edit_separator(container, length, start, &edit->replacement);
+		buffer_append_char(&edit->replacement, '"');
+		if(json_encode_string((const unsigned char*)key->content, key->length, &edit->replacement)) return -1;
+		buffer_append_char(&edit->replacement, '"');
+		buffer_append(&edit->replacement, colon, json_edit_member_value(container, length - 1)->content - colon);
+	} else {
+		edit->start = end - 1;
+		buffer_append_char(&edit->replacement, '"');
+		if(json_encode_string((const unsigned char*)key->content, key->length, &edit->replacement)) return -1;
+		buffer_append(&edit->replacement, "\": ", 3);
+	}
+
+	edit->length = 0;
+	buffer_append(&edit->replacement, value->content, value->length);
+
+	return 0;
+}
+
+
+// Prints text from `start` to `end` with `edit` applied
+void json_edit_print(struct output* out, const char* start, const char* end, const struct json_edit* edit) {
+	if(edit->start == NULL) {
+		output_write(out, start, end - start);
+		return;
+	}
+
+	output_write(out, start, edit->start - start);
+	output_write(out, edit->replacement.content, edit->replacement.length);
+	output_write(out, edit->start + edit->length, end - (edit->start + edit->length));
+}
+
+
+/**********/
+/** main **/
+/**********/
+
+
+enum op {
+	OP_UNKNOWN,
+	// make sure that input contains 1 and only 1 valid JSON value
+	OP_CHECK,
+	// print input value at given position
+	OP_VALUE,
+	// print type name of input value
+	OP_TYPE,
+	// get element of array or property of object
+	OP_GET,
+	// get list of keys in object
+	OP_KEYS,
+	// set element of array or property of object
+	OP_SET,
+	// set values at many paths at once
+	OP_SET_MANY,
+	// apply merge patch
+	OP_MERGE,
+	// apply JSON patch
+	OP_PATCH,
+	// count, sum, minimum, maximum and average of numbers in array elements or lines
+	OP_AGGREGATE,
+	// add element to array
+	OP_SPLICE,
+	// decode JSON-encoded string string to UTF-8 encoded string
+	OP_DECODE_STRING,
+	// escape string characters
+	OP_ENCODE_STRING,
+	// escape periods and backslashes in path component
+	OP_ENCODE_KEY,
+	// write input as binary tape that read actions use without parsing
+	OP_COMPILE,
+	// run multiple get/type/keys/set operations against single input value
+	OP_BATCH,
+	// run actions for clients, keeping parsed inputs in memory
+	OP_SERVE,
+};
+
+
+void print_usage(struct output* out, const char* program_name) {
+	// TODO: write comprehensive usage text
+	output_string(out, "Usage: ");
+	output_string(out, program_name);
+	output_string(out, " ACTION OPTIONS\n");
+}
+
+
+int parse_path(const char* in, struct path* path) {
+
+	struct json_string* components = malloc(1 * sizeof(struct json_string));
+	size_t components_size = 1;
+	size_t components_length = 0;
+
+	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
+
+	while(*in != '\0') {
+		if(*in == '.') {
+			if(components_length >= components_size) {
+				components = realloc(components, (components_size *= 2) * sizeof(struct json_string));
+			}
+
+			components[components_length].content = buffer.content ? buffer.content : malloc(1);
+			components[components_length].length = buffer.length;
+			components[components_length].escaped = 0;
+			components_length++;
+
+			buffer.content = NULL;
+			buffer.length = buffer.size = 0;
+		} else {
+			if(*in == '\\') {
+				in++;
+				if(*in != '.' && *in != '\\') goto error;
+			}
+
+			buffer_append(&buffer, in, 1);
+		}
+		in++;
+	}
+
+	if(components_length >= components_size) {
+		components = realloc(components, (components_size *= 2) * sizeof(struct json_string));
+	}
+
+	components[components_length].content = buffer.content ? buffer.content : malloc(1);
+	components[components_length].length  = buffer.length;
+	components[components_length].escaped = 0;
+
+	path->components = components;
+	path->length = components_length + 1;
+
+	return 0;
+
+ error:
+
+	free(buffer.content);
+
+	while(components_length--) {
+		free((char*)components[components_length].content);
+	}
+
+	free(components);
+
+	return -1;
+}
+
+
+// Parses JSON Pointer (RFC 6901). Empty pointer refers to the whole document and gives empty path.
+int parse_pointer(const char* in, struct path* path) {
+	struct json_string* components = NULL;
+	size_t components_size = 0;
+	size_t components_length = 0;
+
+	if(*in != '\0' && *in != '/') return -1;
+
+	while(*in == '/') {
+		struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
+
+		in++;
+		while(*in != '\0' && *in != '/') {
+			char c = *in++;
+
+			if(c == '~') {
+				if(*in != '0' && *in != '1') {
+					free(buffer.content);
+					goto error;
+				}
+				c = *in++ == '0' ? '~' : '/';
+			}
+
+			buffer_append(&buffer, &c, 1);
+		}
+
+		if(components_length >= components_size) {
+			components_size = components_size ? components_size * 2 : 4;
+			components = realloc(components, components_size * sizeof(struct json_string));
+		}
+
+		// empty token still gets content, so it can be compared with memcmp
+		if(buffer.content == NULL) buffer.content = malloc(1);
+
+		// array index must not have leading zeros, but such token can still be object key - it is marked as escaped,
+		// which keeps it from being used as index (digits decode to themselves)
+		size_t digits = 0;
+		while(digits < buffer.length && buffer.content[digits] >= '0' && buffer.content[digits] <= '9') digits++;
+
+		components[components_length].content = buffer.content;
+		components[components_length].length = buffer.length;
+		components[components_length].escaped = buffer.length > 1 && digits == buffer.length && buffer.content[0] == '0';
+		components_length++;
+	}
+
+	path->components = components;
+	path->length = components_length;
+
+	return 0;
+
+ error:
+
+	while(components_length--) {
+		free((char*)components[components_length].content);
+	}
+
+	free(components);
+
+	return -1;
+}
+
+
+void path_free(struct path* path) {
+	while(path->length--) {
+		free((char*)path->components[path->length].content);
+	}
+
+	free(path->components);
+}
+
+
+void paths_free(struct path* paths, size_t length) {
+	size_t i;
+	for(i = 0; i < length; i++) path_free(&paths[i]);
+	free(paths);
+}
+
+
+// Parses keys of `assignments` object as paths (JSON Pointers if `pointer` is set). Returns array of paths
+// (to be released with `paths_free`) or NULL if some key is not a valid path.
+struct path* parse_assignments(const struct json_object* assignments, int pointer) {
+	struct path* paths = calloc(assignments->length + 1, sizeof(struct path));
+	struct buffer key = { .content = NULL, .length = 0, .size = 0 };
+	size_t i;
+
+	for(i = 0; i < assignments->length; i++) {
+		key.length = 0;
+		json_string_decode(&assignments->keys[i], &key);
+		buffer_append_char(&key, '\0');
+
+		if(pointer ? parse_pointer(key.content, &paths[i]) : parse_path(key.content, &paths[i])) {
+			paths_free(paths, i);
+			paths = NULL;
+			break;
+		}
+	}
+
+	free(key.content);
+
+	return paths;
+}
+
+
+void patch_free(struct json_patch_operation* operations, size_t length) {
+	size_t i;
+	for(i = 0; i < length; i++) {
+		path_free(&operations[i].path);
+		path_free(&operations[i].from);
+	}
+	free(operations);
+}
+
+
+// Parses JSON Pointer given as JSON string
+int parse_string_pointer(const struct json_value* value, struct buffer* buffer, struct path* path) {
+	if(value == NULL || value->type != JSON_TYPE_STRING) return -1;
+
+	buffer->length = 0;
+	json_string_decode(&value->value.string, buffer);
+	buffer_append_char(buffer, '\0');
+
+	return parse_pointer(buffer->content, path);
+}
+
+
+// Parses JSON Patch (RFC 6902) given as array of operation objects. Returns array of operations (to be released
+// with `patch_free`) or NULL if patch is not valid. Values of operations are not copied from `patch`.
+struct json_patch_operation* parse_patch(const struct json_value* patch, size_t* out_length) {
+	// in order of `enum json_patch_op`
+	static const struct json_string names[] = {
+		{ .content = "add", .length = 3 },
+		{ .content = "remove", .length = 6 },
+		{ .content = "replace", .length = 7 },
+		{ .content = "move", .length = 4 },
+		{ .content = "copy", .length = 4 },
+		{ .content = "test", .length = 4 },
+	};
+	static const struct json_string op_key = { .content = "op", .length = 2 };
+	static const struct json_string path_key = { .content = "path", .length = 4 };
+	static const struct json_string from_key = { .content = "from", .length = 4 };
+	static const struct json_string value_key = { .content = "value", .length = 5 };
+
+	if(patch->type != JSON_TYPE_ARRAY) return NULL;
+
+	const struct json_array* array = &patch->value.array;
+	struct json_patch_operation* operations = calloc(array->length + 1, sizeof(struct json_patch_operation));
+	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
+	size_t i;
+
+	for(i = 0; i < array->length; i++) {
+		struct json_patch_operation* operation = &operations[i];
+
+		if(array->values[i].type != JSON_TYPE_OBJECT) goto error;
+
+		// patch may be shared, so no key index is built for it
+		const struct json_object* members = &array->values[i].value.object;
+		const struct json_value* op = json_object_resolve(NULL, members, &op_key);
+		if(op == NULL || op->type != JSON_TYPE_STRING) goto error;
+
+		int j = 0;
+		while(j < sizeof(names) / sizeof(names[0]) && !json_string_equals(&op->value.string, &names[j])) j++;
+		if(j == sizeof(names) / sizeof(names[0])) goto error;
+
+		operation->op = j;
+		operation->value = json_object_resolve(NULL, members, &value_key);
+
+		if(parse_string_pointer(json_object_resolve(NULL, members, &path_key), &buffer, &operation->path)) goto error;
+
+		if(operation->op == JSON_PATCH_MOVE || operation->op == JSON_PATCH_COPY) {
+			if(parse_string_pointer(json_object_resolve(NULL, members, &from_key), &buffer, &operation->from)) goto error;
+		}
+
+		if((operation->op == JSON_PATCH_ADD || operation->op == JSON_PATCH_REPLACE || operation->op == JSON_PATCH_TEST) && operation->value == NULL) {
+			goto error;
+		}
+	}
+
+	free(buffer.content);
+
+	*out_length = array->length;
+	return operations;
+
+ error:
+
+	free(buffer.content);
+	patch_free(operations, i + 1);
+
+	return NULL;
+}
+
+
+int parse_input(struct json_parser* parser, const char** start, const char* end, struct json_value** out, size_t* out_length) {
+	size_t base = parser->values_length;
+	size_t max = *out_length ? *out_length : SIZE_MAX;
+
+	while(*start < end && max--) {
+
+		json_parser_scan_whitespace(parser, start, end, NULL);
+
+		if(*start >= end) break;
+
+		const char* tmp_pos = *start;
+		struct json_value value;
+		enum json_error error = json_parser_scan_value(parser, start, end, &value);
+
+		if(error || *start == tmp_pos) goto error;
+
+		json_parser_push_value(parser, &value);
+	}
+
+	*out_length = parser->values_length - base;
+	*out = arena_copy(parser->arena, &parser->values[base], *out_length * sizeof(struct json_value));
+
+	parser->values_length = base;
+
+	return 0;
+
+ error:
+
+	// values preceding the invalid one are still returned
+	*out_length = parser->values_length - base;
+	*out = arena_copy(parser->arena, &parser->values[base], *out_length * sizeof(struct json_value));
+
+	parser->values_length = base;
+
+	return -1;
+}
+
+
+// Input is mapped only if it is a regular file read from its start. Files that report no size (as in /proc and /sys)
+// may still have content, so they are read like pipes.
+int input_mappable(int fd, struct stat* st) {
+	return fstat(fd, st) == 0 && S_ISREG(st->st_mode) && st->st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0;
+}
+
+
+// Regular files are mapped read-only instead of copied; anything else (pipes, terminals, sockets) is read until EOF.
+// `*mapped` tells how the content has to be released (see `release_input`).
+int read_input(int fd, struct buffer* out, int* mapped) {
+	struct stat st;
+
+	*mapped = 0;
+
+	if(input_mappable(fd, &st)) {
+		void* content = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(content != MAP_FAILED) {
+			madvise(content, st.st_size, MADV_SEQUENTIAL);
+			out->content = content;
+			out->length = out->size = st.st_size;
+			*mapped = 1;
+			return 0;
+		}
+	}
+
+	struct buffer buffer = { .content = malloc(4096), .length = 0, .size = 4096 };
+
+	ssize_t r;
+	while(r = read(fd, buffer.content + buffer.length, buffer.size - buffer.length)) {
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			free(buffer.content);
+			return -1;
+		}
+
+		buffer.length += r;
+		if(buffer.length >= buffer.size)
+			buffer.content = realloc(buffer.content, buffer.size *= 2);
+	}
+
+	*out = buffer;
+
+	return 0;
+}
+
+
+void release_input(struct buffer* input, int mapped) {
+	if(mapped) munmap(input->content, input->size);
+	else free(input->content);
+
+	input->content = NULL;
+	input->length = input->size = 0;
+}
+
+
+struct batch {
+	const char* program_name;
+	FILE* errors;
+	struct arena* arena;
+	struct output* out;
+	struct json_value* root;
+	int shared; // root is shared with cached document - containers must be copied before modification
+	int pointer; // paths are JSON Pointers
+};
+
+
+// Runs single operation of `batch` action - action name, optional path and (for `set`) value, separated by
+// a space. Result is written to output and terminated by NUL byte, even if operation fails.
+int run_batch_operation(struct batch* batch, const char* in, size_t length) {
+	const char* program_name = batch->program_name;
+	struct output* out = batch->out;
+	const char* end = in + length;
+	int status = 0;
+
+	const char* action = in;
+	while(in < end && *in != ' ') in++;
+	size_t action_length = in - action;
+	if(in < end) in++;
+
+	// path ends at the first space not escaped by backslash, the rest is value
+	struct buffer path_buffer = { .content = NULL, .length = 0, .size = 0 };
+	while(in < end && *in != ' ') {
+		if(*in == '\\' && in + 1 < end && in[1] == ' ') {
+			in++;
+		} else if(*in == '\\' && in + 1 < end) {
+			// other escapes are left for path parser, so escaped backslash before separator is kept intact
+			buffer_append_char(&path_buffer, *in++);
+		}
+		buffer_append_char(&path_buffer, *in++);
+	}
+	buffer_append_char(&path_buffer, '\0');
+	char* path_string = path_buffer.content;
+	if(in < end) in++;
+
+	struct path path = { .components = NULL, .length = 0 };
+	if(*path_string && (batch->pointer ? parse_pointer(path_string, &path) : parse_path(path_string, &path))) {
+		fprintf(batch->errors, "%s: Invalid path %s in batch operation %.*s\n", program_name, path_string, (int)length, end - length);
+		status = -1;
+		goto end;
+	}
+
+	// shared document must not get indexes allocated from arena of this request
+	struct json_value* resolved_value;
+	int resolved = json_resolve_path(batch->shared ? NULL : batch->arena, batch->root, &path, (const struct json_value**)&resolved_value) == path.length;
+
+	if(action_length == 3 && memcmp(action, "get", 3) == 0) {
+		if(resolved) out->print(out, resolved_value, 0);
+	} else if(action_length == 4 && memcmp(action, "type", 4) == 0) {
+		if(resolved) output_string(out, json_type_name(resolved_value->type));
+	} else if(action_length == 4 && memcmp(action, "keys", 4) == 0) {
+		if(resolved && print_keys(out, resolved_value)) {
+			fprintf(batch->errors, "%s: Expected JSON object in batch operation %.*s\n", program_name, (int)length, end - length);
+			status = -1;
+		}
+	} else if(action_length == 3 && memcmp(action, "set", 3) == 0) {
+		struct json_parser parser = { .arena = batch->arena };
+		struct json_value value = { .type = JSON_TYPE_UNDEFINED };
+
+		if(in < end) json_parser_scan_whitespace(&parser, &in, end, NULL);
+
+		// value must be the only thing left on the line, missing value deletes the property
+		enum json_error error = JSON_ERROR_OK;
+		const char* tmp_pos = in;
+		if(in < end) {
+			error = json_parser_scan_value(&parser, &in, end, &value);
+			if(!error && in == tmp_pos) error = JSON_ERROR_UNEXPECTED_TOKEN;
+			if(!error && in < end) json_parser_scan_whitespace(&parser, &in, end, NULL);
+			if(!error && in < end) error = JSON_ERROR_UNEXPECTED_TOKEN;
+		}
+
+		if(error) {
+			fprintf(batch->errors, "%s: Invalid value in batch operation %.*s\n", program_name, (int)length, end - length);
+			status = -1;
+		} else if(path.length == 0) {
+			fprintf(batch->errors, "%s: Missing path in batch operation %.*s\n", program_name, (int)length, end - length);
+			status = -1;
+		} else {
+			json_path_set(batch->arena, batch->root, &path, &value);
+		}
+
+		json_parser_free(&parser);
+	} else {
+		fprintf(batch->errors, "%s: Invalid batch operation %.*s\n", program_name, (int)length, end - length);
+		status = -1;
+	}
+
+	path_free(&path);
+
+ end:
+
+	free(path_string);
+	output_char(out, '\0');
+
+	return status;
+}
+
+
+// Runs operations of `batch` action, one per line of script. Empty lines and lines starting with `#` are skipped.
+int run_batch_script(struct batch* batch, const char* in, size_t length) {
+	const char* end = in + length;
+	int status = 0;
+
+	while(in < end) {
+		const char* line = in;
+		const char* line_end = memchr(in, '\n', end - in);
+		if(line_end == NULL) line_end = end;
+		in = line_end + 1;
+
+		if(line_end > line && line_end[-1] == '\r') line_end--;
+		if(line_end == line || *line == '#') continue;
+
+		if(run_batch_operation(batch, line, line_end - line)) status = -1;
+	}
+
+	return status;
+}
+
+
+// Validates input in constant memory. Regular files are mapped, anything else is read in fixed-size chunks.
+int check_input(int fd, size_t max_depth, enum json_error* out) {
+	struct json_validator validator;
+	json_validator_init(&validator, max_depth);
+
+	struct stat st;
+	if(input_mappable(fd, &st)) {
+		const char* content = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(content != MAP_FAILED) {
+			madvise((void*)content, st.st_size, MADV_SEQUENTIAL);
+			json_validator_feed(&validator, content, content + st.st_size);
+			munmap((void*)content, st.st_size);
+			goto done;
+		}
+	}
+
+	char chunk[64 << 10];
+	ssize_t r;
+	// invalid input is still read until EOF, so writer on the other side of pipe does not get EPIPE
+	while(r = read(fd, chunk, sizeof(chunk))) {
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			json_validator_free(&validator);
+			return -1;
+		}
+
+		json_validator_feed(&validator, chunk, chunk + r);
+	}
+
+ done:
+
+	*out = json_validator_finish(&validator);
+	json_validator_free(&validator);
+
+	return 0;
+}
+
+
+/*****************/
+/** Binary tape **/
+/*****************/
+
+
+// Compiled document that can be mapped into memory and queried without parsing. File starts with header, followed
+// by nodes of all values in document order (object member is key node followed by value node) and by pool with
+// raw content of strings and numbers. Numbers are stored in native byte order.
+
+#define TAPE_MAGIC "JSONTAPE"
+#define TAPE_VERSION 1
+
+struct tape_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;
+	uint64_t values; // number of top-level values
+	uint64_t nodes_length;
+	uint64_t pool_length;
+	uint64_t checksum; // of header with checksum set to 0
+};
+
+enum tape_node_flags {
+	TAPE_NODE_ESCAPED = 1, // string contains escape sequences
+};
+
+struct tape_node {
+	uint8_t type; // enum json_type
+	uint8_t flags;
+	uint16_t hash; // low bits of `json_string_hash` of object keys, so most keys can be skipped without reading pool
+	uint32_t length; // string or number: length of content, object or array: number of members
+	uint64_t value; // string or number: position in pool, object or array: index of the node following it,
+	                // boolean: value
+};
+
+struct tape {
+	const struct tape_node* nodes;
+	size_t length;
+	const char* pool;
+	size_t pool_length;
+	size_t values;
+};
+
+struct tape_writer {
+	struct buffer nodes;
+	struct buffer pool;
+	size_t* keys; // hash table of key nodes (index + 1), so every distinct key is stored in pool only once
+	size_t keys_mask, keys_length;
+};
+
+
+uint64_t hash_bytes(const char*, size_t);
+
+
+size_t tape_push(struct tape_writer* writer, enum json_type type, unsigned int flags, uint16_t hash, uint32_t length, uint64_t value) {
+	struct tape_node node = { .type = type, .flags = flags, .hash = hash, .length = length, .value = value };
+	buffer_append(&writer->nodes, (const char*)&node, sizeof(node));
+	return writer->nodes.length / sizeof(node) - 1;
+}
+
+
+int tape_write_string(struct tape_writer* writer, const struct json_string* string, int key) {
+	if(string->length > UINT32_MAX) return -1;
+
+	unsigned int flags = string->escaped ? TAPE_NODE_ESCAPED : 0;
+
+	if(!key) {
+		tape_push(writer, JSON_TYPE_STRING, flags, 0, string->length, writer->pool.length);
+		buffer_append(&writer->pool, string->content, string->length);
+		return 0;
+	}
+
+	if(writer->keys_length * 2 >= writer->keys_mask) {
+		size_t mask = writer->keys_mask ? writer->keys_mask * 2 + 1 : 1023;
+		size_t* keys = calloc(mask + 1, sizeof(size_t));
+		size_t i;
+		for(i = 0; writer->keys && i <= writer->keys_mask; i++) {
+			if(!writer->keys[i]) continue;
+			const struct tape_node* node = (const struct tape_node*)writer->nodes.content + writer->keys[i] - 1;
+			size_t slot = hash_bytes(writer->pool.content + node->value, node->length) & mask;
+			while(keys[slot]) slot = (slot + 1) & mask;
+			keys[slot] = writer->keys[i];
+		}
+		free(writer->keys);
+		writer->keys = keys;
+		writer->keys_mask = mask;
+	}
+
+	uint16_t hash = json_string_hash(string);
+	size_t slot = hash_bytes(string->content, string->length) & writer->keys_mask;
+
+	while(writer->keys[slot]) {
+		const struct tape_node* node = (const struct tape_node*)writer->nodes.content + writer->keys[slot] - 1;
+		if(node->length == string->length && memcmp(writer->pool.content + node->value, string->content, string->length) == 0) {
+			tape_push(writer, JSON_TYPE_STRING, flags, hash, string->length, node->value);
+			return 0;
+		}
+		slot = (slot + 1) & writer->keys_mask;
+	}
+
+	writer->keys[slot] = tape_push(writer, JSON_TYPE_STRING, flags, hash, string->length, writer->pool.length) + 1;
+	writer->keys_length++;
+	buffer_append(&writer->pool, string->content, string->length);
+
+	return 0;
+}
+
+
+int tape_write_value(struct tape_writer* writer, const struct json_value* value) {
+	size_t index, i;
+
+	switch(value->type) {
+	case JSON_TYPE_STRING:
+		return tape_write_string(writer, &value->value.string, 0);
+	case JSON_TYPE_NUMBER:
+		tape_push(writer, JSON_TYPE_NUMBER, 0, 0, value->value.number.length, writer->pool.length);
+		buffer_append(&writer->pool, value->value.number.content, value->value.number.length);
+		return 0;
+	case JSON_TYPE_OBJECT: {
+		const struct json_object* object = &value->value.object;
+		if(object->length > UINT32_MAX) return -1;
+
+		index = tape_push(writer, JSON_TYPE_OBJECT, 0, 0, object->length, 0);
+		for(i = 0; i < object->length; i++) {
+			if(tape_write_string(writer, &object->keys[i], 1) || tape_write_value(writer, &object->values[i])) return -1;
+		}
+		break;
+	}
+	case JSON_TYPE_ARRAY: {
+		const struct json_array* array = &value->value.array;
+		if(array->length > UINT32_MAX) return -1;
+
+		index = tape_push(writer, JSON_TYPE_ARRAY, 0, 0, array->length, 0);
+		for(i = 0; i < array->length; i++) {
+			if(tape_write_value(writer, &array->values[i])) return -1;
+		}
+		break;
+	}
+	case JSON_TYPE_BOOLEAN:
+		tape_push(writer, JSON_TYPE_BOOLEAN, 0, 0, 0, value->value.boolean.value);
+		return 0;
+	case JSON_TYPE_NULL:
+		tape_push(writer, JSON_TYPE_NULL, 0, 0, 0, 0);
+		return 0;
+	default:
+		return -1;
+	}
+
+	// containers skip to the node following their members
+	((struct tape_node*)writer->nodes.content)[index].value = writer->nodes.length / sizeof(struct tape_node);
+
+	return 0;
+}
+
+
+// Writes `values` compiled into tape. Returns -1 if some value cannot be stored (string or container is too large).
+int tape_write(struct output* out, const struct json_value* values, size_t length) {
+	struct tape_writer writer = {
+		.nodes = { .content = NULL, .length = 0, .size = 0 },
+		.pool = { .content = NULL, .length = 0, .size = 0 },
+		.keys = NULL, .keys_mask = 0, .keys_length = 0,
+	};
+	int r = 0;
+
+	size_t i;
+	for(i = 0; i < length && !r; i++) r = tape_write_value(&writer, &values[i]);
+
+	if(!r) {
+		struct tape_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, TAPE_MAGIC, sizeof(header.magic));
+		header.version = TAPE_VERSION;
+		header.node_size = sizeof(struct tape_node);
+		header.values = length;
+		header.nodes_length = writer.nodes.length / sizeof(struct tape_node);
+		header.pool_length = writer.pool.length;
+		header.checksum = hash_bytes((const char*)&header, sizeof(header));
+
+		output_write(out, (const char*)&header, sizeof(header));
+		output_write(out, writer.nodes.content, writer.nodes.length);
+		// pool is empty if there are no strings or numbers
+		if(writer.pool.length) output_write(out, writer.pool.content, writer.pool.length);
+	}
+
+	free(writer.nodes.content);
+	free(writer.pool.content);
+	free(writer.keys);
+
+	return r;
+}
+
+
+int tape_detect(const char* content, size_t length) {
+	return length >= sizeof(TAPE_MAGIC) - 1 && memcmp(content, TAPE_MAGIC, sizeof(TAPE_MAGIC) - 1) == 0;
+}
+
+
+// Checks header of compiled document. Nodes are only checked when they are accessed (see `tape_node`), so opening
+// tape does not read the whole file.
+int tape_open(const char* content, size_t length, struct tape* out) {
+	struct tape_header header;
+
+	if(length < sizeof(header)) return -1;
+	memcpy(&header, content, sizeof(header));
+
+	uint64_t checksum = header.checksum;
+	header.checksum = 0;
+
+	if(memcmp(header.magic, TAPE_MAGIC, sizeof(header.magic)) != 0 || header.version != TAPE_VERSION ||
+	   header.node_size != sizeof(struct tape_node) || checksum != hash_bytes((const char*)&header, sizeof(header))) {
+		return -1;
+	}
+
+	size_t available = length - sizeof(header);
+	if(header.nodes_length > available / sizeof(struct tape_node) ||
+	   header.pool_length != available - header.nodes_length * sizeof(struct tape_node) ||
+	   header.values > header.nodes_length) {
+		return -1;
+	}
+
+	out->nodes = (const struct tape_node*)(content + sizeof(header));
+	out->length = header.nodes_length;
+	out->pool = content + sizeof(header) + header.nodes_length * sizeof(struct tape_node);
+	out->pool_length = header.pool_length;
+	out->values = header.values;
+
+	return 0;
+}
+
+
+// Returns node at `index`, or NULL if it does not fit into tape
+const struct tape_node* tape_node(const struct tape* tape, size_t index) {
+	if(index >= tape->length) return NULL;
+
+	const struct tape_node* node = &tape->nodes[index];
+
+	switch(node->type) {
+	case JSON_TYPE_STRING:
+	case JSON_TYPE_NUMBER:
+		if(node->value > tape->pool_length || node->length > tape->pool_length - node->value) return NULL;
+		return node;
+	case JSON_TYPE_OBJECT:
+	case JSON_TYPE_ARRAY:
+		// every member takes at least one node (two in objects)
+		if(node->value <= index || node->value > tape->length) return NULL;
+		if(node->length > (node->value - index - 1) / (node->type == JSON_TYPE_OBJECT ? 2 : 1)) return NULL;
+		return node;
+	case JSON_TYPE_BOOLEAN:
+	case JSON_TYPE_NULL:
+		return node;
+	default:
+		return NULL;
+	}
+}
+
+
+// Index of the node following value at `index` (and all its members), 0 if tape is invalid
+size_t tape_next(const struct tape* tape, size_t index) {
+	const struct tape_node* node = tape_node(tape, index);
+	if(node == NULL) return 0;
+
+	return node->type == JSON_TYPE_OBJECT || node->type == JSON_TYPE_ARRAY ? node->value : index + 1;
+}
+
+
+// Content of strings and numbers is checked only when it is used, so that damaged pool is reported as invalid
+// tape rather than decoded out of range. Returns -1 if content is not valid.
+int tape_string(const struct tape* tape, const struct tape_node* node, struct json_string* out) {
+	out->content = tape->pool + node->value;
+	out->length = node->length;
+	out->escaped = node->flags & TAPE_NODE_ESCAPED;
+
+	const char* end = out->content + out->length;
+	return out->escaped ? json_string_validate(out->content, end) : json_utf8_validate(out->content, end);
+}
+
+
+int tape_number(const struct tape* tape, const struct tape_node* node, struct json_number* out) {
+	const char* in = tape->pool + node->value;
+	const char* end = in + node->length;
+
+	if(in == end || json_parser_scan_number(&in, end, out) || in != end) return -1;
+
+	return 0;
+}
+
+
+// Finds node of the top-level value `index`
+int tape_top_value(const struct tape* tape, size_t index, size_t* out) {
+	size_t node = 0;
+
+	while(index--) {
+		node = tape_next(tape, node);
+		if(node == 0) return -1;
+	}
+
+	*out = node;
+
+	return 0;
+}
+
+
+// Resolves `path` from node at `index` as `json_resolve_path` does. Returns number of resolved components and stores
+// index of the last resolved node in `out`, or returns -1 if tape is invalid.
+ssize_t tape_resolve(const struct tape* tape, size_t index, const struct path* path, size_t* out) {
+	size_t i;
+
+	for(i = 0; i < path->length; i++) {
+		const struct tape_node* node = tape_node(tape, index);
+		const struct json_string* component = &path->components[i];
+
+		if(node == NULL) return -1;
+
+		if(node->type == JSON_TYPE_OBJECT) {
+			uint16_t hash = json_string_hash(component);
+			size_t member = index + 1, found = 0, m;
+
+			// last one of duplicate keys is used
+			for(m = 0; m < node->length; m++) {
+				const struct tape_node* key = tape_node(tape, member);
+				if(key == NULL || key->type != JSON_TYPE_STRING) return -1;
+
+				if(key->hash == hash) {
+					struct json_string string;
+					if(tape_string(tape, key, &string)) return -1;
+					if(json_string_equals(&string, component)) found = member + 1;
+				}
+
+				member = tape_next(tape, member + 1);
+				if(member == 0 || member > node->value) return -1;
+			}
+
+			if(!found) break;
+			index = found;
+		} else if(node->type == JSON_TYPE_ARRAY) {
+			size_t element;
+			if(json_string_to_index(component, &element) || element >= node->length) break;
+
+			index++;
+			while(element--) {
+				index = tape_next(tape, index);
+				if(index == 0 || index >= node->value) return -1;
+			}
+		} else {
+			break;
+		}
+	}
+
+	*out = index;
+
+	return i;
+}
+
+
+// Builds value of node at `index` with all its members, nested at most `depth` levels (tape may come from build
+// with higher limit or be damaged). Strings and numbers are not copied from tape.
+int tape_value(const struct tape* tape, struct arena* arena, size_t index, size_t depth, struct json_value* out) {
+	const struct tape_node* node = tape_node(tape, index);
+	size_t i;
+
+	if(node == NULL) return -1;
+	if((node->type == JSON_TYPE_OBJECT || node->type == JSON_TYPE_ARRAY) && depth == 0) return -1;
+
+	out->type = node->type;
+
+	switch(node->type) {
+	case JSON_TYPE_STRING:
+		if(tape_string(tape, node, &out->value.string)) return -1;
+		break;
+	case JSON_TYPE_NUMBER:
+		if(tape_number(tape, node, &out->value.number)) return -1;
+		break;
+	case JSON_TYPE_OBJECT: {
+		struct json_object* object = &out->value.object;
+		object->keys = arena_alloc(arena, node->length * sizeof(struct json_string));
+		object->values = arena_alloc(arena, node->length * sizeof(struct json_value));
+		object->length = object->capacity = node->length;
+		object->index = NULL;
+
+		index++;
+		for(i = 0; i < node->length; i++) {
+			const struct tape_node* key = tape_node(tape, index);
+			if(key == NULL || key->type != JSON_TYPE_STRING || tape_value(tape, arena, index + 1, depth - 1, &object->values[i])) return -1;
+			if(tape_string(tape, key, &object->keys[i])) return -1;
+
+			index = tape_next(tape, index + 1);
+			if(index == 0 || index > node->value) return -1;
+		}
+		break;
+	}
+	case JSON_TYPE_ARRAY: {
+		struct json_array* array = &out->value.array;
+		array->values = arena_alloc(arena, node->length * sizeof(struct json_value));
+		array->length = array->capacity = node->length;
+
+		index++;
+		for(i = 0; i < node->length; i++) {
+			if(tape_value(tape, arena, index, depth - 1, &array->values[i])) return -1;
+
+			index = tape_next(tape, index);
+			if(index == 0 || index > node->value) return -1;
+		}
+		break;
+	}
+	case JSON_TYPE_BOOLEAN:
+		out->value.boolean.value = node->value != 0;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+
+/********************/
+/** Document cache **/
+/********************/
+
+
+#define CACHE_DEFAULT_LIMIT ((size_t)1024 << 20)
+
+// Parsed input kept by server between requests. Regular files are identified by device, inode, size and
+// modification times, anything else (pipes, sockets) by content.
+struct cache_entry {
+	struct cache_entry *prev, *next;
+	int regular;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime, ctime;
+	uint64_t hash;
+	struct buffer input;
+	int mapped;
+	struct arena arena;
+	struct json_value* values; // all input values
+	size_t length;
+	int error; // values are followed by invalid JSON
+	size_t max_depth; // values were parsed with
+	size_t memory;
+	size_t users; // requests using the entry, it is not released until they are done
+};
+
+// Entries are ordered from the most recently used one. Least recently used entries are released once
+// `memory` exceeds `limit`. Requests are served concurrently, so the list is only accessed with `mutex` locked;
+// entries themselves are not changed once they are loaded.
+struct cache {
+	struct cache_entry *first, *last;
+	size_t memory, limit;
+	pthread_mutex_t mutex;
+};
+
+
+uint64_t hash_bytes(const char* in, size_t length) {
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+	uint64_t word;
+
+	while(length >= 8) {
+		memcpy(&word, in, 8);
+		hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 32;
+		in += 8;
+		length -= 8;
+	}
+
+	word = 0;
+	memcpy(&word, in, length);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+
+void cache_unlink(struct cache* cache, struct cache_entry* entry) {
+	if(entry->prev) entry->prev->next = entry->next;
+	else cache->first = entry->next;
+	if(entry->next) entry->next->prev = entry->prev;
+	else cache->last = entry->prev;
+}
+
+
+void cache_push(struct cache* cache, struct cache_entry* entry) {
+	entry->prev = NULL;
+	entry->next = cache->first;
+	if(cache->first) cache->first->prev = entry;
+	else cache->last = entry;
+	cache->first = entry;
+}
+
+
+void cache_entry_free(struct cache_entry* entry) {
+	arena_free(&entry->arena);
+	release_input(&entry->input, entry->mapped);
+	free(entry);
+}
+
+
+// Releases least recently used entries over the limit, but never the most recent one or the ones in use
+void cache_trim(struct cache* cache) {
+	struct cache_entry* entry = cache->last;
+
+	while(cache->memory > cache->limit && entry != cache->first) {
+		struct cache_entry* prev = entry->prev;
+
+		if(entry->users == 0) {
+			cache_unlink(cache, entry);
+			cache->memory -= entry->memory;
+			cache_entry_free(entry);
+		}
+
+		entry = prev;
+	}
+}
+
+
+// Ends use of entry returned by `cache_load`
+void cache_release(struct cache* cache, struct cache_entry* entry) {
+	pthread_mutex_lock(&cache->mutex);
+	entry->users--;
+	cache_trim(cache);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+// Builds key indexes of all large objects up front, so lookups never change cached document (see
+// `json_object_resolve`) and it can be read by concurrent requests
+void cache_index_value(struct arena* arena, struct json_value* value) {
+	size_t i;
+
+	if(value->type == JSON_TYPE_OBJECT) {
+		struct json_object* object = &value->value.object;
+		if(object->length >= JSON_OBJECT_INDEX_THRESHOLD) json_object_index_build(arena, object);
+		for(i = 0; i < object->length; i++) cache_index_value(arena, &object->values[i]);
+	} else if(value->type == JSON_TYPE_ARRAY) {
+		for(i = 0; i < value->value.array.length; i++) cache_index_value(arena, &value->value.array.values[i]);
+	}
+}
+
+
+int timespec_equal(const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+
+// Returns cached document read from `fd`, parsing it if it is not in cache yet. Returns NULL if input could not be read.
+// Entry is released by `cache_release`. Input is read and parsed without the lock, so a slow client does not hold up
+// requests for other documents.
+struct cache_entry* cache_load(struct cache* cache, int fd, int huge_pages, size_t max_depth) {
+	struct stat st;
+	struct cache_entry* entry;
+	int regular = input_mappable(fd, &st);
+
+	if(regular) {
+		pthread_mutex_lock(&cache->mutex);
+		for(entry = cache->first; entry; entry = entry->next) {
+			if(entry->regular && entry->max_depth == max_depth && entry->dev == st.st_dev && entry->ino == st.st_ino && entry->size == st.st_size &&
+			   timespec_equal(&entry->mtime, &st.st_mtim) && timespec_equal(&entry->ctime, &st.st_ctim)) goto found;
+		}
+		pthread_mutex_unlock(&cache->mutex);
+	}
+
+	struct buffer input;
+	int mapped;
+	if(read_input(fd, &input, &mapped)) return NULL;
+
+	uint64_t hash = 0;
+	if(!regular) {
+		hash = hash_bytes(input.content, input.length);
+		pthread_mutex_lock(&cache->mutex);
+		for(entry = cache->first; entry; entry = entry->next) {
+			if(!entry->regular && entry->max_depth == max_depth && entry->hash == hash && entry->input.length == input.length &&
+			   memcmp(entry->input.content, input.content, input.length) == 0) {
+				release_input(&input, mapped);
+				goto found;
+			}
+		}
+		pthread_mutex_unlock(&cache->mutex);
+	}
+
+	entry = calloc(1, sizeof(struct cache_entry));
+	entry->regular = regular;
+	if(regular) {
+		entry->dev = st.st_dev;
+		entry->ino = st.st_ino;
+		entry->size = st.st_size;
+		entry->mtime = st.st_mtim;
+		entry->ctime = st.st_ctim;
+	}
+	entry->hash = hash;
+	entry->max_depth = max_depth;
+	entry->input = input;
+	entry->mapped = mapped;
+	entry->arena.chunk_size = ARENA_CHUNK_SIZE;
+	entry->arena.huge_pages = huge_pages;
+
+	if(tape_detect(input.content, input.length)) {
+		// compiled input is read through tape, it has no values to parse
+		entry->length = 0;
+		entry->error = 1;
+	} else {
+		// all input values are parsed up front, so every action can be served from the tree
+		struct json_index index;
+		struct json_parser parser = { .arena = &entry->arena, .index = &index, .shared = 1, .max_depth = max_depth };
+		json_index_init(&index, input.content, input.content + input.length);
+
+		const char* start = input.content;
+		entry->length = 0;
+		entry->error = parse_input(&parser, &start, start + input.length, &entry->values, &entry->length) != 0;
+		json_parser_free(&parser);
+
+		size_t i;
+		for(i = 0; i < entry->length; i++) cache_index_value(&entry->arena, &entry->values[i]);
+	}
+
+	entry->memory = sizeof(struct cache_entry) + entry->input.size + arena_usage(&entry->arena);
+	entry->users = 1;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache_push(cache, entry);
+	cache->memory += entry->memory;
+	cache_trim(cache);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return entry;
+
+ found:
+
+	entry->users++;
+	cache_unlink(cache, entry);
+	cache_push(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return entry;
+}
+
+
+// Same as `parse_input`, but values are taken from cache entry. Values must not be modified.
+int cache_entry_values(const struct cache_entry* entry, struct json_value** out, size_t* out_length) {
+	size_t max = *out_length ? *out_length : SIZE_MAX;
+
+	*out = entry->values;
+	*out_length = entry->length < max ? entry->length : max;
+
+	return entry->length < max && entry->error ? -1 : 0;
+}
+
+
+// Input of an action - either raw content or a cache entry with parsed values
+struct input {
+	const char* content;
+	size_t length;
+	struct cache_entry* cached;
+	const struct tape* tape; // input is compiled, `content` is not JSON text
+};
+
+
+// Reads input values from cache entry if there is one, otherwise parses input content
+int load_input(struct json_parser* parser, const struct input* input, struct json_value** out, size_t* out_length) {
+	if(input->cached) return cache_entry_values(input->cached, out, out_length);
+
+	const char* start = input->content;
+	return parse_input(parser, &start, start + input->length, out, out_length);
+}
+
+
+/*****************/
+/** Aggregation **/
+/*****************/
+
+
+// Numbers are summed exactly as 128-bit integers while all of them are integers with 64-bit magnitude, and as doubles
+// with compensated (Neumaier) summation otherwise. Exact sum is printed if its magnitude fits into 64 bits. Minimum and maximum are printed as they were written.
+
+struct aggregate_stats {
+	size_t count; // values at path, including the ones that are not numbers
+	size_t numbers;
+	int inexact; // `integer_sum` is not the sum
+	__int128 integer_sum;
+	double sum, compensation;
+	struct json_number min, max; // converted, their content is kept in `min_text` and `max_text`
+	struct buffer min_text, max_text;
+};
+
+struct aggregate_group {
+	struct json_string key; // content is owned by the group
+	enum json_type type; // of group value, string "1" and number 1 are different groups with the same key
+	uint64_t hash;
+	struct aggregate_stats stats;
+};
+
+// Values at `path` of every record are aggregated, either all together or grouped by value at `group_path`.
+// Groups are kept in order of their first appearance and looked up through open addressing hash table.
+struct aggregate {
+	const struct path* path;
+	const struct path* group_path; // NULL if values are not grouped
+	struct aggregate_stats total;
+	struct aggregate_group* groups;
+	size_t groups_length, groups_size;
+	size_t* table; // group positions + 1
+	size_t table_mask;
+};
+
+
+void aggregate_init(struct aggregate* aggregate, const struct path* path, const struct path* group_path) {
+	memset(aggregate, 0, sizeof(struct aggregate));
+	aggregate->path = path;
+	aggregate->group_path = group_path;
+}
+
+
+void aggregate_stats_free(struct aggregate_stats* stats) {
+	free(stats->min_text.content);
+	free(stats->max_text.content);
+}
+
+
+void aggregate_free(struct aggregate* aggregate) {
+	size_t i;
+	for(i = 0; i < aggregate->groups_length; i++) {
+		free((char*)aggregate->groups[i].key.content);
+		aggregate_stats_free(&aggregate->groups[i].stats);
+	}
+	aggregate_stats_free(&aggregate->total);
+	free(aggregate->groups);
+	free(aggregate->table);
+	aggregate_init(aggregate, aggregate->path, aggregate->group_path);
+}
+
+
+void aggregate_set_text(struct buffer* text, const char* content, size_t length) {
+	text->length = 0;
+	buffer_append(text, content, length);
+}
+
+
+void aggregate_add_double(struct aggregate_stats* stats, double x) {
+	double t = stats->sum + x;
+	double sum_magnitude = stats->sum < 0 ? -stats->sum : stats->sum, x_magnitude = x < 0 ? -x : x;
+
+	// low-order bits lost by the addition
+	stats->compensation += sum_magnitude >= x_magnitude ? (stats->sum - t) + x : (x - t) + stats->sum;
+	stats->sum = t;
+}
+
+
+void aggregate_stats_add(struct aggregate_stats* stats, const struct json_value* value) {
+	stats->count++;
+
+	if(value->type != JSON_TYPE_NUMBER) return;
+
+	struct json_number number = value->value.number;
+	json_number_convert(&number);
+
+	if(!stats->inexact && number.flags & JSON_NUMBER_INTEGER) {
+		__int128 integer = number.flags & JSON_NUMBER_NEGATIVE ? -(__int128)number.value.integer : (__int128)number.value.integer;
+		if(__builtin_add_overflow(stats->integer_sum, integer, &stats->integer_sum)) stats->inexact = 1;
+	} else {
+		stats->inexact = 1;
+	}
+
+	aggregate_add_double(stats, json_number_to_double(&number));
+
+	if(stats->numbers == 0 || json_number_compare(&number, &stats->min) < 0) {
+		stats->min = number;
+		aggregate_set_text(&stats->min_text, number.content, number.length);
+	}
+
+	if(stats->numbers == 0 || json_number_compare(&number, &stats->max) > 0) {
+		stats->max = number;
+		aggregate_set_text(&stats->max_text, number.content, number.length);
+	}
+
+	stats->numbers++;
+}
+
+
+void aggregate_stats_merge(struct aggregate_stats* stats, struct aggregate_stats* from) {
+	stats->count += from->count;
+
+	if(from->numbers == 0) return;
+
+	if(stats->inexact || from->inexact || __builtin_add_overflow(stats->integer_sum, from->integer_sum, &stats->integer_sum)) {
+		stats->inexact = 1;
+	}
+
+	aggregate_add_double(stats, from->sum);
+	stats->compensation += from->compensation;
+
+	if(stats->numbers == 0 || json_number_compare(&from->min, &stats->min) < 0) {
+		stats->min = from->min;
+		aggregate_set_text(&stats->min_text, from->min_text.content, from->min_text.length);
+	}
+
+	if(stats->numbers == 0 || json_number_compare(&from->max, &stats->max) > 0) {
+		stats->max = from->max;
+		aggregate_set_text(&stats->max_text, from->max_text.content, from->max_text.length);
+	}
+
+	stats->numbers += from->numbers;
+}
+
+
+// Returns statistics of group with `key` and `type`, which is added if there is none yet. Keys are compared decoded.
+struct aggregate_stats* aggregate_group_stats(struct aggregate* aggregate, const struct json_string* key, enum json_type type) {
+	size_t i;
+
+	if(aggregate->groups_length * 2 >= aggregate->table_mask) {
+		size_t mask = aggregate->table_mask ? aggregate->table_mask * 2 + 1 : 255;
+		size_t* table = calloc(mask + 1, sizeof(size_t));
+		for(i = 0; i < aggregate->groups_length; i++) {
+			size_t slot = aggregate->groups[i].hash & mask;
+			while(table[slot]) slot = (slot + 1) & mask;
+			table[slot] = i + 1;
+		}
+		free(aggregate->table);
+		aggregate->table = table;
+		aggregate->table_mask = mask;
+	}
+
+	uint64_t hash = json_string_hash(key) ^ (uint64_t)type * 0x9e3779b97f4a7c15ULL;
+	size_t slot = hash & aggregate->table_mask;
+
+	while(aggregate->table[slot]) {
+		struct aggregate_group* group = &aggregate->groups[aggregate->table[slot] - 1];
+		if(group->hash == hash && group->type == type && json_string_equals(&group->key, key)) return &group->stats;
+		slot = (slot + 1) & aggregate->table_mask;
+	}
+
+	if(aggregate->groups_length >= aggregate->groups_size) {
+		aggregate->groups_size = aggregate->groups_size ? aggregate->groups_size * 2 : 16;
+		aggregate->groups = realloc(aggregate->groups, aggregate->groups_size * sizeof(struct aggregate_group));
+	}
+
+	struct aggregate_group* group = &aggregate->groups[aggregate->groups_length++];
+	char* content = malloc(key->length + 1);
+	memcpy(content, key->content, key->length);
+
+	group->key.content = content;
+	group->key.length = key->length;
+	group->key.escaped = key->escaped;
+	group->type = type;
+	group->hash = hash;
+	memset(&group->stats, 0, sizeof(struct aggregate_stats));
+
+	aggregate->table[slot] = aggregate->groups_length;
+
+	return &group->stats;
+}
+
+
+// Strings are grouped by their content, other scalars by their text. Group keys of different types may be equal.
+int aggregate_group_key(const struct json_value* value, struct json_string* out) {
+	out->escaped = 0;
+
+	switch(value->type) {
+	case JSON_TYPE_STRING:
+		*out = value->value.string;
+		return 0;
+	case JSON_TYPE_NUMBER:
+		out->content = value->value.number.content;
+		out->length = value->value.number.length;
+		return 0;
+	case JSON_TYPE_BOOLEAN:
+		out->content = value->value.boolean.value ? "true" : "false";
+		out->length = strlen(out->content);
+		return 0;
+	case JSON_TYPE_NULL:
+		out->content = "null";
+		out->length = 4;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+
+// Adds value of a record. Grouped records without scalar group value are skipped, records without value (NULL)
+// only make their group appear in output.
+void aggregate_add(struct aggregate* aggregate, const struct json_value* value, const struct json_value* group) {
+	struct aggregate_stats* stats = &aggregate->total;
+
+	if(aggregate->group_path) {
+		struct json_string key;
+		if(group == NULL || aggregate_group_key(group, &key)) return;
+		stats = aggregate_group_stats(aggregate, &key, group->type);
+	}
+
+	if(value) aggregate_stats_add(stats, value);
+}
+
+
+void aggregate_merge(struct aggregate* aggregate, struct aggregate* from) {
+	size_t i;
+	for(i = 0; i < from->groups_length; i++) {
+		aggregate_stats_merge(aggregate_group_stats(aggregate, &from->groups[i].key, from->groups[i].type), &from->groups[i].stats);
+	}
+	aggregate_stats_merge(&aggregate->total, &from->total);
+}
+
+
+// Same as `aggregate_add`, but values are resolved in parsed record
+void aggregate_add_parsed(struct arena* arena, struct aggregate* aggregate, const struct json_value* record) {
+	const struct json_value* value;
+	const struct json_value* group = NULL;
+
+	if(json_resolve_path(arena, record, aggregate->path, &value) != aggregate->path->length) value = NULL;
+	if(aggregate->group_path && json_resolve_path(arena, record, aggregate->group_path, &group) != aggregate->group_path->length) {
+		group = NULL;
+	}
+
+	aggregate_add(aggregate, value, group);
+}
+
+
+// Scans single record and adds its value. Only scalars at value and group path are materialized, so the record
+// is scanned twice if values are grouped.
+enum json_error aggregate_scan_record(struct json_parser* parser, const char** in, const char* end, struct aggregate* aggregate) {
+	const char* start = *in;
+	struct json_value value, group;
+	int found = 0, group_found = 0;
+
+	enum json_error error = json_parser_scan_path(parser, in, end, aggregate->path, 0, &value, &found, 1);
+	if(error || *in == start) return error ? error : JSON_ERROR_UNEXPECTED_TOKEN;
+
+	if(aggregate->group_path) {
+		const char* group_in = start;
+		error = json_parser_scan_path(parser, &group_in, end, aggregate->group_path, 0, &group, &group_found, 1);
+		if(error) return error;
+	}
+
+	aggregate_add(aggregate, found ? &value : NULL, group_found ? &group : NULL);
+
+	return JSON_ERROR_OK;
+}
+
+
+// Aggregates elements of array at `path` (starting from component `depth`) one by one, without materializing
+// the array. `*found` is set to 1 if there is array at path or to -1 if there is other value. As with
+// `json_parser_scan_path`, the last one of duplicate keys is used.
+enum json_error aggregate_scan_array(struct json_parser* parser, const char** in, const char* end, const struct path* path, size_t depth, struct aggregate* aggregate, int* found) {
+
+	assert(*in < end);
+
+	enum json_error error;
+	size_t index;
+	int more;
+
+	if(depth == path->length) {
+		*found = **in == '[' ? 1 : -1;
+		if(**in != '[') return json_parser_scan_value(parser, in, end, NULL);
+
+		error = json_parser_enter(parser);
+		if(error) return error;
+
+		(*in)++;
+
+		for(index = 0; ; index++) {
+			error = json_parser_next_member(parser, in, end, ']', index, NULL, &more);
+			if(error || !more) break;
+
+			error = aggregate_scan_record(parser, in, end, aggregate);
+			if(error) break;
+		}
+
+		parser->depth--;
+		return error;
+	}
+
+	if(**in != '{' && **in != '[') return json_parser_scan_value(parser, in, end, NULL);
+
+	const struct json_string* component = &path->components[depth];
+	char close = **in == '{' ? '}' : ']';
+	size_t target = SIZE_MAX;
+
+	if(close == ']' && json_string_to_index(component, &target)) target = SIZE_MAX;
+
+	error = json_parser_enter(parser);
+	if(error) return error;
+
+	(*in)++;
+
+	for(index = 0; ; index++) {
+		struct json_string key;
+		error = json_parser_next_member(parser, in, end, close, index, &key, &more);
+		if(error || !more) break;
+
+		const char* tmp_pos = *in;
+
+		if(close == '}' ? json_string_equals(&key, component) : index == target) {
+			// values of duplicate key found earlier are dropped
+			aggregate_free(aggregate);
+			*found = 0;
+			error = aggregate_scan_array(parser, in, end, path, depth + 1, aggregate, found);
+		} else {
+			error = json_parser_scan_value(parser, in, end, NULL);
+		}
+
+		if(!error && *in == tmp_pos) error = JSON_ERROR_UNEXPECTED_TOKEN;
+		if(error) break;
+	}
+
+	parser->depth--;
+
+	return error;
+}
+
+
+
+// Input that cannot be mapped (pipe) is aggregated while it is read in chunks. Content before `position` is scanned
+// and is dropped when more input is read, so memory use is bounded by the largest array element (or skipped value)
+// instead of length of the input. Part of input that is cut off by the end of buffer is scanned again.
+
+#define AGGREGATE_CHUNK_SIZE (1 << 20)
+
+struct aggregate_stream {
+	int fd;
+	struct buffer buffer;
+	size_t position;
+	int eof;
+	int error; // reading failed, errno is set
+};
+
+
+// Reads at least as much input as is left unscanned, so large value is rescanned only a few times
+int aggregate_stream_read(struct aggregate_stream* stream) {
+	struct buffer* buffer = &stream->buffer;
+	size_t left = buffer->length - stream->position;
+
+	if(left && stream->position) memmove(buffer->content, buffer->content + stream->position, left);
+	buffer->length = left;
+	stream->position = 0;
+
+	size_t target = left + (left > AGGREGATE_CHUNK_SIZE ? left : AGGREGATE_CHUNK_SIZE);
+	buffer_reserve(buffer, target);
+
+	while(!stream->eof && buffer->length < target) {
+		ssize_t r = read(stream->fd, buffer->content + buffer->length, buffer->size - buffer->length);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			stream->error = 1;
+			return -1;
+		}
+
+		stream->eof = r == 0;
+		buffer->length += r;
+	}
+
+	return 0;
+}
+
+
+// Same as `json_parser_next_member` at current position of stream
+enum json_error aggregate_stream_next_member(struct json_parser* parser, struct aggregate_stream* stream, char close, size_t index, struct json_string* key, int* more) {
+	for(;;) {
+		const char* in = stream->buffer.content + stream->position;
+		const char* end = stream->buffer.content + stream->buffer.length;
+
+		// there is first character of member value after it, so it is not cut off
+		enum json_error error = json_parser_next_member(parser, &in, end, close, index, key, more);
+		if(!error) stream->position = in - stream->buffer.content;
+		if(!error || stream->eof) return error;
+
+		if(aggregate_stream_read(stream)) return JSON_ERROR_UNEXPECTED_END;
+	}
+}
+
+
+// Scans value at current position of stream. It is aggregated as a record if `aggregate` is given.
+enum json_error aggregate_stream_scan(struct json_parser* parser, struct aggregate_stream* stream, struct aggregate* aggregate) {
+	for(;;) {
+		const char* start = stream->buffer.content + stream->position;
+		const char* end = stream->buffer.content + stream->buffer.length;
+		const char* in = start;
+		enum json_error error = JSON_ERROR_OK;
+
+		// number is the only value that is still valid when cut off, so its end is found before it is added
+		if(aggregate == NULL || (!stream->eof && (*start == '-' || (*start >= '0' && *start <= '9')))) {
+			error = json_parser_scan_value(parser, &in, end, NULL);
+			if(!error && in == start) error = JSON_ERROR_UNEXPECTED_TOKEN;
+			if(!error && in == end && !stream->eof) error = JSON_ERROR_UNEXPECTED_END;
+		}
+
+		if(!error && aggregate) {
+			in = start;
+			error = aggregate_scan_record(parser, &in, end, aggregate);
+		}
+
+		if(!error) stream->position = in - stream->buffer.content;
+		if(!error || stream->eof) return error;
+
+		if(aggregate_stream_read(stream)) return JSON_ERROR_UNEXPECTED_END;
+	}
+}
+
+
+// Same as `aggregate_scan_array` at current position of stream, which is at the first character of value
+enum json_error aggregate_stream_array(struct json_parser* parser, struct aggregate_stream* stream, const struct path* path, size_t depth, struct aggregate* aggregate, int* found) {
+	char c = stream->buffer.content[stream->position];
+	enum json_error error;
+	size_t index;
+	int more;
+
+	if(depth == path->length) {
+		*found = c == '[' ? 1 : -1;
+		if(c != '[') return aggregate_stream_scan(parser, stream, NULL);
+
+		error = json_parser_enter(parser);
+		if(error) return error;
+
+		stream->position++;
+
+		for(index = 0; ; index++) {
+			error = aggregate_stream_next_member(parser, stream, ']', index, NULL, &more);
+			if(error || !more) break;
+
+			error = aggregate_stream_scan(parser, stream, aggregate);
+			if(error) break;
+		}
+
+		parser->depth--;
+		return error;
+	}
+
+	if(c != '{' && c != '[') return aggregate_stream_scan(parser, stream, NULL);
+
+	const struct json_string* component = &path->components[depth];
+	char close = c == '{' ? '}' : ']';
+	size_t target = SIZE_MAX;
+
+	if(close == ']' && json_string_to_index(component, &target)) target = SIZE_MAX;
+
+	error = json_parser_enter(parser);
+	if(error) return error;
+
+	stream->position++;
+
+	for(index = 0; ; index++) {
+		struct json_string key;
+		error = aggregate_stream_next_member(parser, stream, close, index, &key, &more);
+		if(error || !more) break;
+
+		// key points into buffer, so it is compared before more input is read
+		if(close == '}' ? json_string_equals(&key, component) : index == target) {
+			aggregate_free(aggregate);
+			*found = 0;
+			error = aggregate_stream_array(parser, stream, path, depth + 1, aggregate, found);
+		} else {
+			error = aggregate_stream_scan(parser, stream, NULL);
+		}
+
+		if(error) break;
+	}
+
+	parser->depth--;
+
+	return error;
+}
+
+// Formats double with the shortest text that converts back to the same value. Non-finite values become null.
+void aggregate_double_value(struct arena* arena, double x, struct json_value* out) {
+	char text[32];
+	int precision, length = 0;
+
+	if(x != x || x - x != 0) {
+		out->type = JSON_TYPE_NULL;
+		return;
+	}
+
+	for(precision = 1; precision <= 17; precision++) {
+		length = snprintf(text, sizeof(text), "%.*g", precision, x);
+		if(strtod(text, NULL) == x) break;
+	}
+
+	out->type = JSON_TYPE_NUMBER;
+	out->value.number.content = arena_copy(arena, text, length);
+	out->value.number.length = length;
+	out->value.number.flags = 0;
+}
+
+
+void aggregate_text_value(const char* content, size_t length, struct json_value* out) {
+	out->type = JSON_TYPE_NUMBER;
+	out->value.number.content = content;
+	out->value.number.length = length;
+	out->value.number.flags = 0;
+}
+
+
+void aggregate_stats_value(struct arena* arena, const struct aggregate_stats* stats, struct json_value* out) {
+	static const struct json_string keys[] = {
+		{ .content = "count", .length = 5 }, { .content = "sum", .length = 3 }, { .content = "min", .length = 3 },
+		{ .content = "max", .length = 3 }, { .content = "avg", .length = 3 },
+	};
+
+	struct json_value* values = arena_alloc(arena, 5 * sizeof(struct json_value));
+	char text[32];
+	int length;
+
+	length = snprintf(text, sizeof(text), "%zu", stats->count);
+	aggregate_text_value(arena_copy(arena, text, length), length, &values[0]);
+
+	double sum = stats->inexact ? stats->sum + stats->compensation : (double)stats->integer_sum;
+
+	unsigned __int128 magnitude = stats->integer_sum < 0 ? -(unsigned __int128)stats->integer_sum : (unsigned __int128)stats->integer_sum;
+
+	if(!stats->inexact && magnitude <= UINT64_MAX) {
+		length = snprintf(text, sizeof(text), "%s%" PRIu64, stats->integer_sum < 0 ? "-" : "", (uint64_t)magnitude);
+		aggregate_text_value(arena_copy(arena, text, length), length, &values[1]);
+	} else {
+		aggregate_double_value(arena, sum, &values[1]);
+	}
+
+	if(stats->numbers) {
+		aggregate_text_value(stats->min_text.content, stats->min_text.length, &values[2]);
+		aggregate_text_value(stats->max_text.content, stats->max_text.length, &values[3]);
+		aggregate_double_value(arena, sum / stats->numbers, &values[4]);
+	} else {
+		values[2].type = values[3].type = values[4].type = JSON_TYPE_NULL;
+	}
+
+	out->type = JSON_TYPE_OBJECT;
+	out->value.object.keys = (struct json_string*)keys;
+	out->value.object.values = values;
+	out->value.object.length = 5;
+	out->value.object.capacity = 0;
+	out->value.object.index = NULL;
+}
+
+
+// Prints statistics, or object with statistics of every group. Printed values point into `aggregate`.
+void aggregate_print(struct arena* arena, const struct aggregate* aggregate, struct output* out) {
+	struct json_value value;
+
+	if(aggregate->group_path) {
+		size_t length = aggregate->groups_length, i;
+		struct json_string* keys = arena_alloc(arena, length * sizeof(struct json_string));
+		struct json_value* values = arena_alloc(arena, length * sizeof(struct json_value));
+
+		for(i = 0; i < length; i++) {
+			keys[i] = aggregate->groups[i].key;
+			aggregate_stats_value(arena, &aggregate->groups[i].stats, &values[i]);
+		}
+
+		value.type = JSON_TYPE_OBJECT;
+		value.value.object.keys = keys;
+		value.value.object.values = values;
+		value.value.object.length = length;
+		value.value.object.capacity = 0;
+		value.value.object.index = NULL;
+	} else {
+		aggregate_stats_value(arena, &aggregate->total, &value);
+	}
+
+	out->print(out, &value, 0);
+}
+
+
+/*************/
+/** Actions **/
+/*************/
+
+
+// Actions that work on parsed input. Failures are returned to caller, which reports them.
+
+enum action_error {
+	ACTION_OK = 0,
+	ACTION_INVALID_INPUT,
+	ACTION_EXPECTED_OBJECT,
+	ACTION_EXPECTED_ARRAY,
+	ACTION_EXPECTED_STRING,
+	ACTION_EXPECTED_ASSIGNMENTS,
+	ACTION_INVALID_PATH,
+	ACTION_EXPECTED_PATCH,
+	ACTION_EXPECTED_JSON_PATCH,
+	ACTION_PATCH_FAILED,
+	ACTION_INVALID_TAPE,
+	ACTION_TOO_LARGE,
+};
+
+const char* const action_error_messages[] = {
+	[ACTION_INVALID_INPUT] = "Invalid input",
+	[ACTION_EXPECTED_OBJECT] = "Expected JSON object as input",
+	[ACTION_EXPECTED_ARRAY] = "Expected JSON array as input",
+	[ACTION_EXPECTED_STRING] = "Expected JSON string as input",
+	[ACTION_EXPECTED_ASSIGNMENTS] = "Expected JSON object with assignments as second input value",
+	[ACTION_INVALID_PATH] = "Invalid path in assignments",
+	[ACTION_EXPECTED_PATCH] = "Expected merge patch as second input value",
+	[ACTION_EXPECTED_JSON_PATCH] = "Expected JSON patch as second input value",
+	[ACTION_PATCH_FAILED] = "JSON patch could not be applied",
+	[ACTION_INVALID_TAPE] = "Invalid compiled input",
+	[ACTION_TOO_LARGE] = "Input value is too large to be compiled",
+};
+
+
+enum action_error action_value(struct json_parser* parser, struct output* out, const struct input* input, size_t index) {
+	struct json_value* json_in;
+	size_t length = index + 1;
+
+	if(input->tape) {
+		struct json_value value;
+		size_t node;
+
+		if(index >= input->tape->values) return ACTION_OK;
+		if(tape_top_value(input->tape, index, &node) || tape_value(input->tape, parser->arena, node, json_parser_max_depth(parser), &value)) return ACTION_INVALID_TAPE;
+
+		out->print(out, &value, 0);
+		return ACTION_OK;
+	}
+
+	if(!load_input(parser, input, &json_in, &length) && index < length) {
+		out->print(out, &json_in[index], 0);
+	}
+
+	return ACTION_OK;
+}
+
+
+enum action_error action_type(struct json_parser* parser, struct output* out, const struct input* input) {
+	struct json_value* json_in;
+	size_t length = 1;
+
+	if(input->tape) {
+		const struct tape_node* node = input->tape->values ? tape_node(input->tape, 0) : NULL;
+		if(node == NULL) return ACTION_INVALID_TAPE;
+
+		output_string(out, json_type_name(node->type));
+		return ACTION_OK;
+	}
+
+	if(load_input(parser, input, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+
+	output_string(out, json_type_name(json_in->type));
+
+	return ACTION_OK;
+}
+
+
+// Keys are printed one per line, or as compact JSON array if `array` is set
+enum action_error action_keys(struct json_parser* parser, struct output* out, const struct input* input, int array) {
+	struct json_value* json_in;
+	size_t length = 1;
+
+	if(input->tape) {
+		const struct tape* tape = input->tape;
+		const struct tape_node* node = tape->values ? tape_node(tape, 0) : NULL;
+
+		if(node == NULL) return ACTION_INVALID_TAPE;
+		if(node->type != JSON_TYPE_OBJECT) return ACTION_EXPECTED_OBJECT;
+
+		// keys are printed straight from tape, values are skipped
+		size_t member = 1, i;
+		for(i = 0; i < node->length; i++) {
+			const struct tape_node* key = tape_node(tape, member);
+			if(key == NULL || key->type != JSON_TYPE_STRING) return ACTION_INVALID_TAPE;
+
+			struct json_string string;
+			if(tape_string(tape, key, &string)) return ACTION_INVALID_TAPE;
+			print_string(out, &string);
+			output_char(out, '\n');
+
+			member = tape_next(tape, member + 1);
+			if(member == 0 || member > node->value) return ACTION_INVALID_TAPE;
+		}
+
+		return ACTION_OK;
+	}
+
+	if(load_input(parser, input, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+	if(json_in->type != JSON_TYPE_OBJECT) return ACTION_EXPECTED_OBJECT;
+
+	if(!array) {
+		print_keys(out, json_in);
+		return ACTION_OK;
+	}
+
+	const struct json_object* object = &json_in->value.object;
+
+	output_char(out, '[');
+	size_t i;
+	for(i = 0; i < object->length; i++) {
+		if(i) output_char(out, ',');
+		print_string(out, &object->keys[i]);
+	}
+	output_char(out, ']');
+
+	return ACTION_OK;
+}
+
+
+enum action_error action_get(struct json_parser* parser, struct output* out, const struct input* input, const struct path* path) {
+	struct json_value resolved_value;
+	int found = 0;
+
+	if(input->tape) {
+		size_t node;
+		ssize_t resolved = input->tape->values ? tape_resolve(input->tape, 0, path, &node) : -1;
+
+		if(resolved < 0) return ACTION_INVALID_TAPE;
+		if(resolved == path->length) {
+			if(tape_value(input->tape, parser->arena, node, json_parser_max_depth(parser), &resolved_value)) return ACTION_INVALID_TAPE;
+			found = 1;
+		}
+	} else if(input->cached) {
+		struct json_value* json_in;
+		const struct json_value* resolved;
+		size_t length = 1;
+
+		if(cache_entry_values(input->cached, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+
+		// cached document is shared by concurrent requests, its key indexes were built when it was loaded
+		if(json_resolve_path(NULL, json_in, path, &resolved) == path->length) {
+			resolved_value = *resolved;
+			found = 1;
+		}
+	} else {
+		const char* start = input->content;
+		const char* end = start + input->length;
+		if(start < end) json_parser_scan_whitespace(parser, &start, end, NULL);
+
+		// only the value at path is parsed, the rest of the document is just validated
+		const char* tmp_pos = start;
+		if(start >= end || json_parser_scan_path(parser, &start, end, path, 0, &resolved_value, &found, 0) || start == tmp_pos) {
+			return ACTION_INVALID_INPUT;
+		}
+	}
+
+	if(found) {
+		out->print(out, &resolved_value, 0);
+	}
+
+	return ACTION_OK;
+}
+
+
+// Assigns `value` at `path`, or the second input value if `value` is NULL
+enum action_error action_set(struct json_parser* parser, struct output* out, const struct input* input, const struct path* path, const struct json_value* value) {
+	struct json_value json_in[2];
+	struct path parent = { .components = path->components, .length = path->length ? path->length - 1 : 0 };
+
+	json_in[1].type = JSON_TYPE_UNDEFINED;
+
+	if(input->cached) {
+		struct json_value* values;
+		size_t length = value ? 1 : 2;
+
+		if(cache_entry_values(input->cached, &values, &length) || length < 1) return ACTION_INVALID_INPUT;
+
+		// cached document is shared with other requests, `json_path_set` copies what it changes
+		json_in[0] = values[0];
+		if(length > 1) json_in[1] = values[1];
+	} else {
+		// only containers along the path are parsed, other values are kept as text until printed
+		const char* start = input->content;
+		const char* end = start + input->length;
+		if(start < end) json_parser_scan_whitespace(parser, &start, end, NULL);
+
+		const char* tmp_pos = start;
+		if(start >= end || json_parser_scan_spine(parser, &start, end, &parent, 0, &json_in[0]) || start == tmp_pos) {
+			return ACTION_INVALID_INPUT;
+		}
+
+		if(!value) {
+			if(start < end) json_parser_scan_whitespace(parser, &start, end, NULL);
+
+			tmp_pos = start;
+			if(start < end && (json_parser_scan_value(parser, &start, end, &json_in[1]) || start == tmp_pos)) {
+				return ACTION_INVALID_INPUT;
+			}
+		}
+	}
+
+	json_path_set(parser->arena, json_in, path, value ? value : &json_in[1]);
+
+	out->print(out, json_in, 0);
+
+	return ACTION_OK;
+}
+
+
+// Sets values of `assignments` object at paths given by its keys (parsed into `paths`), in order. If `assignments`
+// is NULL, they are taken from the second input value and keys are parsed as JSON Pointers if `pointer` is set.
+enum action_error action_set_many(struct json_parser* parser, struct output* out, const struct input* input, const struct json_object* assignments, const struct path* paths, int pointer) {
+	struct json_value* json_in;
+	struct path* input_paths = NULL;
+	size_t length = assignments ? 1 : 2;
+
+	if(load_input(parser, input, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+
+	if(!assignments) {
+		if(length < 2 || json_in[1].type != JSON_TYPE_OBJECT) return ACTION_EXPECTED_ASSIGNMENTS;
+
+		assignments = &json_in[1].value.object;
+		paths = input_paths = parse_assignments(assignments, pointer);
+		if(paths == NULL) return ACTION_INVALID_PATH;
+	}
+
+	// cached document is shared with other requests, `json_path_set` copies what it changes
+	struct json_value root = json_in[0];
+
+	size_t i;
+	for(i = 0; i < assignments->length; i++) {
+		json_path_set(parser->arena, &root, &paths[i], &assignments->values[i]);
+	}
+
+	out->print(out, &root, 0);
+
+	if(input_paths) paths_free(input_paths, assignments->length);
+
+	return ACTION_OK;
+}
+
+
+// Applies `patch` (or the second input value if `patch` is NULL) to the input value as RFC 7396 merge patch
+enum action_error action_merge(struct json_parser* parser, struct output* out, const struct input* input, const struct json_value* patch) {
+	struct json_value* json_in;
+	size_t length = patch ? 1 : 2;
+
+	if(load_input(parser, input, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+
+	if(!patch) {
+		if(length < 2) return ACTION_EXPECTED_PATCH;
+		patch = &json_in[1];
+	}
+
+	// cached document is shared with other requests, `json_merge_patch` copies what it changes
+	struct json_value root = json_in[0];
+	json_merge_patch(parser->arena, &root, patch);
+
+	out->print(out, &root, 0);
+
+	return ACTION_OK;
+}
+
+
+// Applies JSON Patch `operations` (or the second input value if `operations` is NULL). Document is left unchanged
+// if any of the operations fails.
+enum action_error action_patch(struct json_parser* parser, struct output* out, const struct input* input, const struct json_patch_operation* operations, size_t operations_length) {
+	struct json_value* json_in;
+	struct json_patch_operation* input_operations = NULL;
+	size_t length = operations ? 1 : 2;
+	int shared = parser->shared;
+
+	// shared containers are copied on the first change, so failed patch does not have to be rolled back
+	parser->shared = 1;
+	int r = load_input(parser, input, &json_in, &length);
+	parser->shared = shared;
+
+	if(r || length < 1) return ACTION_INVALID_INPUT;
+
+	if(!operations) {
+		if(length < 2) return ACTION_EXPECTED_JSON_PATCH;
+
+		operations = input_operations = parse_patch(&json_in[1], &operations_length);
+		if(operations == NULL) return ACTION_EXPECTED_JSON_PATCH;
+	}
+
+	struct json_value root = json_in[0];
+	enum action_error error = ACTION_OK;
+
+	if(json_patch_apply(parser->arena, &root, operations, operations_length) == operations_length) {
+		out->print(out, &root, 0);
+	} else {
+		error = ACTION_PATCH_FAILED;
+	}
+
+	if(input_operations) patch_free(input_operations, operations_length);
+
+	return error;
+}
+
+
+// Aggregates values at `aggregate->path` in elements of array at `path`. Elements are scanned one by one, so
+// the array is never materialized. Nothing is printed if there is no value at `path`.
+enum action_error action_aggregate(struct json_parser* parser, struct output* out, const struct input* input, const struct path* path, struct aggregate* aggregate) {
+	int found = 0;
+
+	if(input->cached) {
+		struct json_value* json_in;
+		const struct json_value* array;
+		size_t length = 1, i;
+
+		if(cache_entry_values(input->cached, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+
+		// cached document is shared by concurrent requests, its key indexes were built when it was loaded
+		if(json_resolve_path(NULL, json_in, path, &array) == path->length) {
+			if(array->type != JSON_TYPE_ARRAY) return ACTION_EXPECTED_ARRAY;
+
+			for(i = 0; i < array->value.array.length; i++) {
+				aggregate_add_parsed(NULL, aggregate, &array->value.array.values[i]);
+			}
+			found = 1;
+		}
+	} else {
+		const char* start = input->content;
+		const char* end = start + input->length;
+		if(start < end) json_parser_scan_whitespace(parser, &start, end, NULL);
+
+		const char* tmp_pos = start;
+		if(start >= end || aggregate_scan_array(parser, &start, end, path, 0, aggregate, &found) || start == tmp_pos) {
+			return ACTION_INVALID_INPUT;
+		}
+
+		if(found < 0) return ACTION_EXPECTED_ARRAY;
+	}
+
+	if(found) aggregate_print(parser->arena, aggregate, out);
+
+	return ACTION_OK;
+}
+
+
+// Same as `action_aggregate` for input read from `fd` in chunks. Returns -1 if input could not be read.
+int action_aggregate_stream(struct json_parser* parser, struct output* out, int fd, const struct path* path, struct aggregate* aggregate, enum action_error* error) {
+	struct aggregate_stream stream = { .fd = fd, .buffer = { .content = NULL, .length = 0, .size = 0 }, .position = 0, .eof = 0, .error = 0 };
+	enum json_error json_error = JSON_ERROR_UNEXPECTED_END;
+	int found = 0;
+
+	while(!aggregate_stream_read(&stream)) {
+		const char* in = stream.buffer.content + stream.position;
+		const char* end = stream.buffer.content + stream.buffer.length;
+		if(in < end) json_parser_scan_whitespace(parser, &in, end, NULL);
+		stream.position = in - stream.buffer.content;
+
+		if(in < end) {
+			json_error = aggregate_stream_array(parser, &stream, path, 0, aggregate, &found);
+			break;
+		}
+
+		if(stream.eof) break;
+	}
 
- error:
+	free(stream.buffer.content);
+	if(stream.error) return -1;
 
-	free(buffer.content);
-	return error;
+	*error = json_error ? ACTION_INVALID_INPUT : found < 0 ? ACTION_EXPECTED_ARRAY : ACTION_OK;
+	if(*error == ACTION_OK && found) aggregate_print(parser->arena, aggregate, out);
+
+	return 0;
 }
 
 
-enum json_error json_parser_scan_boolean(const char** in, const char* end, struct json_boolean* out) {
+// Writes all input values compiled into tape
+enum action_error action_compile(struct json_parser* parser, struct output* out, const struct input* input) {
+	struct json_value* json_in;
+	size_t length = 0;
 
-	assert(*in < end);
+	if(load_input(parser, input, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+	if(tape_write(out, json_in, length)) return ACTION_TOO_LARGE;
 
-	const char* s = *in;
-	if(*in + 4 <= end && s[0] == 't' && s[1] == 'r' && s[2] == 'u' && s[3] == 'e') {
-		out->value = 1;
-		*in += 4;
-	} else if(*in + 5 <= end && s[0] == 'f' && s[1] == 'a' && s[2] == 'l' && s[3] == 's' && s[4] == 'e') {
-		out->value = 0;
-		*in += 5;
-	}
-	return JSON_ERROR_OK;
+	return ACTION_OK;
 }
 
 
-enum json_error json_parser_scan_null(const char** in, const char* end) {
+// Inserts `values` (or the input values following the array if `values` is NULL) into the input array
+enum action_error action_splice(struct json_parser* parser, struct output* out, const struct input* input, size_t index, size_t count, const struct json_value* values, size_t length) {
+	struct json_value* json_in;
+	size_t input_length = values ? 1 : 0;
 
-	assert(*in < end);
+	if(load_input(parser, input, &json_in, &input_length) || input_length < 1) return ACTION_INVALID_INPUT;
+	if(json_in->type != JSON_TYPE_ARRAY) return ACTION_EXPECTED_ARRAY;
 
-	const char* s = *in;
-	if(*in + 4 <= end && s[0] == 'n' && s[1] == 'u' && s[2] == 'l' && s[3] == 'l') {
-		*in += 4;
+	if(!values) {
+		values = &json_in[1];
+		length = input_length - 1;
 	}
-	return JSON_ERROR_OK;
-}
 
+	struct json_value root = *json_in;
+	struct json_array* array = &root.value.array;
 
-enum json_error json_parser_scan_value(const char** in, const char* end, struct json_value* out) {
+	if(index >= array->length) {
+		count = 0;
+		index = array->length;
+	} else if(index + count >= array->length) {
+		count = array->length - index;
+	}
 
-	assert(*in < end);
+	// members of cached document are copied here, as it is shared with other requests
+	size_t new_size = array->length + length - count;
+	json_array_reserve(parser->arena, array, new_size);
 
-	const char* pos = *in;
-	enum json_error error;
+	size_t shift_dst = index + length;
+	size_t shift_src = index + count;
+	if(shift_src != shift_dst) {
+		size_t shift_count = array->length - shift_src;
+		memmove(&array->values[shift_dst], &array->values[shift_src], shift_count * sizeof(struct json_value));
+	}
 
-	if(error = json_parser_scan_string(in, end, &out->value.string)) return error;
-	if(pos != *in) {
-		out->type = JSON_TYPE_STRING;
-		return JSON_ERROR_OK;
+	if(length) {
+		memcpy(&array->values[index], values, length * sizeof(struct json_value));
 	}
 
-	if(error = json_parser_scan_number(in, end, &out->value.number)) return error;
-	if(pos != *in) {
-		out->type = JSON_TYPE_NUMBER;
-		return JSON_ERROR_OK;
+	array->length = new_size;
+
+	out->print(out, &root, 0);
+
+	return ACTION_OK;
+}
+
+
+// Same as `action_set`, but prints input text with only the changed member replaced
+enum action_error action_edit_set(struct json_parser* parser, struct output* out, const struct input* input, const struct path* path) {
+	static const struct path empty = { .components = NULL, .length = 0 };
+	struct path grandparent = { .components = path->components, .length = path->length < 2 ? 0 : path->length - 2 };
+	struct path parent = { .components = path->components, .length = path->length - 1 };
+	const char* start = input->content;
+	const char* end = start + input->length;
+	struct json_value root, container;
+	const char* container_start = NULL;
+	const char* container_end = NULL;
+
+	if(start < end) json_parser_scan_whitespace(parser, &start, end, NULL);
+
+	const char* document = start;
+	if(start >= end || json_parser_scan_spine(parser, &start, end, &grandparent, 0, &root) || start == document) {
+		return ACTION_INVALID_INPUT;
 	}
+	const char* document_end = start;
 
-	if(error = json_parser_scan_object(in, end, &out->value.object)) return error;
-	if(pos != *in) {
-		out->type = JSON_TYPE_OBJECT;
-		return JSON_ERROR_OK;
+	container.type = JSON_TYPE_UNDEFINED;
+
+	if(parent.length == 0) {
+		container = root;
+		container_start = document;
+		container_end = document_end;
+	} else {
+		// container is unparsed member of its parent, so its text is known; it is scanned once more for its members
+		const struct json_value* resolved;
+		if(json_resolve_path(NULL, &root, &parent, &resolved) == parent.length && resolved->type == JSON_TYPE_UNPARSED) {
+			struct json_parser members = { .arena = parser->arena, .max_depth = parser->max_depth };
+			container_start = resolved->value.unparsed.content;
+			container_end = container_start + resolved->value.unparsed.length;
+
+			const char* tmp_pos = container_start;
+			json_parser_scan_spine(&members, &tmp_pos, container_end, &empty, 0, &container);
+			json_parser_free(&members);
+		}
 	}
 
-	if(error = json_parser_scan_array(in, end, &out->value.array)) return error;
-	if(pos != *in) {
-		out->type = JSON_TYPE_ARRAY;
-		return JSON_ERROR_OK;
+	struct json_unparsed value;
+	int has_value = 0;
+
+	if(start < end) json_parser_scan_whitespace(parser, &start, end, NULL);
+
+	if(start < end) {
+		const char* tmp_pos = start;
+		if(json_parser_scan_value(parser, &start, end, NULL) || start == tmp_pos) return ACTION_INVALID_INPUT;
+
+		value.content = tmp_pos;
+		value.length = start - tmp_pos;
+		has_value = 1;
 	}
 
-	if(error = json_parser_scan_boolean(in, end, &out->value.boolean)) return error;
-	if(pos != *in) {
-		out->type = JSON_TYPE_BOOLEAN;
-		return JSON_ERROR_OK;
+	struct json_edit edit = { .start = NULL, .length = 0, .replacement = { .content = NULL, .length = 0, .size = 0 } };
+
+	if(container_start && json_edit_set(&container, container_start, container_end, &path->components[path->length - 1], has_value ? &value : NULL, &edit)) {
+		out->invalid = 1;
 	}
 
-	if(error = json_parser_scan_null(in, end)) return error;
-	if(pos != *in) {
-		out->type = JSON_TYPE_NULL;
-		return JSON_ERROR_OK;
+	json_edit_print(out, document, document_end, &edit);
+	free(edit.replacement.content);
+
+	return ACTION_OK;
+}
+
+
+// Same as `action_splice`, but prints input text with only the changed elements replaced. Inserted values are
+// copied as they are written in input.
+enum action_error action_edit_splice(struct json_parser* parser, struct output* out, const struct input* input, size_t index, size_t count) {
+	static const struct path empty = { .components = NULL, .length = 0 };
+	const char* start = input->content;
+	const char* end = start + input->length;
+	struct json_value array;
+
+	if(start < end) json_parser_scan_whitespace(parser, &start, end, NULL);
+
+	const char* document = start;
+	if(start >= end || json_parser_scan_spine(parser, &start, end, &empty, 0, &array) || start == document) {
+		return ACTION_INVALID_INPUT;
 	}
+	const char* document_end = start;
 
-	return JSON_ERROR_OK;
+	if(array.type != JSON_TYPE_ARRAY) return ACTION_EXPECTED_ARRAY;
+
+	struct json_unparsed* values = NULL;
+	size_t length = 0;
+
+	while(start < end) {
+		json_parser_scan_whitespace(parser, &start, end, NULL);
+		if(start >= end) break;
+
+		const char* tmp_pos = start;
+		if(json_parser_scan_value(parser, &start, end, NULL) || start == tmp_pos) {
+			free(values);
+			return ACTION_INVALID_INPUT;
+		}
+
+		values = realloc(values, (length + 1) * sizeof(struct json_unparsed));
+		values[length].content = tmp_pos;
+		values[length].length = start - tmp_pos;
+		length++;
+	}
+
+	struct json_edit edit = { .start = NULL, .length = 0, .replacement = { .content = NULL, .length = 0, .size = 0 } };
+
+	json_edit_splice(&array, document, document_end, index, count, values, length, &edit);
+	json_edit_print(out, document, document_end, &edit);
+
+	free(edit.replacement.content);
+	free(values);
+
+	return ACTION_OK;
 }
 
 
-/********************/
-/** JSON generator **/
-/********************/
+enum action_error action_decode_string(struct json_parser* parser, struct output* out, const struct input* input) {
+	struct json_value* json_in;
+	size_t length = 1;
 
+	if(load_input(parser, input, &json_in, &length) || length < 1) return ACTION_INVALID_INPUT;
+	if(json_in->type != JSON_TYPE_STRING) return ACTION_EXPECTED_STRING;
 
-void json_encode_string(const unsigned char* in, size_t length, struct buffer* out);
+	json_string_decode(&json_in->value.string, &out->buffer);
+	output_check(out);
 
-void print_value(const struct json_value*, unsigned int);
-void print_string(const struct json_string*);
-void print_number(const struct json_number*);
-void print_object(const struct json_object*, unsigned int);
-void print_array(const struct json_array*, unsigned int);
-void print_boolean(const struct json_boolean*);
-void print_null();
+	return ACTION_OK;
+}
 
 
-void print_value(const struct json_value* value, unsigned int level) {
-	switch(value->type) {
-//	case JSON_TYPE_UNDEFINED:
-//		printf("undefined");
-//		break;
-	case JSON_TYPE_STRING:
-		print_string(&value->value.string);
+/****************/
+/** JSON Lines **/
+/****************/
+
+
+#define LINES_CHUNK_SIZE (1 << 20)
+
+// Action applied to every line of input in --lines mode. Values for `set`, `splice`, `merge` and `patch` come from
+// arguments.
+struct lines {
+	const char* program_name;
+	FILE* errors;
+	enum op op;
+	struct output* out;
+	struct json_parser* parser; // its arena is reset for every record
+	const struct path* path;
+	size_t index_argument, count;
+	const struct json_value* values;
+	size_t values_length;
+	const struct path* paths; // paths of `set-many` assignments, which are the only value
+	const struct json_patch_operation* operations; // operations of `patch`, which is the only value
+	size_t operations_length;
+	struct aggregate* aggregate; // records of `aggregate` are added to it, nothing is printed for them
+};
+
+
+// Runs action on single record and terminates its output with a newline
+int run_record(struct lines* lines, const char* start, const char* end, size_t line_number) {
+	struct json_parser* parser = lines->parser;
+	struct input input = { .content = start, .length = end - start, .cached = NULL };
+	struct output* out = lines->out;
+	size_t output_length = out->buffer.length;
+	enum action_error error = ACTION_OK;
+
+	arena_reset(parser->arena);
+	json_index_init(parser->index, start, end);
+
+	switch(lines->op) {
+	case OP_CHECK: {
+		struct json_validator validator;
+		json_validator_init(&validator, parser->max_depth);
+		json_validator_feed(&validator, start, end);
+		if(json_validator_finish(&validator)) output_string(out, "ERROR");
+		json_validator_free(&validator);
 		break;
-	case JSON_TYPE_NUMBER:
-		print_number(&value->value.number);
+	}
+	case OP_VALUE:
+		error = action_value(parser, out, &input, lines->index_argument);
 		break;
-	case JSON_TYPE_OBJECT:
-		print_object(&value->value.object, level);
+	case OP_TYPE:
+		error = action_type(parser, out, &input);
 		break;
-	case JSON_TYPE_ARRAY:
-		print_array(&value->value.array, level);
+	case OP_GET:
+		error = action_get(parser, out, &input, lines->path);
 		break;
-	case JSON_TYPE_BOOLEAN:
-		print_boolean(&value->value.boolean);
+	case OP_KEYS:
+		error = action_keys(parser, out, &input, 1);
 		break;
-	case JSON_TYPE_NULL:
-		print_null();
+	case OP_SET:
+		error = action_set(parser, out, &input, lines->path, lines->values);
+		break;
+	case OP_SET_MANY:
+		error = action_set_many(parser, out, &input, &lines->values->value.object, lines->paths, 0);
+		break;
+	case OP_MERGE:
+		error = action_merge(parser, out, &input, lines->values);
+		break;
+	case OP_PATCH:
+		error = action_patch(parser, out, &input, lines->operations, lines->operations_length);
+		break;
+	case OP_SPLICE:
+		error = action_splice(parser, out, &input, lines->index_argument, lines->count, lines->values, lines->values_length);
+		break;
+	case OP_DECODE_STRING:
+		error = action_decode_string(parser, out, &input);
+		break;
+	case OP_AGGREGATE: {
+		const char* in = start;
+		json_parser_scan_whitespace(parser, &in, end, NULL);
+		if(aggregate_scan_record(parser, &in, end, lines->aggregate)) error = ACTION_INVALID_INPUT;
+		break;
+	}
+	case OP_ENCODE_STRING:
+		// encoded string is appended to buffer directly, partial output is dropped
+		if(json_encode_string((const unsigned char*)start, end - start, &out->buffer)) {
+			out->buffer.length = output_length;
+			error = ACTION_INVALID_INPUT;
+		}
+		output_check(out);
 		break;
 	default:
 		assert(0);
 	}
-}
 
+	// failed record still gets its line so output lines match input lines
+	if(error) {
+		fprintf(lines->errors, "%s: %s at line %zu\n", lines->program_name, action_error_messages[error], line_number);
+	}
+
+	if(lines->op != OP_AGGREGATE) output_char(out, '\n');
 
-void print_string(const struct json_string* string) {
-	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
-	json_encode_string((unsigned char*)string->content, string->length, &buffer);
-	printf("\"%.*s\"", (unsigned int)buffer.length, buffer.content);
+	return error ? -1 : 0;
 }
 
 
-void print_number(const struct json_number* number) {
-	printf("%.*s", (unsigned int)number->length, number->content);
-}
+// Runs action on every non-empty line of content. Last line is processed only if it is terminated or if `eof` is set.
+// Returns position following the last processed line.
+const char* run_lines_batch(struct lines* lines, const char* in, const char* end, int eof, size_t* line_number, int* status) {
+	while(in < end) {
+		const char* line_end = memchr(in, '\n', end - in);
+		if(line_end == NULL) {
+			if(!eof) break;
+			line_end = end;
+		}
 
+		(*line_number)++;
 
-void print_object(const struct json_object* object, unsigned int level) {
-	printf("{\n");
+		const char* start = in;
+		in = line_end < end ? line_end + 1 : end;
 
-	level++;
+		if(line_end > start && line_end[-1] == '\r') line_end--;
 
-	int i, ii;
-	for(i = 0; i < object->length; i++) {
-		for(ii = 0; ii < level; ii++) printf("\t");
-		print_string(&object->keys[i]);
-		printf(" : ");
-		print_value(&object->values[i], level);
-		if(i != object->length - 1) printf(",");
-		printf("\n");
-	}
+		const char* tmp_pos = start;
+		while(tmp_pos < line_end && (*tmp_pos == 0x20 || *tmp_pos == 0x09 || *tmp_pos == 0x0D)) tmp_pos++;
+		if(tmp_pos == line_end) continue;
 
-	for(ii = 0; ii < level - 1; ii++) printf("\t");
+		if(run_record(lines, start, line_end, *line_number)) *status = 1;
+	}
 
-	printf("}");
+	return in;
 }
 
 
-void print_array(const struct json_array* array, unsigned int level) {
-	printf("[\n");
+// Reads input in chunks and runs action on every non-empty line. Memory use is bounded by the chunk size and
+// the longest line. Output is flushed whenever more input has to be read.
+int run_lines(struct lines* lines, int fd) {
+	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
+	size_t line_number = 0;
+	int status = 0, eof = 0;
 
-	level++;
+	buffer_reserve(&buffer, LINES_CHUNK_SIZE);
 
-	int i, ii;
-	for(i = 0; i < array->length; i++) {
-		for(ii = 0; ii < level; ii++) printf("\t");
-		print_value(&array->values[i], level);
-		if(i+1 < array->length) printf(",");
-		printf("\n");
-	}
+	while(!eof) {
+		if(buffer.length == buffer.size) buffer_reserve(&buffer, buffer.size * 2);
 
-	for(ii = 0; ii < level - 1; ii++) printf("\t");
+		output_flush(lines->out);
 
-	printf("]");
-}
+		ssize_t r = read(fd, buffer.content + buffer.length, buffer.size - buffer.length);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			free(buffer.content);
+			return -1;
+		}
 
+		eof = r == 0;
+		buffer.length += r;
 
-void print_boolean(const struct json_boolean* boolean) {
-	printf(boolean->value ? "true" : "false");
-}
+		const char* in = run_lines_batch(lines, buffer.content, buffer.content + buffer.length, eof, &line_number, &status);
+
+		// incomplete line is kept for the next chunk
+		buffer.length = buffer.content + buffer.length - in;
+		memmove(buffer.content, in, buffer.length);
+	}
 
+	free(buffer.content);
 
-void print_null() {
-	printf("null");
+	return status;
 }
 
 
-/****************/
-/** JSON utils **/
-/****************/
+// Input is split at line boundaries into batches of about LINES_BATCH_SIZE bytes, which are processed by worker
+// threads, each with its own parser, arena and output buffer. Reading and writing is done by the calling thread,
+// which writes results of batches in input order, or as soon as they are ready if order is not kept.
 
+#define LINES_BATCH_SIZE (4 << 20)
+#define LINES_MAX_JOBS 1024
 
-struct path {
-	struct json_string* components;
-	size_t length;
+struct lines_batch {
+	struct lines_batch* next;
+	size_t sequence;
+	size_t line_number; // lines preceding the batch
+	struct buffer input;
+	struct buffer output;
+	struct aggregate aggregate; // of records in the batch
+	int status;
 };
 
+struct lines_pool {
+	const struct lines* lines;
+	pthread_mutex_t mutex;
+	pthread_cond_t queued, done;
+	struct lines_batch* queue_first;
+	struct lines_batch* queue_last;
+	struct lines_batch* done_first; // processed batches in order of completion
+	int closing;
+};
 
-// FIXME: hacking with const
-int json_resolve_path(const struct json_value*, const struct path*, const struct json_value** out);
-struct json_value* json_object_resolve(const struct json_object*, const struct json_string*);
-int json_string_to_index(const struct json_string*, size_t*);
-void json_object_set(struct json_object*, const struct json_string*, const struct json_value*, struct json_value*);
-void json_array_set(struct json_array*, size_t, const struct json_value*, struct json_value*);
-void json_encode_string(const unsigned char*, size_t, struct buffer*);
 
+void* lines_worker(void* argument) {
+	struct lines_pool* pool = argument;
+	struct lines lines = *pool->lines;
+	struct arena arena = { .chunk = NULL, .chunk_size = ARENA_CHUNK_SIZE, .huge_pages = lines.parser->arena->huge_pages };
+	struct json_parser parser = { .arena = &arena, .index = malloc(sizeof(struct json_index)), .max_depth = lines.parser->max_depth };
+	struct output out;
 
-int json_resolve_path(const struct json_value* in, const struct path* path, const struct json_value** out) {
-	int i;
-	for(i = 0; i < path->length; i++) {
+	// output is kept in memory and handed over with the batch
+	output_init(&out, -1);
+	out.indent = lines.out->indent;
+	out.indent_length = lines.out->indent_length;
+	out.print = lines.out->print;
 
-		const struct json_string* component = &path->components[i];
+	lines.parser = &parser;
+	lines.out = &out;
 
-		if(in->type == JSON_TYPE_OBJECT) {
-			in = json_object_resolve(&in->value.object, component);
-			if(in == NULL) break;
-		} else if(in->type == JSON_TYPE_ARRAY) {
+	while(1) {
+		pthread_mutex_lock(&pool->mutex);
+		while(pool->queue_first == NULL && !pool->closing) pthread_cond_wait(&pool->queued, &pool->mutex);
 
-			// because I do not trust standard number parsers and my use case is simplistic anyway
-			size_t index = 0;
+		struct lines_batch* batch = pool->queue_first;
+		if(batch) {
+			pool->queue_first = batch->next;
+			if(pool->queue_first == NULL) pool->queue_last = NULL;
+		}
+		pthread_mutex_unlock(&pool->mutex);
 
-			if(json_string_to_index(component, &index) || index >= in->value.array.length) {
-				in = NULL;
-				break;
-			}
+		if(batch == NULL) break;
 
-			in = &in->value.array.values[index];
-		} else {
-			in = NULL;
-			break;
+		size_t line_number = batch->line_number;
+		const char* start = batch->input.content;
+
+		out.buffer = batch->output;
+		out.buffer.length = 0;
+		out.invalid = 0;
+		batch->status = 0;
+
+		if(pool->lines->aggregate) {
+			aggregate_init(&batch->aggregate, pool->lines->aggregate->path, pool->lines->aggregate->group_path);
+			lines.aggregate = &batch->aggregate;
 		}
+
+		run_lines_batch(&lines, start, start + batch->input.length, 1, &line_number, &batch->status);
+
+		if(out.invalid) batch->status = 1;
+		batch->output = out.buffer;
+		out.buffer.content = NULL;
+		out.buffer.length = out.buffer.size = 0;
+
+		pthread_mutex_lock(&pool->mutex);
+		batch->next = pool->done_first;
+		pool->done_first = batch;
+		pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->mutex);
 	}
 
-	*out = in;
+	output_free(&out);
+	json_parser_free(&parser);
+	free(parser.index);
+	arena_free(&arena);
 
-	return i;
+	return NULL;
 }
 
 
-struct json_value* json_object_resolve(const struct json_object* object, const struct json_string* key) {
-	struct json_value* property_value = NULL;
-	size_t ii;
-	for(ii = 0; ii < object->length; ii++) {
-		if(key->length == object->keys[ii].length && strncmp(object->keys[ii].content, key->content, key->length) == 0) {
-			property_value = &object->values[ii];
-		}
-	}
+// Fills `batch` with complete lines. Partial line at the end is moved to `rest` and starts the next batch.
+int lines_read_batch(int fd, struct lines_batch* batch, struct buffer* rest, int* eof) {
+	struct buffer* input = &batch->input;
+	size_t line_end = 0; // length of content up to the last newline
 
-	return property_value;
-}
+	buffer_reserve(input, rest->length > LINES_BATCH_SIZE ? rest->length : LINES_BATCH_SIZE);
+	if(rest->length) memcpy(input->content, rest->content, rest->length);
+	input->length = rest->length;
+	rest->length = 0;
 
+	while(!*eof && (input->length < LINES_BATCH_SIZE || line_end == 0)) {
+		if(input->length == input->size) buffer_reserve(input, input->size * 2);
 
-int json_string_to_index(const struct json_string* string, size_t* out) {
-	size_t index = 0;
-	size_t ii;
-	for(ii = 0; ii < string->length; ii++) {
-		char c = string->content[ii];
-		if(c < '0' || c > '9') {
+		ssize_t r = read(fd, input->content + input->length, input->size - input->length);
+		if(r < 0) {
+			if(errno == EINTR) continue;
 			return -1;
 		}
 
-		int n =	c - '0';
+		if(r == 0) *eof = 1;
 
-		// overflow chack
-		if(index > SIZE_MAX / 10 || (index *= 10) > SIZE_MAX - n) {
-			fprintf(stderr, "Overflow\n");
-			return -1;
-		}
+		// only newly read content is searched, so long lines are not scanned repeatedly
+		size_t i = input->length + r;
+		while(i > input->length && input->content[i - 1] != '\n') i--;
+		if(i > input->length) line_end = i;
 
-		index += n;
+		input->length += r;
+	}
+
+	if(!*eof) {
+		buffer_append(rest, input->content + line_end, input->length - line_end);
+		input->length = line_end;
 	}
 
-	*out = index;
 	return 0;
 }
 
 
-void json_object_set(struct json_object* object, const struct json_string* key, const struct json_value* value, struct json_value* old_value) {
-	struct json_value* v = json_object_resolve(object, key);
-	if(v) {
-		size_t index = v - object->values;
+// Processes lines with `jobs` worker threads. Output is written in input order unless `ordered` is 0.
+int run_lines_parallel(struct lines* lines, int fd, int jobs, int ordered) {
+	struct lines_pool pool = { .lines = lines, .queue_first = NULL, .queue_last = NULL, .done_first = NULL, .closing = 0 };
+	pthread_t* threads = malloc(jobs * sizeof(pthread_t));
+	struct lines_batch* free_batches = NULL;
+	struct buffer rest = { .content = NULL, .length = 0, .size = 0 };
+	size_t sequence = 0, next = 0, in_flight = 0, line_number = 0;
+	int status = 0, eof = 0, error = 0;
+	int i;
 
-//		if(old_key) *old_key = object->keys[index];			// FIXME: key will be dangling
-		if(old_value) *old_value = object->values[index];
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.queued, NULL);
+	pthread_cond_init(&pool.done, NULL);
 
-		if(value->type == JSON_TYPE_UNDEFINED) {
-			object->length--;
-			memmove(&object->keys[index], &object->keys[index+1], (object->length - index) * sizeof(struct json_string));
-			memmove(&object->values[index], &object->values[index+1], (object->length - index) * sizeof(struct json_value));
-		} else {
-			object->keys[index] = *key;
-			object->values[index] = *value;
+	// scanners pick their implementation on first use, which must not happen concurrently
+	const char* empty = "";
+	json_string_find_special(empty, empty);
+	json_utf8_validate(empty, empty);
+	json_encode_find_escape((const unsigned char*)empty, (const unsigned char*)empty);
+
+	for(i = 0; i < jobs; i++) {
+		int r = pthread_create(&threads[i], NULL, lines_worker, &pool);
+		if(r) {
+			fprintf(lines->errors, "%s: Error creating thread: (%d) %s\n", lines->program_name, r, strerror(r));
+			exit(1);
 		}
-	} else if(value->type != JSON_TYPE_UNDEFINED) {
-		object->keys = realloc(object->keys, (object->length + 1) * sizeof(struct json_string));
-		object->values = realloc(object->values, (object->length + 1) * sizeof(struct json_value));
+	}
 
-		object->keys[object->length] = *key;
-		object->values[object->length] = *value;
+	while(!eof || in_flight) {
 
-		object->length++;
-		if(old_value) old_value->type = JSON_TYPE_UNDEFINED;
-	}
-}
+		// keep a couple of batches per worker queued, so workers do not wait for reader
+		if(!eof && in_flight < (size_t)jobs * 2) {
+			struct lines_batch* batch = free_batches;
+			if(batch) {
+				free_batches = batch->next;
+			} else {
+				batch = calloc(1, sizeof(struct lines_batch));
+			}
 
+			// results are not held back by slow input
+			output_flush(lines->out);
 
-void json_array_set(struct json_array* array, size_t index, const struct json_value* value, struct json_value* old_value) {
-	if(index >= array->length) {
-		// fill gap
-		array->values = realloc(array->values, (index + 1) * sizeof(struct json_value));
-		int i;
-		for(i = array->length; i < index; i++) {
-			array->values[i].type = JSON_TYPE_NULL;
+			if(lines_read_batch(fd, batch, &rest, &eof)) {
+				error = errno;
+				eof = 1;
+			}
+
+			if(batch->input.length == 0) {
+				batch->next = free_batches;
+				free_batches = batch;
+				continue;
+			}
+
+			batch->sequence = sequence++;
+			batch->line_number = line_number;
+
+			const char* in = batch->input.content;
+			const char* end = in + batch->input.length;
+			while((in = memchr(in, '\n', end - in))) {
+				line_number++;
+				in++;
+			}
+
+			pthread_mutex_lock(&pool.mutex);
+			batch->next = NULL;
+			if(pool.queue_last) pool.queue_last->next = batch;
+			else pool.queue_first = batch;
+			pool.queue_last = batch;
+			pthread_cond_signal(&pool.queued);
+			pthread_mutex_unlock(&pool.mutex);
+
+			in_flight++;
 		}
-		array->length = index + 1;
 
-		if(old_value) old_value->type = JSON_TYPE_UNDEFINED;
-	} else {
-		if(old_value) *old_value = array->values[index];
+		// take batches that can be written; wait for them only if no more input can be queued
+		int wait = eof || in_flight >= (size_t)jobs * 2;
+		struct lines_batch* ready = NULL;
+		struct lines_batch** last = &ready;
+
+		pthread_mutex_lock(&pool.mutex);
+		while(1) {
+			struct lines_batch** link = &pool.done_first;
+			while(*link) {
+				struct lines_batch* batch = *link;
+				if(!ordered || batch->sequence == next) {
+					*link = batch->next;
+					batch->next = NULL;
+					*last = batch;
+					last = &batch->next;
+					next++;
+					if(ordered) link = &pool.done_first;
+				} else {
+					link = &batch->next;
+				}
+			}
+
+			if(ready || !wait || in_flight == 0) break;
+			pthread_cond_wait(&pool.done, &pool.mutex);
+		}
+		pthread_mutex_unlock(&pool.mutex);
+
+		while(ready) {
+			struct lines_batch* batch = ready;
+			ready = batch->next;
+
+			if(batch->output.length) output_write(lines->out, batch->output.content, batch->output.length);
+			if(batch->status) status = 1;
+
+			// groups keep order of their first appearance unless batches are taken out of order
+			if(lines->aggregate) {
+				aggregate_merge(lines->aggregate, &batch->aggregate);
+				aggregate_free(&batch->aggregate);
+			}
+
+			batch->next = free_batches;
+			free_batches = batch;
+			in_flight--;
+		}
 	}
-	array->values[index] = *value;
-	if(value->type == JSON_TYPE_UNDEFINED) array->values[index].type = JSON_TYPE_NULL;
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.closing = 1;
+	pthread_cond_broadcast(&pool.queued);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for(i = 0; i < jobs; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	while(free_batches) {
+		struct lines_batch* batch = free_batches;
+		free_batches = batch->next;
+		free(batch->input.content);
+		free(batch->output.content);
+		free(batch);
+	}
+
+	free(rest.content);
+	pthread_cond_destroy(&pool.done);
+	pthread_cond_destroy(&pool.queued);
+	pthread_mutex_destroy(&pool.mutex);
+
+	if(error) {
+		errno = error;
+		return -1;
+	}
+
+	return status;
 }
 
 
-void json_encode_string(const unsigned char* in, size_t length, struct buffer* out) {
-	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
+/************/
+/** Server **/
+/************/
 
-	uint16_t unicode_char = 0;
-	const unsigned char* end = in + length;
 
-	while(in < end) {
-		switch(*in) {
-		case '"':
-			buffer_append(&buffer, "\\\"", 2);
-			break;
-		case '\\':
-			buffer_append(&buffer, "\\\\", 2);
-			break;
-		case '\b':
-			buffer_append(&buffer, "\\b", 2);
-			break;
-		case '\f':
-			buffer_append(&buffer, "\\f", 2);
-			break;
-		case '\n':
-			buffer_append(&buffer, "\\n", 2);
-			break;
-		case '\r':
-			buffer_append(&buffer, "\\r", 2);
-			break;
-		case '\t':
-			buffer_append(&buffer, "\\t", 2);
-			break;
-		default:
-			// FIXME: this could be optimized/cleaned?
-			if(*in >= 0x20 && *in < 0x7f) { // printable ASCII characters
-				buffer_append(&buffer, (const char*)in, 1);
-			} else {
+#define SERVER_MAX_REQUEST (16 << 20)
+#define SERVER_TIMEOUT 10 // seconds
+
+// Streams and working directory of an action. Server runs actions of its clients concurrently, each one with
+// the ones sent by its client, so actions never use the process-wide ones.
+struct run_files {
+	int in, out;
+	FILE* errors;
+	int dir; // relative paths are opened from it
+};
+
+int run(struct cache* cache, const struct run_files* files, int argc, const char* const* argv);
+
+
+int read_full(int fd, void* content, size_t length) {
+	while(length) {
+		ssize_t r = read(fd, content, length);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return -1;
+		content = (char*)content + r;
+		length -= r;
+	}
+
+	return 0;
+}
+
 
-				if(*in < 0x20 || *in == 0x7f) {
-					unicode_char = *in;
-				} else if((*in >> 5) == 0x06) { // starts with 110
-					// 2-byte unicode
+int write_full(int fd, const void* content, size_t length) {
+	struct iovec iov = { .iov_base = (void*)content, .iov_len = length };
+	return output_writev(fd, &iov, 1);
+}
 
-//					fprintf(stderr, "2-byte unicode: %x", *in);
 
-					unicode_char = (*in & 0x1f) << 6;
+// Request is a header with payload length, sent together with client's stdin, stdout, stderr and working directory
+// file descriptors, followed by payload - NUL-terminated arguments. Response is exit status of the action, -1 if
+// client has to run it itself.
+void serve_request(const char* program_name, struct cache* cache, int client) {
+	uint32_t length;
+	int fds[4];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = &length, .iov_len = sizeof(length) };
+	struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
 
-					if(in + 1 < end) {
-						in++;
-//						fprintf(stderr, " %x", *in);
-						unicode_char |= *in & 0x3f;
-					}
-//					fprintf(stderr, "\n");
-				} else if((*in >> 4) == 0x0e) { // starts with 1110
-					// 3-byte unicode
+	ssize_t r = recvmsg(client, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	struct cmsghdr* cmsg = r > 0 ? CMSG_FIRSTHDR(&message) : NULL;
 
-//					fprintf(stderr, "3-byte unicode: %x", *in);
+	if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "%s: Invalid request\n", program_name);
+		return;
+	}
 
-					unicode_char = (*in & 0x0f) << 12;
+	size_t fds_length = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(cmsg), (fds_length < 4 ? fds_length : 4) * sizeof(int));
 
-					if(in + 1 < end) {
-						in++;
-//						fprintf(stderr, " %x", *in);
-						unicode_char |= (*in & 0x3f) << 6;
-					}
+	char* payload = NULL;
+	const char** argv = NULL;
+	FILE* errors = NULL;
+	int32_t status = 1;
 
-					if(in + 1 < end) {
-						in++;
-//						fprintf(stderr, " %x", *in);
-						unicode_char |= *in & 0x3f;
-					}
-//					fprintf(stderr, "\n");
-				} else {
-					fprintf(stderr, "Unsupported unicode sequence starting with %x\n", *in);
-					exit(1);
-				}
+	if(r != sizeof(length) || fds_length != 4 || length > SERVER_MAX_REQUEST) {
+		fprintf(stderr, "%s: Invalid request\n", program_name);
+		goto end;
+	}
 
-				char b[6] = "\\u";
-				b[2] = (unicode_char & 0xf000) >> 12;
-				b[3] = (unicode_char & 0x0f00) >> 8;
-				b[4] = (unicode_char & 0x00f0) >> 4;
-				b[5] = (unicode_char & 0x000f) >> 0;
-//				fprintf(stderr, "Unicode: %x%x%x%x\n", b[2], b[3], b[4], b[5]);
-				b[2] += b[2] >= 0xa ? 'a' - 0xa : '0';
-				b[3] += b[3] >= 0xa ? 'a' - 0xa : '0';
-				b[4] += b[4] >= 0xa ? 'a' - 0xa : '0';
-				b[5] += b[5] >= 0xa ? 'a' - 0xa : '0';
-				buffer_append(&buffer, b, 6);
-			}
-		}
-		in++;
+	payload = malloc(length + 1);
+	if(read_full(client, payload, length)) {
+		fprintf(stderr, "%s: Invalid request\n", program_name);
+		goto end;
 	}
-	*out = buffer;
-}
 
+	size_t argc = 0, i;
+	for(i = 0; i < length; i++) {
+		if(payload[i] == '\0') argc++;
+	}
 
-/**********/
-/** main **/
-/**********/
+	if(argc < 1 || payload[length - 1] != '\0') {
+		fprintf(stderr, "%s: Invalid request\n", program_name);
+		goto end;
+	}
 
+	argv = malloc((argc + 1) * sizeof(const char*));
+	const char* arg = payload;
+	for(i = 0; i < argc; i++) {
+		argv[i] = arg;
+		arg += strlen(arg) + 1;
+	}
+	argv[argc] = NULL;
 
-enum op {
-	OP_UNKNOWN,
-	// make sure that input contains 1 and only 1 valid JSON value
-	OP_CHECK,
-	// print input value at given position
-	OP_VALUE,
-	// print type name of input value
-	OP_TYPE,
-	// get element of array or property of object
-	OP_GET,
-	// get list of keys in object
-	OP_KEYS,
-	// set element of array or property of object
-	OP_SET,
-	// add element to array
-	OP_SPLICE,
-	// decode JSON-encoded string string to UTF-8 encoded string
-	OP_DECODE_STRING,
-	// escape string characters
-	OP_ENCODE_STRING,
-	// escape periods and backslashes in path component
-	OP_ENCODE_KEY,
-};
+	// action runs as if it was started by client
+	errors = fdopen(fds[2], "w");
+	if(errors == NULL) {
+		fprintf(stderr, "%s: Error opening stderr of client: (%d) %s\n", program_name, errno, strerror(errno));
+		goto end;
+	}
+	fds[2] = -1;
 
+	struct run_files files = { .in = fds[0], .out = fds[1], .errors = errors, .dir = fds[3] };
+	status = run(cache, &files, argc, argv);
 
-void print_usage(const char* program_name) {
-	// TODO: write comprehensive usage text
-	printf("Usage: %s ACTION OPTIONS\n", program_name);
+	write_full(client, &status, sizeof(status));
+
+ end:
+
+	if(errors) fclose(errors);
+	free(argv);
+	free(payload);
+	for(i = 0; i < fds_length && i < 4; i++) {
+		if(fds[i] >= 0) close(fds[i]);
+	}
 }
 
 
-int parse_path(const char* in, struct path* path) {
+struct server_connection {
+	const char* program_name;
+	struct cache* cache;
+	int client;
+};
 
-	struct json_string* components = malloc(1 * sizeof(struct json_string));
-	size_t components_size = 1;
-	size_t components_length = 0;
 
-	struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
+void* serve_connection(void* argument) {
+	struct server_connection* connection = argument;
 
-	while(*in != '\0') {
-		if(*in == '.') {
-			if(components_length >= components_size) {
-				components = realloc(components, (components_size *= 2) * sizeof(struct json_string));
-			}
+	serve_request(connection->program_name, connection->cache, connection->client);
+	close(connection->client);
+	free(connection);
 
-			components[components_length].content = buffer.content;
-			components[components_length].length = buffer.length;
-			components_length++;
+	return NULL;
+}
 
-			buffer.content = NULL;
-			buffer.length = buffer.size = 0;
-		} else {
-			if(*in == '\\') {
-				in++;
-				if(*in != '.' && *in != '\\') goto error;
-			}
 
-			buffer_append(&buffer, in, 1);
-		}
-		in++;
+// Serves every request in its own thread, keeping parsed inputs in cache of given size. Actions read input of their
+// clients, which may take long, so one request never waits for another; only receiving of the request itself is
+// limited by SERVER_TIMEOUT.
+int serve(const char* program_name, const char* socket_path, size_t cache_limit) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+	if(strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "%s: Socket path too long %s\n", program_name, socket_path);
+		return 1;
 	}
 
-	if(components_length >= components_size) {
-		components = realloc(components, (components_size *= 2) * sizeof(struct json_string));
+	strcpy(address.sun_path, socket_path);
+	unlink(socket_path);
+
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(server < 0 || bind(server, (struct sockaddr*)&address, sizeof(address)) || listen(server, 64)) {
+		fprintf(stderr, "%s: Error listening on %s: (%d) %s\n", program_name, socket_path, errno, strerror(errno));
+		return 1;
 	}
 
-	components[components_length].content = buffer.content;
-	components[components_length].length  = buffer.length;
+	// client may go away before output is written
+	signal(SIGPIPE, SIG_IGN);
 
-	path->components = components;
-	path->length = components_length + 1;
+	struct cache cache = { .first = NULL, .last = NULL, .memory = 0, .limit = cache_limit };
+	pthread_mutex_init(&cache.mutex, NULL);
 
-	return 0;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
 
- error:
+	struct timeval timeout = { .tv_sec = SERVER_TIMEOUT, .tv_usec = 0 };
 
-	free(buffer.content);
+	while(1) {
+		int client = accept(server, NULL, NULL);
+		if(client < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "%s: Error accepting connection: (%d) %s\n", program_name, errno, strerror(errno));
+			return 1;
+		}
 
-	while(components_length--) {
-		free(components[components_length].content);
-	}
+		// client that does not send its request is dropped
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-	free(components);
+		struct server_connection* connection = malloc(sizeof(struct server_connection));
+		connection->program_name = program_name;
+		connection->cache = &cache;
+		connection->client = client;
 
-	return -1;
+		pthread_t thread;
+		int r = pthread_create(&thread, &attributes, serve_connection, connection);
+		if(r) {
+			fprintf(stderr, "%s: Error creating thread: (%d) %s\n", program_name, r, strerror(r));
+			close(client);
+			free(connection);
+		}
+	}
 }
 
 
-int parse_input(const char** start, const char* end, struct json_value** out, size_t* out_length) {
-	struct json_value* values = malloc(2 * sizeof(struct json_value));
-	size_t size = 2, length = 0;
-	size_t max = *out_length ? *out_length : SIZE_MAX;
+// Forwards invocation to server. Returns exit status of the action or -1 if server is not available.
+int client(const char* socket_path, int argc, const char* const* argv) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
 
-	while(*start < end && max--) {
+	if(strlen(socket_path) >= sizeof(address.sun_path)) return -1;
+	strcpy(address.sun_path, socket_path);
 
-		json_parser_scan_whitespace(start, end, NULL);
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(server < 0) return -1;
 
-		if(*start >= end) break;
+	int cwd = -1;
+	struct buffer payload = { .content = NULL, .length = 0, .size = 0 };
+	int32_t status = -1;
 
-		const char* tmp_pos = *start;
-		struct json_value value;
-		enum json_error error = json_parser_scan_value(start, end, &value);
+	if(connect(server, (struct sockaddr*)&address, sizeof(address))) goto end;
 
-		if(error || *start == tmp_pos) goto error;
+	cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(cwd < 0) goto end;
 
-		if(length >= size) values = realloc(values, (size *= 2) * sizeof(struct json_value));
-		values[length++] = value;
+	int i;
+	for(i = 0; i < argc; i++) {
+		buffer_append(&payload, argv[i], strlen(argv[i]) + 1);
 	}
 
-	*out = values;
-	*out_length = length;
-
-	return 0;
+	uint32_t length = payload.length;
+	int fds[4] = { 0, 1, 2, cwd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = &length, .iov_len = sizeof(length) };
+	struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	// request is not processed until it is complete, so it is safe to fall back to running locally
+	if(sendmsg(server, &message, MSG_NOSIGNAL) != sizeof(length) || write_full(server, payload.content, payload.length)) goto end;
+
+	if(read_full(server, &status, sizeof(status))) {
+		fprintf(stderr, "%s: Lost connection to server %s\n", argv[0], socket_path);
+		status = 1;
+	}
 
- error:
+ end:
 
-	free(values);
+	free(payload.content);
+	if(cwd >= 0) close(cwd);
+	close(server);
 
-	return -1;
+	return status;
 }
 
 
-int main(int argc, const char* const* argv) {
+// Runs action given by command line arguments. Inputs are taken from `cache` if it is given. Returns -1 if action
+// has to be run by client itself.
+int run(struct cache* cache, const struct run_files* files, int argc, const char* const* argv) {
+
+	FILE* errors = files->errors;
 
-	struct buffer stdin_buffer = { .content = malloc(4), .length = 0, .size = 4 };
+	struct buffer stdin_buffer = { .content = NULL, .length = 0, .size = 0 };
+	int stdin_mapped = 0;
+	struct cache_entry* cached = NULL;
+	struct input input = { .content = NULL, .length = 0, .cached = NULL, .tape = NULL };
+	struct tape tape;
 	enum op op = OP_UNKNOWN;
+	int status = 0;
+	int lines_mode = 0, indent_given = 0;
+	int jobs = 1, ordered = 1;
+	int preserve_format = 0;
+	int pointer = 0;
+	const char* group_by = NULL;
+
+	struct path path = { .components = NULL, .length = 0 };
+	struct path value_path = { .components = NULL, .length = 0 };
+	struct path group_path = { .components = NULL, .length = 0 };
+	struct aggregate aggregate = { .path = &value_path, .group_path = NULL };
+	struct path* assignment_paths = NULL;
+	size_t assignments_length = 0;
+	struct json_patch_operation* patch_operations = NULL;
+	size_t patch_length = 0;
+
+	const char* input_path = NULL;
+
+	struct arena arena = { .chunk = NULL, .chunk_size = ARENA_CHUNK_SIZE, .huge_pages = 0 };
+	struct json_parser parser = { .arena = &arena };
+
+	struct output output;
+	output_init(&output, files->out);
+	output.print = print_value;
+
+
+	// options preceding the action
+	const char* args[argc + 1];
+	int argi = 1;
+	while(argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+		if(strcmp(argv[argi], "--") == 0) {
+			argi++;
+			break;
+		} else if(strcmp(argv[argi], "--input") == 0 && argi + 1 < argc) {
+			input_path = argv[argi + 1];
+			argi += 2;
+		} else if(strcmp(argv[argi], "--huge-pages") == 0) {
+			arena.huge_pages = 1;
+			argi++;
+		} else if(strcmp(argv[argi], "--compact") == 0) {
+			output.print = print_value_compact;
+			argi++;
+		} else if(strcmp(argv[argi], "--indent") == 0 && argi + 1 < argc) {
+			static const char spaces[] = "                ";
+			const char* end = argv[argi + 1];
+			errno = 0;
+			uintmax_t indent = strtoumax(argv[argi + 1], (char**)&end, 10);
+			if(*end != '\0' || end == argv[argi + 1] || errno != 0 || indent > sizeof(spaces) - 1) {
+				fprintf(errors, "%s: Invalid indent %s\n", argv[0], argv[argi + 1]);
+				goto fail;
+			}
+			output.indent = spaces;
+			output.indent_length = indent;
+			output.print = indent ? print_value : print_value_compact;
+			indent_given = 1;
+			argi += 2;
+		} else if(strcmp(argv[argi], "--lines") == 0) {
+			lines_mode = 1;
+			argi++;
+		} else if(strcmp(argv[argi], "--jobs") == 0 && argi + 1 < argc) {
+			const char* end = argv[argi + 1];
+			errno = 0;
+			uintmax_t n = strtoumax(argv[argi + 1], (char**)&end, 10);
+			if(argv[argi + 1][0] == '-' || *end != '\0' || end == argv[argi + 1] || errno != 0 || n > LINES_MAX_JOBS) {
+				fprintf(errors, "%s: Invalid number of jobs %s\n", argv[0], argv[argi + 1]);
+				goto fail;
+			}
+			// 0 means one job per processor
+			jobs = n ? n : sysconf(_SC_NPROCESSORS_ONLN);
+			if(jobs < 1) jobs = 1;
+			if(jobs > LINES_MAX_JOBS) jobs = LINES_MAX_JOBS;
+			argi += 2;
+		} else if(strcmp(argv[argi], "--max-depth") == 0 && argi + 1 < argc) {
+			const char* end = argv[argi + 1];
+			errno = 0;
+			uintmax_t n = strtoumax(argv[argi + 1], (char**)&end, 10);
+			if(argv[argi + 1][0] == '-' || *end != '\0' || end == argv[argi + 1] || errno != 0 || n == 0 || n > JSON_PARSER_DEPTH_LIMIT) {
+				fprintf(errors, "%s: Invalid maximum depth %s (at most %d)\n", argv[0], argv[argi + 1], JSON_PARSER_DEPTH_LIMIT);
+				goto fail;
+			}
+			parser.max_depth = n;
+			argi += 2;
+		} else if(strcmp(argv[argi], "--preserve-format") == 0) {
+			preserve_format = 1;
+			argi++;
+		} else if(strcmp(argv[argi], "--pointer") == 0) {
+			pointer = 1;
+			argi++;
+		} else if(strcmp(argv[argi], "--group-by") == 0 && argi + 1 < argc) {
+			group_by = argv[argi + 1];
+			argi += 2;
+		} else if(strcmp(argv[argi], "--unordered") == 0) {
+			ordered = 0;
+			argi++;
+		} else {
+			fprintf(errors, "%s: Invalid option %s\n", argv[0], argv[argi]);
+			goto fail;
+		}
+	}
+
+	if(!lines_mode && (jobs != 1 || !ordered)) {
+		fprintf(errors, "%s: Options --jobs and --unordered require --lines\n", argv[0]);
+		goto fail;
+	}
+
+	if(lines_mode && preserve_format) {
+		fprintf(errors, "%s: Option --preserve-format cannot be used with --lines\n", argv[0]);
+		goto fail;
+	}
+
+	// one output value per line unless indentation is asked for
+	if(lines_mode && !indent_given) output.print = print_value_compact;
+
+	args[0] = argv[0];
+	memcpy(&args[1], &argv[argi], (argc - argi + 1) * sizeof(const char*));
+	argc -= argi - 1;
+	argv = args;
 
 
 	if(argc < 2) {
-		print_usage(argv[0]);
-		exit(1);
+		print_usage(&output, argv[0]);
+		goto fail;
 	}
 
 
@@ -1155,327 +6999,482 @@ int main(int argc, const char* const* argv) {
 	else if(strcmp(argv[1], "get") == 0) op = OP_GET;
 	else if(strcmp(argv[1], "keys") == 0) op = OP_KEYS;
 	else if(strcmp(argv[1], "set") == 0) op = OP_SET;
+	else if(strcmp(argv[1], "set-many") == 0) op = OP_SET_MANY;
+	else if(strcmp(argv[1], "merge") == 0) op = OP_MERGE;
+	else if(strcmp(argv[1], "patch") == 0) op = OP_PATCH;
+	else if(strcmp(argv[1], "aggregate") == 0) op = OP_AGGREGATE;
 	else if(strcmp(argv[1], "splice") == 0) op = OP_SPLICE;
 	else if(strcmp(argv[1], "decode-string") == 0) op = OP_DECODE_STRING;
 	else if(strcmp(argv[1], "encode-string") == 0) op = OP_ENCODE_STRING;
 	else if(strcmp(argv[1], "encode-key") == 0) op = OP_ENCODE_KEY;
+	else if(strcmp(argv[1], "compile") == 0) op = OP_COMPILE;
+	else if(strcmp(argv[1], "batch") == 0) op = OP_BATCH;
+	else if(strcmp(argv[1], "serve") == 0) op = OP_SERVE;
 	else {
-		fprintf(stderr, "%s: Invalid action %s\n", argv[0], argv[1]);
+		fprintf(errors, "%s: Invalid action %s\n", argv[0], argv[1]);
 	}
 
 
-	// read stdin for these actions and parse as JSON if needed
-	if(op == OP_CHECK || op == OP_VALUE || op == OP_TYPE || op == OP_GET || op == OP_KEYS || // read operations
-	   op == OP_SET || op == OP_SPLICE || // write operation
-	   op == OP_DECODE_STRING || op == OP_ENCODE_STRING /* || op == OP_ENCODE_KEY */ // utils
-	   ) {
-
-		int r;
-		while(r = read(0, stdin_buffer.content + stdin_buffer.length, stdin_buffer.size - stdin_buffer.length)) {
-			if(r < 0) {
-				fprintf(stderr, "%s: Error reading stdin: (%d) %s\n", argv[0], errno, strerror(errno));
-				exit(1);
-			}
+	// arguments are checked before any input is read
+	size_t index = op == OP_SPLICE ? SIZE_MAX : 0, count = 0;
 
-			stdin_buffer.length += r;
-			if(stdin_buffer.length >= stdin_buffer.size)
-				stdin_buffer.content = realloc(stdin_buffer.content, stdin_buffer.size *= 2);
+	if((op == OP_VALUE || op == OP_SPLICE) && argc >= 3) {
+		const char* end = argv[2];
+		errno = 0;
+		index = strtoumax(argv[2], (char**)&end, 0);
+		if(argv[2][0] == '-' || *end != '\0' || end == argv[2] || errno != 0) {
+			fprintf(errors, "%s: Invalid index\n", argv[0]);
+			goto fail;
 		}
 	}
 
-
-	if(op == OP_CHECK) {
-		struct json_value* json_in;
-		size_t length = 2;
-
-		const char* start = stdin_buffer.content;
-		const char* end = start + stdin_buffer.length;
-		if(parse_input(&start, end, &json_in, &length) || length != 1) {
-			printf("ERROR");
+	if(op == OP_SPLICE && argc >= 4) {
+		const char* end = argv[3];
+		errno = 0;
+		count = strtoumax(argv[3], (char**)&end, 0);
+		if(argv[3][0] == '-' || *end != '\0' || end == argv[3] || errno != 0) {
+			fprintf(errors, "%s: Invalid element count\n", argv[0]);
+			goto fail;
 		}
 	}
 
+	if(op == OP_GET || op == OP_SET) {
 
-	if(op == OP_VALUE) {
-		struct json_value* json_in;
-		size_t index = 0;
-
-		if(argc >= 3) {
-			const char* end = argv[2];
-			index = strtoumax(argv[2], (char**)&end, 0);
-			if(argv[2][0] == '-' || *end != '\0' || end == argv[2] || errno != 0) {
-				fprintf(stderr, "%s: Invalid index\n", argv[0]);
-				exit(1);
-			}
+		if(argc < 3) {
+			fprintf(errors, "Usage: %s %s pathname\n", argv[0], argv[1]);
+			goto fail;
 		}
 
-		const char* start = stdin_buffer.content;
-		const char* end = start + stdin_buffer.length;
-		size_t length = index + 1;
-		if(!parse_input(&start, end, &json_in, &length) && index < length) {
-			print_value(&json_in[index], 0);
+		if(pointer ? parse_pointer(argv[2], &path) : parse_path(argv[2], &path)) {
+			fprintf(errors, "%s: Invalid path %s for action %s\n", argv[0], argv[2], argv[1]);
+			goto fail;
 		}
-	}
 
-
-	if(op == OP_TYPE) {
-		struct json_value* json_in;
-		size_t length = 1;
-
-		const char* start = stdin_buffer.content;
-		if(parse_input(&start, start + stdin_buffer.length, &json_in, &length) || length < 1) {
-			fprintf(stderr, "%s: Invalid input\n", argv[0]);
-			exit(1);
+		// formatting of the whole document is not kept
+		if(op == OP_SET && preserve_format && path.length == 0) {
+			fprintf(errors, "%s: Option --preserve-format cannot be used with empty path\n", argv[0]);
+			goto fail;
 		}
+	}
 
-		switch(json_in->type) {
-		case JSON_TYPE_OBJECT:
-			printf("object");
-			break;
-		case JSON_TYPE_ARRAY:
-			printf("array");
-			break;
-		case JSON_TYPE_STRING:
-			printf("string");
-			break;
-		case JSON_TYPE_NUMBER:
-			printf("number");
-			break;
-		case JSON_TYPE_BOOLEAN:
-			printf("boolean");
-			break;
-		case JSON_TYPE_NULL:
-			printf("null");
-			break;
-		default:
-			assert(0);
-		}
+
+	if(group_by && op != OP_AGGREGATE) {
+		fprintf(errors, "%s: Option --group-by requires aggregate action\n", argv[0]);
+		goto fail;
 	}
 
+	aggregate_init(&aggregate, &value_path, group_by ? &group_path : NULL);
 
-	if(op == OP_GET) {
+	if(op == OP_AGGREGATE) {
+		// lines are the records, so there is no array path
+		int value_argument = lines_mode ? 2 : 3;
 
-		struct path path;
-		struct json_value* json_in;
-		size_t length = 1;
+		if(argc > value_argument + 1) {
+			fprintf(errors, "Usage: %s %s%s [value-pathname]\n", argv[0], argv[1], lines_mode ? "" : " [pathname]");
+			goto fail;
+		}
 
-		if(argc < 3) {
-			fprintf(stderr, "Usage: %s %s pathname\n", argv[0], argv[1]);
-			exit(1);
+		// empty pathname is the input value itself, so value path can be given for top-level array
+		if(!lines_mode && argc > 2 && argv[2][0] && (pointer ? parse_pointer(argv[2], &path) : parse_path(argv[2], &path))) {
+			fprintf(errors, "%s: Invalid path %s for action %s\n", argv[0], argv[2], argv[1]);
+			goto fail;
 		}
 
-		if(parse_path(argv[2], &path)) {
-			fprintf(stderr, "%s: Invalid path %s for action %s\n", argv[0], argv[2], argv[1]);
-			exit(1);
+		if(argc > value_argument && (pointer ? parse_pointer(argv[value_argument], &value_path) : parse_path(argv[value_argument], &value_path))) {
+			fprintf(errors, "%s: Invalid path %s for action %s\n", argv[0], argv[value_argument], argv[1]);
+			goto fail;
 		}
 
-		const char* start = stdin_buffer.content;
-		if(parse_input(&start, start + stdin_buffer.length, &json_in, &length) || length < 1) {
-			fprintf(stderr, "%s: Invalid input\n", argv[0]);
-			exit(1);
+		if(group_by && (pointer ? parse_pointer(group_by, &group_path) : parse_path(group_by, &group_path))) {
+			fprintf(errors, "%s: Invalid path %s for option --group-by\n", argv[0], group_by);
+			goto fail;
 		}
+	}
 
-		const struct json_value* resolved_value;
-		int r = json_resolve_path(json_in, &path, &resolved_value);
 
-		if(r == path.length) {
-			print_value(resolved_value, 0);
+	// every line of input is a separate document, values for set and splice are given as arguments
+	if(lines_mode && op != OP_UNKNOWN) {
+
+		if(op == OP_ENCODE_KEY || op == OP_COMPILE || op == OP_BATCH || op == OP_SERVE) {
+			fprintf(errors, "%s: Action %s cannot be used with --lines\n", argv[0], argv[1]);
+			goto fail;
 		}
-	}
 
+		struct json_value unset = { .type = JSON_TYPE_UNDEFINED };
+		struct json_value* values = NULL;
+		size_t values_length = 0;
 
-	if(op == OP_SET) {
+		// values from arguments are inserted into every record, so they must not be changed in place
+		parser.shared = 1;
 
-		struct path path;
-		struct json_value* json_in;
-		struct json_value* value;
-		size_t length = 2;
+		if(op == OP_SET || op == OP_SPLICE || op == OP_SET_MANY || op == OP_MERGE || op == OP_PATCH) {
+			int first = op == OP_SET ? 3 : op == OP_SPLICE ? 4 : 2;
 
-		if(argc < 3) {
-			fprintf(stderr, "Usage: %s %s pathname\n", argv[0], argv[1]);
-			exit(1);
-		}
+			if(op == OP_SET && argc > 4) {
+				fprintf(errors, "Usage: %s --lines %s pathname [value]\n", argv[0], argv[1]);
+				goto fail;
+			}
 
-		if(parse_path(argv[2], &path)) {
-			fprintf(stderr, "%s: Invalid path %s for action %s\n", argv[0], argv[2], argv[1]);
-			exit(1);
-		}
+			if(op == OP_SET_MANY && argc != 3) {
+				fprintf(errors, "Usage: %s --lines %s assignments\n", argv[0], argv[1]);
+				goto fail;
+			}
 
-		const char* start = stdin_buffer.content;
-		if(parse_input(&start, start + stdin_buffer.length, &json_in, &length) || length < 1) {
-			fprintf(stderr, "%s: Invalid input\n", argv[0]);
-			exit(1);
-		}
+			if((op == OP_MERGE || op == OP_PATCH) && argc != 3) {
+				fprintf(errors, "Usage: %s --lines %s patch\n", argv[0], argv[1]);
+				goto fail;
+			}
 
-		if(length < 2) {
-			value = malloc(sizeof(struct json_value));
-			value->type = JSON_TYPE_UNDEFINED;
-		} else {
-			value = &json_in[1];
-		}
+			if(argc > first) values = arena_alloc(&arena, (argc - first) * sizeof(struct json_value));
+
+			int i;
+			for(i = first; i < argc; i++) {
+				const char* start = argv[i];
+				struct json_value* value;
+				size_t length = 0;
 
-		struct json_value* resolved_value;
+				if(parse_input(&parser, &start, start + strlen(start), &value, &length) || length != 1) {
+					fprintf(errors, "%s: Invalid value %s\n", argv[0], argv[i]);
+					goto fail;
+				}
+
+				values[values_length++] = *value;
+			}
 
-		path.length--;
+			if(op == OP_SET && values_length == 0) {
+				values = &unset;
+				values_length = 1;
+			}
 
-		if(json_resolve_path(json_in, &path, (const struct json_value**)&resolved_value) == path.length) {
+			if(op == OP_SET_MANY) {
+				if(values->type != JSON_TYPE_OBJECT) {
+					fprintf(errors, "%s: Expected JSON object with assignments %s\n", argv[0], argv[2]);
+					goto fail;
+				}
 
-			if(resolved_value->type == JSON_TYPE_OBJECT) {
-				json_object_set(&resolved_value->value.object, &path.components[path.length], value, NULL);
+				assignment_paths = parse_assignments(&values->value.object, pointer);
+				assignments_length = values->value.object.length;
+				if(assignment_paths == NULL) {
+					fprintf(errors, "%s: %s\n", argv[0], action_error_messages[ACTION_INVALID_PATH]);
+					goto fail;
+				}
 			}
 
-			if(resolved_value->type == JSON_TYPE_ARRAY) {
-				size_t index;
-				if(!json_string_to_index(&path.components[path.length], &index)) {
-					json_array_set(&resolved_value->value.array, index, value, NULL);
+			if(op == OP_PATCH) {
+				patch_operations = parse_patch(values, &patch_length);
+				if(patch_operations == NULL) {
+					fprintf(errors, "%s: Invalid JSON patch %s\n", argv[0], argv[2]);
+					goto fail;
 				}
 			}
 		}
 
-		print_value(json_in, 0);
-	}
-
+		int fd = files->in;
 
-	if(op == OP_KEYS) {
+		if(input_path) {
+			fd = openat(files->dir, input_path, O_RDONLY);
+			if(fd < 0) {
+				fprintf(errors, "%s: Error opening %s: (%d) %s\n", argv[0], input_path, errno, strerror(errno));
+				goto fail;
+			}
+		}
 
-		struct json_value* json_in;
-		size_t length = 1;
+		// records are parsed into their own arena, so it can be reset without losing values from arguments
+		struct arena record_arena = { .chunk = NULL, .chunk_size = ARENA_CHUNK_SIZE, .huge_pages = arena.huge_pages };
+		struct json_parser record_parser = { .arena = &record_arena, .index = malloc(sizeof(struct json_index)), .max_depth = parser.max_depth };
+		struct lines lines = {
+			.program_name = argv[0], .errors = errors, .op = op, .out = &output, .parser = &record_parser,
+			.path = &path, .index_argument = index, .count = count, .values = values, .values_length = values_length,
+			.paths = assignment_paths, .operations = patch_operations, .operations_length = patch_length,
+			.aggregate = op == OP_AGGREGATE ? &aggregate : NULL,
+		};
+
+		int r = jobs > 1 ? run_lines_parallel(&lines, fd, jobs, ordered) : run_lines(&lines, fd);
+
+		json_parser_free(&record_parser);
+		free(record_parser.index);
+		arena_free(&record_arena);
+		if(input_path) close(fd);
+
+		if(r < 0) {
+			fprintf(errors, "%s: Error reading %s: (%d) %s\n", argv[0], input_path ? input_path : "stdin", errno, strerror(errno));
+			goto fail;
+		}
 
-		const char* start = stdin_buffer.content;
-		if(parse_input(&start, start + stdin_buffer.length, &json_in, &length) || length < 1) {
-			fprintf(stderr, "%s: Invalid input\n", argv[0]);
-			exit(1);
+		// aggregate of all records is printed once they are read
+		if(op == OP_AGGREGATE) {
+			aggregate_print(&arena, &aggregate, &output);
+			output_char(&output, '\n');
 		}
 
-		if(json_in->type != JSON_TYPE_OBJECT) {
-			fprintf(stderr, "%s: Expected JSON object as input\n", argv[0]);
-			exit(1);
+		status = r;
+		goto end;
+	}
+
+
+	if(op == OP_CHECK) {
+		int fd = files->in;
+		enum json_error error;
+
+		if(input_path) {
+			fd = openat(files->dir, input_path, O_RDONLY);
+			if(fd < 0) {
+				fprintf(errors, "%s: Error opening %s: (%d) %s\n", argv[0], input_path, errno, strerror(errno));
+				goto fail;
+			}
 		}
 
-		struct json_object* object = &json_in->value.object;
+		int r = check_input(fd, parser.max_depth, &error);
+		if(input_path) close(fd);
 
-		int i;
-		for(i = 0; i < object->length; i++) {
-			print_string(&object->keys[i]);
-			printf("\n");
+		if(r) {
+			fprintf(errors, "%s: Error reading %s: (%d) %s\n", argv[0], input_path ? input_path : "stdin", errno, strerror(errno));
+			goto fail;
+		}
+
+		if(error) {
+			output_string(&output, "ERROR");
 		}
 	}
 
 
-	if(op == OP_SPLICE) {
+	enum action_error error = ACTION_OK;
+	int streamed = 0; // action was run while input was read
 
-		struct json_value* json_in;
-		size_t length = 0;
+	// read stdin for these actions and parse as JSON if needed
+	if(op == OP_VALUE || op == OP_TYPE || op == OP_GET || op == OP_KEYS || // read operations
+	   op == OP_SET || op == OP_SET_MANY || op == OP_MERGE || op == OP_PATCH || op == OP_SPLICE || op == OP_BATCH || // write operation
+	   op == OP_AGGREGATE ||
+	   op == OP_DECODE_STRING || op == OP_ENCODE_STRING || op == OP_COMPILE /* || op == OP_ENCODE_KEY */ // utils
+	   ) {
 
-		size_t index = SIZE_MAX, count = 0;
+		int fd = files->in;
 
-		errno = 0;
-		if(argc >= 3) {
-			const char* end = argv[2];
-			index = strtoumax(argv[2], (char**)&end, 0);
-			if(argv[2][0] == '-' || *end != '\0' || end == argv[2] || errno != 0) {
-				fprintf(stderr, "%s: Invalid index\n", argv[0]);
-				exit(1);
+		if(input_path) {
+			fd = openat(files->dir, input_path, O_RDONLY);
+			if(fd < 0) {
+				fprintf(errors, "%s: Error opening %s: (%d) %s\n", argv[0], input_path, errno, strerror(errno));
+				goto fail;
 			}
 		}
 
-		if(argc >= 4) {
-			const char* end = argv[3];
-			count = strtoumax(argv[3], (char**)&end, 0);
-			if(argv[3][0] == '-' || *end != '\0' || end == argv[3] || errno != 0) {
-				fprintf(stderr, "%s: Invalid element count\n", argv[0]);
-				exit(1);
-			}
+		int r;
+		struct stat st;
+		// original text is needed to preserve formatting
+		if(cache && op != OP_ENCODE_STRING && !(preserve_format && (op == OP_SET || op == OP_SPLICE))) {
+			cached = cache_load(cache, fd, arena.huge_pages, parser.max_depth);
+			r = cached ? 0 : -1;
+		} else if(op == OP_AGGREGATE && !input_mappable(fd, &st)) {
+			// input that cannot be mapped is not read into memory whole
+			r = action_aggregate_stream(&parser, &output, fd, &path, &aggregate, &error);
+			streamed = 1;
+		} else {
+			r = read_input(fd, &stdin_buffer, &stdin_mapped);
 		}
 
-		const char* start = stdin_buffer.content;
-		if(parse_input(&start, start + stdin_buffer.length, &json_in, &length) || length < 1) {
-			fprintf(stderr, "%s: Invalid input\n", argv[0]);
-			exit(1);
+		if(input_path) close(fd);
+
+		if(r) {
+			fprintf(errors, "%s: Error reading %s: (%d) %s\n", argv[0], input_path ? input_path : "stdin", errno, strerror(errno));
+			goto fail;
 		}
 
-		if(json_in->type != JSON_TYPE_ARRAY) {
-			fprintf(stderr, "%s: Expected JSON array as input\n", argv[0]);
-			exit(1);
+		if(!cached && !streamed && op != OP_ENCODE_STRING) {
+			parser.index = malloc(sizeof(struct json_index));
+			json_index_init(parser.index, stdin_buffer.content, stdin_buffer.content + stdin_buffer.length);
 		}
 
-		length--;
+		input.content = stdin_buffer.content;
+		input.length = stdin_buffer.length;
+		input.cached = cached;
 
-		struct json_array* array = &json_in->value.array;
+		// compiled input is queried in place, only actions that read values support it
+		const struct buffer* content = cached ? &cached->input : &stdin_buffer;
+		if(op != OP_ENCODE_STRING && !streamed && tape_detect(content->content, content->length)) {
+			if(op != OP_VALUE && op != OP_TYPE && op != OP_GET && op != OP_KEYS) {
+				fprintf(errors, "%s: Action %s cannot be used with compiled input\n", argv[0], argv[1]);
+				goto fail;
+			}
 
-		if(index >= array->length) {
-			count = 0;
-			index = array->length;
-		} else if(index + count >= array->length) {
-			count = array->length - index;
-		}
+			if(tape_open(content->content, content->length, &tape)) {
+				fprintf(errors, "%s: %s\n", argv[0], action_error_messages[ACTION_INVALID_TAPE]);
+				goto fail;
+			}
 
-		size_t new_size = array->length + length - count;
-		if(array->length < new_size) {
-			array->values = realloc(array->values, new_size * sizeof(struct json_value));
-		}
+			// lookups only touch pages they need
+			if(cached ? cached->mapped : stdin_mapped) madvise((void*)content->content, content->length, MADV_RANDOM);
 
-		size_t shift_dst = index + length;
-		size_t shift_src = index + count;
-		if(shift_src != shift_dst) {
-			size_t shift_count = array->length - shift_src;
-			memmove(&array->values[shift_dst], &array->values[shift_src], shift_count * sizeof(struct json_value));
+			input.tape = &tape;
 		}
+	}
 
-		if(length) {
-			memcpy(&array->values[index], &json_in[1], length * sizeof(struct json_value));
-		}
 
-		array->length = new_size;
+	if(op == OP_VALUE) error = action_value(&parser, &output, &input, index);
+	else if(op == OP_TYPE) error = action_type(&parser, &output, &input);
+	else if(op == OP_GET) error = action_get(&parser, &output, &input, &path);
+	else if(op == OP_SET && preserve_format) error = action_edit_set(&parser, &output, &input, &path);
+	else if(op == OP_SET) error = action_set(&parser, &output, &input, &path, NULL);
+	else if(op == OP_SET_MANY) error = action_set_many(&parser, &output, &input, NULL, NULL, pointer);
+	else if(op == OP_MERGE) error = action_merge(&parser, &output, &input, NULL);
+	else if(op == OP_PATCH) error = action_patch(&parser, &output, &input, NULL, 0);
+	else if(op == OP_AGGREGATE && !streamed) error = action_aggregate(&parser, &output, &input, &path, &aggregate);
+	else if(op == OP_KEYS) error = action_keys(&parser, &output, &input, 0);
+	else if(op == OP_SPLICE && preserve_format) error = action_edit_splice(&parser, &output, &input, index, count);
+	else if(op == OP_SPLICE) error = action_splice(&parser, &output, &input, index, count, NULL, 0);
+	else if(op == OP_DECODE_STRING) error = action_decode_string(&parser, &output, &input);
+	else if(op == OP_COMPILE) error = action_compile(&parser, &output, &input);
+
+	if(error) {
+		fprintf(errors, "%s: %s\n", argv[0], action_error_messages[error]);
+		goto fail;
+	}
 
-		print_array(array, 0);
+	if(op == OP_ENCODE_STRING) {
+		if(json_encode_string((unsigned char*)stdin_buffer.content, stdin_buffer.length, &output.buffer)) {
+			output.buffer.length = 0;
+			goto fail;
+		}
+		output_check(&output);
 	}
 
 
-	if(op == OP_DECODE_STRING) {
+	if(op == OP_BATCH) {
 
 		struct json_value* json_in;
 		size_t length = 1;
-		const char* start = stdin_buffer.content;
-		if(parse_input(&start, start + stdin_buffer.length, &json_in, &length) || length < 1) {
-			fprintf(stderr, "%s: Invalid input\n", argv[0]);
-			exit(1);
-		}
 
-		if(json_in->type != JSON_TYPE_STRING) {
-			fprintf(stderr, "%s: Expected JSON string as input\n", argv[0]);
-			exit(1);
+		if(load_input(&parser, &input, &json_in, &length) || length < 1) {
+			fprintf(errors, "%s: Invalid input\n", argv[0]);
+			goto fail;
 		}
 
-		printf("%.*s", (unsigned int)json_in->value.string.length, json_in->value.string.content);
-	}
+		struct json_value root = *json_in;
+		struct batch batch = { .program_name = argv[0], .errors = errors, .arena = &arena, .out = &output, .root = &root, .shared = cached != NULL, .pointer = pointer };
 
+		// values set by script point into its content, so scripts are released after the whole batch
+		struct buffer* scripts = malloc(argc * sizeof(struct buffer));
+		int* scripts_mapped = malloc(argc * sizeof(int));
+		size_t scripts_length = 0;
+		int script_error = 0;
 
-	if(op == OP_ENCODE_STRING) {
-		struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
-		json_encode_string((unsigned char*)stdin_buffer.content, stdin_buffer.length, &buffer);
+		int i;
+		for(i = 2; i < argc; i++) {
+			if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+				i++;
+
+				int fd = openat(files->dir, argv[i], O_RDONLY);
+				if(fd < 0 || read_input(fd, &scripts[scripts_length], &scripts_mapped[scripts_length])) {
+					fprintf(errors, "%s: Error reading %s: (%d) %s\n", argv[0], argv[i], errno, strerror(errno));
+					if(fd >= 0) close(fd);
+					script_error = 1;
+					break;
+				}
+				close(fd);
+
+				const struct buffer* script = &scripts[scripts_length++];
+				if(run_batch_script(&batch, script->content, script->length)) status = 1;
+			} else {
+				if(run_batch_operation(&batch, argv[i], strlen(argv[i]))) status = 1;
+			}
+		}
+
+		while(scripts_length > 0) {
+			scripts_length--;
+			release_input(&scripts[scripts_length], scripts_mapped[scripts_length]);
+		}
+		free(scripts);
+		free(scripts_mapped);
 
-		printf("%.*s", (unsigned int)buffer.length, buffer.content);
+		if(script_error) goto fail;
 	}
 
 
 	if(op == OP_ENCODE_KEY) {
 		if(argc < 3) {
-			fprintf(stderr, "Usage %s %s pathcomponent Missing argument action\n", argv[0], argv[1]);
-			exit(1);
+			fprintf(errors, "Usage %s %s pathcomponent Missing argument action\n", argv[0], argv[1]);
+			goto fail;
 		}
 
 		const char* arg = argv[2];
 
-		struct buffer buffer = { .content = NULL, .length = 0, .size = 0 };
 		while(*arg != '\0') {
 			if(*arg == '.' || *arg == '\\')
-				buffer_append(&buffer, "\\", 1);
-			buffer_append(&buffer, arg, 1);
+				output_char(&output, '\\');
+			output_char(&output, *arg);
 			arg++;
 		}
-		printf("%.*s", (unsigned int)buffer.length, buffer.content);
 	}
 
-	return 0;
+	if(op == OP_SERVE) {
+		size_t limit = CACHE_DEFAULT_LIMIT;
+
+		// server is never started by another server
+		if(cache) {
+			status = -1;
+			goto end;
+		}
+
+		if(argc < 3) {
+			fprintf(errors, "Usage: %s %s socket [cache-size]\n", argv[0], argv[1]);
+			goto fail;
+		}
+
+		if(argc >= 4) {
+			const char* end = argv[3];
+			errno = 0;
+			uintmax_t megabytes = strtoumax(argv[3], (char**)&end, 10);
+			if(argv[3][0] == '-' || *end != '\0' || end == argv[3] || errno != 0 || megabytes > SIZE_MAX >> 20) {
+				fprintf(errors, "%s: Invalid cache size %s\n", argv[0], argv[3]);
+				goto fail;
+			}
+			limit = megabytes << 20;
+		}
+
+		status = serve(argv[0], argv[2], limit);
+	}
+
+	goto end;
+
+ fail:
+
+	status = 1;
+
+ end:
+
+	output_free(&output);
+	if(output.error) {
+		fprintf(errors, "%s: Error writing output: (%d) %s\n", argv[0], output.error, strerror(output.error));
+		status = 1;
+	}
+	if(output.invalid) status = 1;
+
+	fflush(errors);
+
+	if(cached) cache_release(cache, cached);
+	path_free(&path);
+	path_free(&value_path);
+	path_free(&group_path);
+	aggregate_free(&aggregate);
+	if(assignment_paths) paths_free(assignment_paths, assignments_length);
+	if(patch_operations) patch_free(patch_operations, patch_length);
+	json_parser_free(&parser);
+	free(parser.index);
+	arena_free(&arena);
+	if(!cached) release_input(&stdin_buffer, stdin_mapped);
+
+	return status;
+}
+
+
+int main(int argc, const char* const* argv) {
+	const char* server = getenv("JSON_UTIL_SERVER");
+
+	if(server && *server) {
+		int status = client(server, argc, argv);
+		if(status >= 0) return status;
+	}
+
+	struct run_files files = { .in = 0, .out = 1, .errors = stderr, .dir = AT_FDCWD };
+
+	return run(NULL, &files, argc, argv);
 }